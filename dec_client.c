@@ -1,13 +1,13 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>  // ssize_t
 #include <sys/socket.h> // send(),recv()
-#include <netdb.h>      // gethostbyname()
 #include <arpa/inet.h>  // inet_pton()
 
-#define LOCALHOST "127.0.0.1"
+#include "otp_client.h"
 
 /*
 * Client code
@@ -15,129 +15,144 @@
 * 2. Sends the verification, key, and message to the server, and recieves the decrypted message back.
 */
 
-// Set up the address struct
-void setupAddressStruct(struct sockaddr_in* address, int portNumber)
-{
-    // Clear out the address struct
-    memset((char*) address, '\0', sizeof(*address)); 
-
-    // The address should be network capable
-    address->sin_family = AF_INET;
-    // Store the port number
-    address->sin_port = htons(portNumber);
-    //printf("\nport is: %d\n", portNumber);
-
-    // Convert IP address from text to binary (Citation: Adapted from lecture #13 slides - Sockets)
-    if (inet_pton(AF_INET, LOCALHOST, &address->sin_addr) <= 0) {
-        fprintf(stderr, "DEC_CLIENT: Invalid address, address not supported.\n"); 
-        exit(1); 
-    }
-}
-
 int main(int argc, char *argv[]) {
-    int socketFD, portNumber, charsWritten, charsRead;
-    struct sockaddr_in serverAddress;
-    char buffer[100000];
-    // Check usage & args
-    if (argc < 3) { 
-        fprintf(stderr,"USAGE: %s hostname port\n", argv[0]); 
-        exit(0); 
-    } 
+    int socketFD;
+    struct client_config cfg = {
+        .name = "DEC_CLIENT",
+        .client_name = "dec_client",
+        .opcode = OTP_OP_DECRYPT,
+        .key_offset = OTP_KEY_NEXT,
+    };
 
-    // Get input message from user
-    FILE *ciphertext = fopen(argv[1], "r");
-    // Clear out the buffer array
-    memset(buffer, '\0', sizeof(buffer));
-    // Get input from the user, trunc to buffer - 1 chars, leaving \0
-    int input_length = fread(buffer, sizeof(char), sizeof(buffer), ciphertext);
-    buffer[strcspn(buffer, "\n")] = '|';  // Remove the trailing \n that fgets adds and replace with | (terminating char)
-    input_length--;
-    fclose(ciphertext);
-
-    // Get the key out of the key file and make sure it's equal to or longer than the message
-    FILE *key_file = fopen(argv[2], "r");
-    char key[100000];
-    int key_length = fread(key, sizeof(char), sizeof(key), key_file);
-    key[strcspn(key, "\n")] = '|';  // Remove the trailing \n that fgets adds
-    key_length--;
-    fclose(key_file);
-    //printf("input is %d, key is %d\n", input_length, key_length);
-    if (key_length < input_length)
-    {
-        fprintf(stderr, "DEC_CLIENT: Key length is too short\n");
+    // Check usage & args
+    const char* manifest_path = NULL;
+    int inflight = BATCH_DEFAULT_INFLIGHT;
+    int opt;
+    int bad = 0;
+    while ((opt = getopt(argc, argv, "LPSsmko:b:j:")) != -1) {
+        switch (opt) {
+        case 'L':
+            cfg.legacy = 1;
+            break;
+        case 'P':
+            cfg.packed = 1;
+            break;
+        case 'S':
+            cfg.shared = 1;
+            break;
+        case 's':
+            cfg.stream = 1;
+            break;
+        case 'm':
+            cfg.session = 1;
+            break;
+        case 'k':
+            cfg.keyref = 1;
+            break;
+        case 'o':
+            cfg.key_offset = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            manifest_path = optarg;
+            break;
+        case 'j':
+            inflight = atoi(optarg);
+            break;
+        default:
+            bad = 1;
+            break;
+        }
+    }
+    if (bad || inflight < 1 || argc - optind != (manifest_path != NULL ? 1 : 3)) {
+        fprintf(stderr,"USAGE: %s ciphertext key port|socket [-L] [-P] [-S] [-s] [-m] [-k [-o offset]]\n", argv[0]);
+        fprintf(stderr,"       %s -b manifest [-j requests] [-P] port|socket\n", argv[0]);
         exit(1);
     }
 
-    // Output error and exit if the ciphertext or key has ANY invalid characters
-    char invalid_chars[50] = "`1234567890-=[]\\;',./~!@#$%^&*()_+{}:\"<>?";
-    if (strcspn(buffer, invalid_chars) != strlen(buffer) || 
-        strcspn(key, invalid_chars) != strlen(key))
-    {
-        fprintf(stderr, "DEC_CLIENT: file \"%s\" contains invalid characters\n", argv[1]);
-        exit(1); 
+    // With -b every "input key output" line of the manifest is its own job,
+    // run over a few connections that are reused for the whole batch
+    if (manifest_path != NULL) {
+        return runBatch(&cfg, manifest_path, clientServerArg(&cfg, argv[optind]), inflight);
     }
-
-    // Create a socket
-    socketFD = socket(AF_INET, SOCK_STREAM, 0); 
-    if (socketFD < 0){
-        fprintf(stderr, "DEC_CLIENT: ERROR opening socket\n");
+    const char* input_path = argv[optind];
+    const char* key_path = argv[optind + 1];
+    // A path in place of the port is the server's Unix domain socket
+    int portNumber = clientServerArg(&cfg, argv[optind + 2]);
+    if (cfg.shared && cfg.socket_path == NULL) {
+        fprintf(stderr, "%s: -S needs the server's socket path in place of the port\n", cfg.name);
         exit(1);
     }
 
-    // Set up the server address struct
-    setupAddressStruct(&serverAddress, atoi(argv[3]));
+    // With -m every line is its own message, all sent over one connection
+    if (cfg.session) {
+        return runSession(&cfg, input_path, key_path, portNumber);
+    }
 
-    // Connect to server
-    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
-        fprintf(stderr, "DEC_CLIENT: ERROR connecting\n");
-        exit(1);
+    // With -S the files are read into memory shared with the server, so a
+    // message of any size goes in one request
+    if (cfg.shared) {
+        runShared(&cfg, input_path, key_path, portNumber);
+        return 0;
     }
 
-    // Inform the server that dec_client is trying to connect (this is valid)
-    int verify = send(socketFD, "dec_client|", 11, 0);
+    // Messages longer than the servers take in one request are streamed through
+    // them, and so is input from a pipe, whose length is not known until all
+    // of it has been read, unless the request cannot be streamed
+    struct stat input_stat;
+    if (stat(input_path, &input_stat) == 0 && (input_stat.st_size >= SESSION_MAX_LINE ||
+        (!S_ISREG(input_stat.st_mode) && !cfg.legacy && !cfg.keyref))) {
+        cfg.stream = 1;
+    }
+    if (cfg.stream) {
+        runStream(&cfg, input_path, key_path, portNumber);
+        return 0;
+    }
 
-    // Send the ciphertext message to server
-    // Write to the server (if the full message isn't send, keep sending fragments until it is fully sent over)
-    int chars_written = 0;
-    int total_written = 0;
-    size_t message_length = strlen(buffer);
-    while (total_written < message_length)
-    {
-        // Write the amount of characters that are left to write
-        chars_written = send(socketFD, buffer + total_written, message_length - total_written, 0);
-        if (chars_written < 0) {
-            fprintf(stderr, "DEC_CLIENT: ERROR writing to socket\n");
-            exit(1);
-        }
-        total_written += chars_written;
+    // Map the message and make sure it has no invalid characters, in one pass,
+    // so it is sent straight from the page cache rather than copied in first
+    size_t message_map_len, message_length;
+    const char* message = mapMessage(&cfg, input_path, SESSION_MAX_LINE, 1, &message_map_len, &message_length);
+
+    // With -k the key argument names a pad on the server, and only that name
+    // and an offset are sent instead of the key itself
+    if (cfg.keyref) {
+        runKeyRef(&cfg, message, message_length, key_path, portNumber);
+        return 0;
     }
 
-    // Send the key to the server
-    chars_written, total_written = 0;
-    key_length = strlen(key);
-    while (total_written < key_length)
+    // Only as much of the key as the message uses is mapped and checked
+    size_t key_map_len, key_length;
+    const char* key = mapMessage(&cfg, key_path, message_length, 0, &key_map_len, &key_length);
+    // Terminate if the key is shorter than the user's ciphertext
+    if (key_length < message_length)
     {
-        // Write the amount of characters that are left to write
-        chars_written = send(socketFD, key + total_written, key_length - total_written, 0);
-        if (chars_written < 0) {
-            fprintf(stderr, "DEC_CLIENT: ERROR writing to socket\n");
-            exit(1);
-        }
-        total_written += chars_written;
+        fprintf(stderr, "DEC_CLIENT: Key length is too short\n");
+        exit(1);
     }
 
-    // Get return message from server
-    // Clear out the buffer again for reuse
-    memset(buffer, '\0', sizeof(buffer));
-    // Read data from the socket, leaving \0 at end
-    charsRead = recv(socketFD, buffer, sizeof(buffer) - 1, 0); 
-    if (charsRead < 0){
-        fprintf(stderr, "DEC_CLIENT: ERROR reading from socket using port %s\n", argv[3]);
-        exit(2);
+    // Try the length-prefixed version 2 protocol first and fall back to the
+    // original protocol if the server hangs up without answering it. The
+    // reply is never longer than the message, and leaves with its newline in
+    // one write rather than through stdio
+    char* reply = malloc(message_length + 1);
+    if (reply == NULL) {
+        fprintf(stderr, "DEC_CLIENT: out of memory\n");
+        exit(1);
     }
-    printf("%s\n", buffer);
-
-    // Close the socket
-    close(socketFD); 
+    ssize_t reply_length = -1;
+    if (!cfg.legacy) {
+        socketFD = connectServer(portNumber, &cfg);
+        reply_length = requestV2(socketFD, &cfg, message, message_length, key,
+                                 reply, message_length);
+        close(socketFD);
+    }
+    if (reply_length < 0) {
+        socketFD = connectServer(portNumber, &cfg);
+        reply_length = requestLegacy(socketFD, &cfg, message, message_length,
+                                     key, key_length, reply, message_length);
+        close(socketFD);
+    }
+    reply[reply_length] = '\n';
+    writeAll(STDOUT_FILENO, reply, reply_length + 1, &cfg);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,44 +1,209 @@
 /*
 * Name: Christian DeVore
-* Description: Generates a key of specified lenght containing all alphabet 
+* Description: Generates a key of specified lenght containing all alphabet
 * characters (A-Z), including spaces (" ").
+* The key comes from ChaCha20 seeded by getrandom(), so it is fit for a
+* one-time pad (see otp_keygen.h). The key is generated in fixed-size
+* chunks by a pool of threads and written out in order, so memory use does
+* not grow with the length of the key.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
 
-int main(int argc, char *argv[]) 
+#include "otp_keygen.h"
+
+#define CHUNK_SYMBOLS (1 << 20)     // Symbols generated per unit of work
+#define SLOTS_PER_THREAD 2          // Chunk buffers per thread, so writing overlaps generating
+
+// Shared state of the generator threads and the writer
+struct generator {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // Broadcast whenever a chunk is filled or written
+    size_t length;              // Symbols in the whole key
+    uint64_t chunks;            // Chunks in the whole key
+    uint64_t next;              // Next chunk a thread will claim
+    uint64_t written;           // Chunks already written out
+    int slots;                  // Chunk buffers
+    char** buf;                 // buf[c % slots] holds chunk c
+    int* ready;                 // ready[c % slots] is set once chunk c is filled
+};
+
+// Number of symbols in chunk c
+static size_t chunkLength(const struct generator* g, uint64_t c)
+{
+    size_t start = c * CHUNK_SYMBOLS;
+    return g->length - start < CHUNK_SYMBOLS ? g->length - start : CHUNK_SYMBOLS;
+}
+
+// Body of a generator thread: claim chunks in order and fill them as soon as their buffer is free
+static void* generatorMain(void* arg)
+{
+    struct generator* g = arg;
+
+    pthread_mutex_lock(&g->lock);
+    while (g->next < g->chunks)
+    {
+        uint64_t c = g->next++;
+        // The buffer is free once the chunk that last used it has been written
+        while (c >= g->written + g->slots) {
+            pthread_cond_wait(&g->changed, &g->lock);
+        }
+        pthread_mutex_unlock(&g->lock);
+
+        keygenFill(g->buf[c % g->slots], chunkLength(g, c), c);
+
+        pthread_mutex_lock(&g->lock);
+        g->ready[c % g->slots] = 1;
+        pthread_cond_broadcast(&g->changed);
+    }
+    pthread_mutex_unlock(&g->lock);
+    return NULL;
+}
+
+// Write all len bytes of buf to fd, exiting if that fails
+static void writeAll(int fd, const char* buf, size_t len)
 {
-    // Make sure at least one argument is passed through
-    if (argc != 2)
+    while (len > 0)
+    {
+        ssize_t charsWritten = write(fd, buf, len);
+        if (charsWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: could not write the key: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        buf += charsWritten;
+        len -= charsWritten;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? (int)cpus : 1;
+    const char* output_path = NULL;
+
+    int opt;
+    int bad = 0;
+    while ((opt = getopt(argc, argv, "t:o:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        default:
+            bad = 1;
+            break;
+        }
+    }
+    // Make sure the length of the key is passed through
+    char* end = NULL;
+    long long key_length = optind == argc - 1 ? strtoll(argv[optind], &end, 10) : -1;
+    if (bad || threads < 1 || key_length < 0 || end == argv[optind] || *end != '\0')
     {
         fprintf(stderr, "Error: Please enter the length of the key you would like provided.\n");
+        fprintf(stderr, "USAGE: %s keylength [-t threads] [-o file]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    // Initialize random number seed
-    srand(time(0));
+    int out = STDOUT_FILENO;
+    if (output_path != NULL) {
+        out = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            fprintf(stderr, "Error: could not open \"%s\": %s\n", output_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Seed the stream cipher from the kernel's CSPRNG
+    uint32_t seed[8];
+    size_t seeded = 0;
+    while (seeded < sizeof(seed))
+    {
+        ssize_t got = getrandom((char*)seed + seeded, sizeof(seed) - seeded, 0);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: getrandom failed: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        seeded += got;
+    }
+    keygenSeed(seed);
 
-    // Generate the random key
-    int key_length = atoi(argv[1]);
-    char* key = malloc(key_length * sizeof(char));
-    for(int i = 0; i < key_length; i++)
+    struct generator g;
+    memset(&g, 0, sizeof(g));
+    pthread_mutex_init(&g.lock, NULL);
+    pthread_cond_init(&g.changed, NULL);
+    g.length = key_length;
+    g.chunks = (g.length + CHUNK_SYMBOLS - 1) / CHUNK_SYMBOLS;
+    if ((uint64_t)threads > g.chunks) {
+        threads = g.chunks > 0 ? (int)g.chunks : 1;
+    }
+    g.slots = threads * SLOTS_PER_THREAD;
+    g.buf = calloc(g.slots, sizeof(char*));
+    g.ready = calloc(g.slots, sizeof(int));
+    for (int i = 0; g.buf != NULL && i < g.slots; i++)
     {
-        // Create random number between 0-26 (to be converted to characters later) 
-        int num = rand() % 27;
-        if (num == 26)
-        {
-            // This becomes a space
-            key[i] = ' ';
+        g.buf[i] = malloc(CHUNK_SYMBOLS);
+        if (g.buf[i] == NULL) {
+            g.buf = NULL;
         }
-        else
-        {
-            // Converts the number to an A-Z char using ASCII
-            key[i] = (char)(num + 'A');
+    }
+    if (g.buf == NULL || g.ready == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    pthread_t* workers = calloc(threads, sizeof(pthread_t));
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&workers[i], NULL, generatorMain, &g) != 0) {
+            fprintf(stderr, "Error: could not start generator thread\n");
+            return EXIT_FAILURE;
         }
     }
-    printf("%s\n", key);
 
+    // Write the chunks out in order as they become ready
+    for (uint64_t c = 0; c < g.chunks; c++)
+    {
+        int slot = c % g.slots;
+        pthread_mutex_lock(&g.lock);
+        while (!g.ready[slot]) {
+            pthread_cond_wait(&g.changed, &g.lock);
+        }
+        g.ready[slot] = 0;
+        pthread_mutex_unlock(&g.lock);
+
+        writeAll(out, g.buf[slot], chunkLength(&g, c));
+
+        pthread_mutex_lock(&g.lock);
+        g.written++;
+        pthread_cond_broadcast(&g.changed);
+        pthread_mutex_unlock(&g.lock);
+    }
+    writeAll(out, "\n", 1);
+
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    if (out != STDOUT_FILENO && close(out) < 0) {
+        fprintf(stderr, "Error: could not write the key: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
     return 0;
-}
\ No newline at end of file
+}
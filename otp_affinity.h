@@ -0,0 +1,200 @@
+/*
+* CPU and NUMA placement for the servers' loops, workers and helper threads.
+* A CPU list names CPUs the way the kernel's cpulist files do ("0-3,8"), and
+* "nodeN" stands for every CPU of NUMA node N as sysfs lists them, so work
+* can be placed by node ("node1", "node0,node1") without knowing its CPUs.
+* The n-th loop, worker or helper runs on the n-th CPU of its list, wrapping
+* around. A pinned thread also asks for its memory from its own node, so the
+* request buffers it allocates and reuses (otp_buffer.h) are first touched
+* there and stay there, rather than crossing the interconnect on every
+* request when the scheduler moves the thread to another socket.
+* When every loop has a CPU of its own, the kernel can be told to hand each
+* connection to the loop on the CPU that took its packets: each listening
+* socket of the SO_REUSEPORT group sets SO_INCOMING_CPU, and a classic BPF
+* program on the group maps the receiving CPU to the socket of the loop
+* pinned there.
+*/
+
+#ifndef OTP_AFFINITY_H
+#define OTP_AFFINITY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4
+#endif
+
+#define AFFINITY_MAX_CPUS 1024      // Longest CPU list, and one past the highest CPU it can name
+
+struct cpu_list {
+    int cpus[AFFINITY_MAX_CPUS];    // In the order work is placed on them
+    int count;                      // 0 = leave placement to the scheduler
+};
+
+/*
+* Append the CPUs of spec, a list of CPUs and ranges like "0-3,8" ending at
+* a newline or the end of the string, to list. "nodeN" items are taken
+* only if nodes is set. Returns 0, or -1 if spec is malformed.
+*/
+static inline int affinityAppend(struct cpu_list* list, const char* spec, int nodes)
+{
+    const char* p = spec;
+    while (*p != '\0' && *p != '\n')
+    {
+        if (nodes && strncmp(p, "node", 4) == 0)
+        {
+            char* end;
+            long node = strtol(p + 4, &end, 10);
+            if (end == p + 4 || node < 0) {
+                return -1;
+            }
+            char path[64];
+            char cpus[4096];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", node);
+            FILE* f = fopen(path, "r");
+            if (f == NULL) {
+                return -1;
+            }
+            int ok = fgets(cpus, sizeof(cpus), f) != NULL;
+            fclose(f);
+            if (!ok || affinityAppend(list, cpus, 0) < 0) {
+                return -1;
+            }
+            p = end;
+        }
+        else
+        {
+            char* end;
+            long first = strtol(p, &end, 10);
+            long last = first;
+            if (end == p || first < 0) {
+                return -1;
+            }
+            p = end;
+            if (*p == '-') {
+                last = strtol(p + 1, &end, 10);
+                if (end == p + 1 || last < first) {
+                    return -1;
+                }
+                p = end;
+            }
+            if (last >= AFFINITY_MAX_CPUS || list->count + (last - first + 1) > AFFINITY_MAX_CPUS) {
+                return -1;
+            }
+            for (long cpu = first; cpu <= last; cpu++) {
+                list->cpus[list->count++] = (int)cpu;
+            }
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Parse spec into list, replacing what it held. Returns 0, or -1 if spec is malformed or names no CPU.
+static inline int affinityParse(struct cpu_list* list, const char* spec)
+{
+    list->count = 0;
+    if (affinityAppend(list, spec, 1) < 0 || list->count == 0) {
+        list->count = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// CPU the index-th loop, worker or helper runs on, or -1 to leave it to the scheduler
+static inline int affinityCpu(const struct cpu_list* list, int index)
+{
+    return list->count > 0 ? list->cpus[index % list->count] : -1;
+}
+
+// Whether the first count loops each get a CPU no other of them shares
+static inline int affinityDistinct(const struct cpu_list* list, int count)
+{
+    if (list->count == 0 || count > list->count) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < i; j++)
+        {
+            if (list->cpus[i] == list->cpus[j]) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+* Pin the calling thread to cpu and have its memory come from that CPU's
+* node. Does nothing for cpu = -1. Placement is only ever a hint, so a CPU
+* the thread cannot run on is reported and the thread left where it is.
+*/
+static inline void affinityPin(int cpu, const char* name)
+{
+    if (cpu < 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "%s: could not run on CPU %d: %s\n", name, cpu, strerror(errno));
+        return;
+    }
+    // Without NUMA support there is only one node to allocate from anyway
+    syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+}
+
+/*
+* Mark listenSocket, the index-th socket to join its SO_REUSEPORT group, as
+* serving connections received on the index-th CPU of list, and with the
+* first one attach the program that steers each connection there. A
+* connection received on a CPU with no loop of its own goes to the socket
+* its CPU number picks modulo count. Returns 0, or -1 with errno set.
+*/
+static inline int affinitySteer(int listenSocket, const struct cpu_list* list, int index, int count)
+{
+    int cpu = affinityCpu(list, index);
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        return -1;
+    }
+    if (index != 0) {
+        return 0;
+    }
+
+    // A = receiving CPU; for each loop, if A is its CPU return its socket;
+    // otherwise return A % count
+    struct sock_filter code[2 * AFFINITY_MAX_CPUS + 3];
+    int n = 0;
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < count; i++)
+    {
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, affinityCpu(list, i), 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+    struct sock_fprog prog = { (unsigned short)n, code };
+    return setsockopt(listenSocket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+#endif
@@ -0,0 +1,584 @@
+/*
+* Name: Christian DeVore
+* Description: Load generator for enc_server and dec_server.
+* A number of connections, one per thread, send randomly generated messages
+* to a server on localhost, or on the Unix domain socket given in place of
+* the port, and time every reply. Message sizes are drawn
+* from a weighted list, from a few bytes up to many megabytes; messages too
+* long for a single request are streamed. Connections are either reused for
+* the whole run as sessions or opened anew for every request.
+* In closed-loop mode (the default) each connection sends its next request
+* as soon as the last reply arrives. With -r requests arrive at the given
+* average rate with exponential gaps between them, whether or not earlier
+* replies are back, and latency is measured from when a request was due
+* rather than when a connection was free to send it, so a server falling
+* behind shows up as latency instead of a lower request rate.
+* A request the server turns away as busy, or drops without a reply when it
+* is too busy even for that, is counted on its own and kept out of the
+* latencies, and its connection is opened anew for the next request after a
+* wait that doubles with every busy reply in a row, as a well-behaved client
+* would back off, rather than piling straight back onto the server.
+* The results are printed as one line of JSON, or CSV with -f csv, so runs
+* of different builds can be compared by scripts. Link with -lm.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "otp_client.h"
+
+#define BENCH_DEFAULT_CONNECTIONS 4
+#define BENCH_DEFAULT_REQUESTS 10000
+#define BENCH_DEFAULT_SIZES "1k"
+#define BENCH_MIX_SIZES "16:40,1k:30,64k:20,1m:9,8m:1"
+#define BENCH_MAX_SIZES 16
+#define BENCH_BACKOFF_MIN_NS 1000000ull     // First wait after a busy reply
+#define BENCH_BACKOFF_MAX_NS 64000000ull    // Longest wait after busy replies in a row
+
+// Latencies are kept in a log-linear histogram: exact below HIST_SUB
+// nanoseconds, then HIST_SUB buckets per power of two, so every reported
+// value is within 1/HIST_SUB of the true one
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+static const char symbols[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct size_class {
+    size_t size;
+    unsigned weight;
+};
+
+// Settings and shared state of a run
+struct bench {
+    struct client_config cfg;
+    int port;
+    int connections;
+    int reuse;                  // Keep each connection open as a session
+    double rate;                // Arrivals per second, or 0 for a closed loop
+    uint64_t requests;          // Requests to send, or 0 to run for duration_ns
+    uint64_t duration_ns;
+    const char* size_spec;
+    struct size_class sizes[BENCH_MAX_SIZES];
+    int size_count;
+    unsigned weight_total;
+    size_t max_size;
+
+    // The text and key every message is a prefix of, in memory for single
+    // requests and in memory-backed files for streams
+    char* text;
+    char* key;
+    int textFD;
+    int keyFD;
+    int nullFD;
+
+    uint64_t start_ns;
+    uint64_t next;              // Requests claimed so far, updated atomically
+    pthread_mutex_t arrival_lock;
+    uint64_t next_arrival;      // When the next open-loop request is due
+    uint64_t arrival_rng;
+};
+
+struct bench_worker {
+    struct bench* b;
+    pthread_t thread;
+    uint64_t rng;
+    uint64_t bytes;             // Message bytes transformed
+    uint64_t busy;              // Requests the server was too busy to take
+    char* reply;
+    struct histogram hist;
+};
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift64*: fast, and plenty for picking sizes and arrival gaps
+static uint64_t nextRandom(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+static int histBucket(uint64_t v)
+{
+    if (v < HIST_SUB) {
+        return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// The middle of the range of values that land in bucket i
+static uint64_t histValue(int i)
+{
+    if (i < HIST_SUB) {
+        return i;
+    }
+    int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t width = 1ull << (e - HIST_SUB_BITS);
+    return (HIST_SUB + (uint64_t)(i % HIST_SUB)) * width + width / 2;
+}
+
+static void histRecord(struct histogram* h, uint64_t v)
+{
+    h->buckets[histBucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static void histMerge(struct histogram* into, const struct histogram* from)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+// The value below which a fraction q of the samples fall
+static uint64_t histPercentile(const struct histogram* h, double q)
+{
+    uint64_t rank = (uint64_t)ceil(q * h->count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t v = histValue(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Parse a size such as "512", "4k" or "8m". Returns 0 if it is not one.
+static size_t parseSize(const char* s, char** end)
+{
+    unsigned long long n = strtoull(s, end, 10);
+    if (*end == s) {
+        return 0;
+    }
+    if (**end == 'k' || **end == 'K') {
+        n *= 1024;
+        (*end)++;
+    } else if (**end == 'm' || **end == 'M') {
+        n *= 1024 * 1024;
+        (*end)++;
+    }
+    return n;
+}
+
+/*
+* Parse a size list: comma-separated sizes, each optionally followed by
+* ":weight" (1 by default), or "mix" for a spread from tiny to several
+* megabytes. Exits if the list is malformed.
+*/
+static void parseSizes(struct bench* b, const char* spec)
+{
+    b->size_spec = spec;
+    if (strcmp(spec, "mix") == 0) {
+        spec = BENCH_MIX_SIZES;
+    }
+    const char* p = spec;
+    while (*p != '\0')
+    {
+        char* end;
+        size_t size = parseSize(p, &end);
+        unsigned long weight = 1;
+        if (*end == ':') {
+            p = end + 1;
+            weight = strtoul(p, &end, 10);
+            if (end == p) {
+                weight = 0;
+            }
+        }
+        if (size == 0 || weight == 0 || (*end != ',' && *end != '\0') || b->size_count == BENCH_MAX_SIZES) {
+            fprintf(stderr, "OTP_BENCH: bad size list \"%s\"\n", b->size_spec);
+            exit(1);
+        }
+        b->sizes[b->size_count].size = size;
+        b->sizes[b->size_count].weight = weight;
+        b->size_count++;
+        b->weight_total += weight;
+        if (size > b->max_size) {
+            b->max_size = size;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    if (b->size_count == 0) {
+        fprintf(stderr, "OTP_BENCH: bad size list \"%s\"\n", b->size_spec);
+        exit(1);
+    }
+}
+
+static size_t pickSize(const struct bench* b, uint64_t* rng)
+{
+    unsigned pick = nextRandom(rng) % b->weight_total;
+    for (int i = 0; i < b->size_count; i++)
+    {
+        if (pick < b->sizes[i].weight) {
+            return b->sizes[i].size;
+        }
+        pick -= b->sizes[i].weight;
+    }
+    return b->sizes[b->size_count - 1].size;
+}
+
+// Copy buf into a new memory-backed file for streams to send from
+static int memoryFile(const char* name, const char* buf, size_t len)
+{
+    int fd = memfd_create(name, 0);
+    if (fd < 0) {
+        fprintf(stderr, "OTP_BENCH: ERROR creating %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    while (len > 0)
+    {
+        ssize_t charsWritten = write(fd, buf, len);
+        if (charsWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "OTP_BENCH: ERROR writing %s: %s\n", name, strerror(errno));
+            exit(1);
+        }
+        buf += charsWritten;
+        len -= charsWritten;
+    }
+    return fd;
+}
+
+// Generate the text and key every message is cut from
+static void preparePayload(struct bench* b)
+{
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+    b->text = malloc(b->max_size);
+    b->key = malloc(b->max_size);
+    if (b->text == NULL || b->key == NULL) {
+        fprintf(stderr, "OTP_BENCH: out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < b->max_size; i++)
+    {
+        b->text[i] = symbols[nextRandom(&rng) % 27];
+        b->key[i] = symbols[nextRandom(&rng) % 27];
+    }
+    b->textFD = -1;
+    b->keyFD = -1;
+    if (b->max_size > SESSION_MAX_LINE) {
+        b->textFD = memoryFile("otp_bench_text", b->text, b->max_size);
+        b->keyFD = memoryFile("otp_bench_key", b->key, b->max_size);
+    }
+    b->nullFD = open("/dev/null", O_WRONLY);
+    if (b->nullFD < 0) {
+        fprintf(stderr, "OTP_BENCH: ERROR opening /dev/null\n");
+        exit(1);
+    }
+}
+
+/*
+* Claim the next request of the run and store in *due when it should be
+* sent. Returns 0 once the run is over.
+*/
+static int claimRequest(struct bench* b, uint64_t* due)
+{
+    uint64_t i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+    if (b->requests > 0 && i >= b->requests) {
+        return 0;
+    }
+    if (b->rate > 0) {
+        // Gaps between arrivals are exponential, as for a Poisson process
+        pthread_mutex_lock(&b->arrival_lock);
+        *due = b->next_arrival;
+        double u = (nextRandom(&b->arrival_rng) >> 11) * (1.0 / 9007199254740992.0);
+        b->next_arrival += (uint64_t)(-log(1.0 - u) / b->rate * 1e9);
+        pthread_mutex_unlock(&b->arrival_lock);
+    } else {
+        *due = nowNs();
+    }
+    return b->requests > 0 || *due < b->start_ns + b->duration_ns;
+}
+
+/*
+* Send one message of len bytes as a single request and read the reply.
+* Returns 0, or REPLY_BUSY if the server turned it away or hung up on it.
+*/
+static int sendRequest(struct bench_worker* w, int socketFD, size_t len, uint16_t flags)
+{
+    const struct bench* b = w->b;
+    struct otp_header hdr;
+    unsigned char header[OTP_HEADER_SIZE];
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version = OTP_VERSION;
+    hdr.opcode = b->cfg.opcode;
+    hdr.flags = flags;
+    hdr.payload_len = len;
+    hdr.key_len = len;
+    otpEncodeHeader(header, &hdr);
+
+    // Header, text and key leave in one write so no part waits on an ACK
+    struct iovec iov[3] = {
+        { header, sizeof(header) },
+        { b->text, len },
+        { b->key, len },
+    };
+    // A busy server may hang up before taking all of the request
+    if (otpSendAllv(socketFD, iov, 3) < 0 && errno != EPIPE && errno != ECONNRESET) {
+        fprintf(stderr, "OTP_BENCH: ERROR writing to socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    ssize_t reply_length = readReplyV2(socketFD, &b->cfg, w->reply, SESSION_MAX_LINE, &hdr);
+    if (reply_length == REPLY_BUSY || reply_length < 0) {
+        return REPLY_BUSY;
+    }
+    if (reply_length != (ssize_t)len) {
+        fprintf(stderr, "OTP_BENCH: server returned %zd bytes for a %zu byte message\n", reply_length, len);
+        exit(2);
+    }
+    return 0;
+}
+
+// Body of a connection's thread: send requests until the run is over
+static void* benchWorker(void* arg)
+{
+    struct bench_worker* w = arg;
+    struct bench* b = w->b;
+    int socketFD = -1;
+    uint64_t due;
+    uint64_t backoff = 0;
+
+    while (claimRequest(b, &due))
+    {
+        size_t len = pickSize(b, &w->rng);
+        if (b->rate > 0) {
+            struct timespec ts = { due / 1000000000ull, due % 1000000000ull };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            }
+        }
+
+        if (socketFD < 0) {
+            socketFD = connectServer(b->port, &b->cfg);
+            int one = 1;
+            setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        uint16_t flags = b->reuse ? OTP_FLAG_SESSION : 0;
+        int rc = 0;
+        if (len > SESSION_MAX_LINE) {
+            if (streamV2(socketFD, &b->cfg, b->textFD, b->keyFD, len, b->nullFD, flags) != 0) {
+                exit(1);
+            }
+            fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) & ~O_NONBLOCK);
+        } else {
+            rc = sendRequest(w, socketFD, len, flags);
+        }
+        if (rc == REPLY_BUSY) {
+            w->busy++;
+        } else {
+            histRecord(&w->hist, nowNs() - due);
+            w->bytes += len;
+            backoff = 0;
+        }
+
+        if (!b->reuse || rc == REPLY_BUSY) {
+            close(socketFD);
+            socketFD = -1;
+        }
+        if (rc == REPLY_BUSY)
+        {
+            backoff = backoff == 0 ? BENCH_BACKOFF_MIN_NS : backoff * 2;
+            if (backoff > BENCH_BACKOFF_MAX_NS) {
+                backoff = BENCH_BACKOFF_MAX_NS;
+            }
+            struct timespec ts = { backoff / 1000000000ull, backoff % 1000000000ull };
+            while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+            }
+        }
+    }
+    if (socketFD >= 0) {
+        close(socketFD);
+    }
+    return NULL;
+}
+
+// Print the results of the run as one line of JSON or as CSV with a header
+static void report(const struct bench* b, const struct histogram* h, uint64_t bytes,
+                   uint64_t busy, double seconds, int csv)
+{
+    double mean_us = h->count > 0 ? (double)h->sum / h->count / 1e3 : 0;
+    double p50_us = histPercentile(h, 0.50) / 1e3;
+    double p99_us = histPercentile(h, 0.99) / 1e3;
+    double p999_us = histPercentile(h, 0.999) / 1e3;
+    double max_us = h->max / 1e3;
+    double rps = seconds > 0 ? h->count / seconds : 0;
+    double mbps = seconds > 0 ? bytes / seconds / 1e6 : 0;
+    const char* op = b->cfg.opcode == OTP_OP_ENCRYPT ? "enc" : "dec";
+    const char* arrival = b->rate > 0 ? "open" : "closed";
+
+    if (csv) {
+        printf("op,connections,reuse,arrival,rate,sizes,requests,busy,bytes,seconds,"
+               "requests_per_s,mb_per_s,mean_us,p50_us,p99_us,p999_us,max_us\n");
+        printf("%s,%d,%d,%s,%.1f,\"%s\",%llu,%llu,%llu,%.6f,%.1f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+               op, b->connections, b->reuse, arrival, b->rate, b->size_spec,
+               (unsigned long long)h->count, (unsigned long long)busy, (unsigned long long)bytes, seconds,
+               rps, mbps, mean_us, p50_us, p99_us, p999_us, max_us);
+        return;
+    }
+    printf("{\"op\":\"%s\",\"connections\":%d,\"reuse\":%s,\"arrival\":\"%s\",\"rate\":%.1f,"
+           "\"sizes\":\"%s\",\"requests\":%llu,\"busy\":%llu,\"bytes\":%llu,\"seconds\":%.6f,"
+           "\"requests_per_s\":%.1f,\"mb_per_s\":%.3f,\"mean_us\":%.1f,\"p50_us\":%.1f,"
+           "\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           op, b->connections, b->reuse ? "true" : "false", arrival, b->rate, b->size_spec,
+           (unsigned long long)h->count, (unsigned long long)busy, (unsigned long long)bytes, seconds,
+           rps, mbps, mean_us, p50_us, p99_us, p999_us, max_us);
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "USAGE: %s [-o enc|dec] [-c connections] [-n requests | -d seconds] [-r rate]\n", prog);
+    fprintf(stderr, "       [-s sizes] [-N] [-f json|csv] port|socket\n");
+    fprintf(stderr, "  -s takes sizes like \"64,4k:3,2m\" (size:weight) or \"mix\"; -N opens a\n");
+    fprintf(stderr, "  connection per request; -r sends requests at that rate (open loop)\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench b;
+    memset(&b, 0, sizeof(b));
+    b.cfg.name = "OTP_BENCH";
+    b.cfg.client_name = "enc_client";
+    b.cfg.opcode = OTP_OP_ENCRYPT;
+    b.cfg.busy_ok = 1;
+    b.connections = BENCH_DEFAULT_CONNECTIONS;
+    b.requests = BENCH_DEFAULT_REQUESTS;
+    b.reuse = 1;
+    const char* sizes = BENCH_DEFAULT_SIZES;
+    int csv = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:c:n:d:r:s:Nf:")) != -1) {
+        switch (opt) {
+        case 'o':
+            if (strcmp(optarg, "dec") == 0) {
+                b.cfg.client_name = "dec_client";
+                b.cfg.opcode = OTP_OP_DECRYPT;
+            } else if (strcmp(optarg, "enc") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            b.connections = atoi(optarg);
+            break;
+        case 'n':
+            b.requests = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            b.requests = 0;
+            b.duration_ns = (uint64_t)(atof(optarg) * 1e9);
+            break;
+        case 'r':
+            b.rate = atof(optarg);
+            break;
+        case 's':
+            sizes = optarg;
+            break;
+        case 'N':
+            b.reuse = 0;
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                csv = 1;
+            } else if (strcmp(optarg, "json") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || b.connections < 1 || b.rate < 0 ||
+        (b.requests == 0 && b.duration_ns == 0))
+    {
+        usage(argv[0]);
+    }
+    b.port = clientServerArg(&b.cfg, argv[optind]);
+    parseSizes(&b, sizes);
+    preparePayload(&b);
+
+    // sendfile() has no MSG_NOSIGNAL, so a server hanging up must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    struct bench_worker* workers = calloc(b.connections, sizeof(*workers));
+    if (workers == NULL) {
+        fprintf(stderr, "OTP_BENCH: out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&b.arrival_lock, NULL);
+    b.arrival_rng = 0x853c49e6748fea9bull;
+    b.start_ns = nowNs();
+    b.next_arrival = b.start_ns;
+    for (int i = 0; i < b.connections; i++)
+    {
+        workers[i].b = &b;
+        workers[i].rng = 0xda3e39cb94b95bdbull + i;
+        workers[i].reply = malloc(SESSION_MAX_LINE);
+        if (workers[i].reply == NULL || pthread_create(&workers[i].thread, NULL, benchWorker, &workers[i]) != 0) {
+            fprintf(stderr, "OTP_BENCH: could not start connection thread\n");
+            exit(1);
+        }
+    }
+
+    // Gather every connection's latencies into one histogram
+    struct histogram* total = calloc(1, sizeof(*total));
+    uint64_t bytes = 0;
+    uint64_t busy = 0;
+    for (int i = 0; i < b.connections; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        histMerge(total, &workers[i].hist);
+        bytes += workers[i].bytes;
+        busy += workers[i].busy;
+        free(workers[i].reply);
+    }
+    double seconds = (nowNs() - b.start_ns) / 1e9;
+
+    report(&b, total, bytes, busy, seconds, csv);
+    free(total);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+* Size-classed buffer pool for the servers' request buffers.
+* Sizes are rounded up to a power of two from 4 KB to 256 KB, and a buffer
+* given back goes on its class's free list for the next request of that size
+* instead of back to malloc, so a busy server keeps reusing the same warm
+* pages rather than faulting in new ones. Each thread has free lists of its
+* own: a connection's buffers are only ever taken and given back by the
+* thread serving it, so nothing is locked. A thread keeps at most
+* BUFFER_CACHE_BYTES on its lists and frees the rest, and sizes past the
+* largest class go straight to malloc.
+*/
+
+#ifndef OTP_BUFFER_H
+#define OTP_BUFFER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_MIN_SHIFT 12                 // Smallest class, 4 KB
+#define BUFFER_CLASSES 7                    // 4 KB, 8 KB, ... 256 KB
+#define BUFFER_CACHE_BYTES (4u << 20)       // Free buffers each thread holds on to
+
+struct buffer_cache {
+    void* free[BUFFER_CLASSES];             // Linked through each buffer's first word
+    size_t bytes;                           // Total size of the buffers on the lists
+};
+
+static __thread struct buffer_cache buffer_cache;
+
+// Class of a buffer of size bytes, or -1 if it is too large for one
+static inline int bufferClass(size_t size)
+{
+    if (size <= ((size_t)1 << BUFFER_MIN_SHIFT)) {
+        return 0;
+    }
+    int c = 64 - __builtin_clzll(size - 1) - BUFFER_MIN_SHIFT;
+    return c < BUFFER_CLASSES ? c : -1;
+}
+
+static inline size_t bufferClassSize(int c)
+{
+    return (size_t)1 << (c + BUFFER_MIN_SHIFT);
+}
+
+// A buffer of at least size bytes, or NULL if out of memory
+static inline void* bufferGet(size_t size)
+{
+    int c = bufferClass(size);
+    if (c < 0) {
+        return malloc(size);
+    }
+    void* buf = buffer_cache.free[c];
+    if (buf != NULL) {
+        memcpy(&buffer_cache.free[c], buf, sizeof(void*));
+        buffer_cache.bytes -= bufferClassSize(c);
+        return buf;
+    }
+    return malloc(bufferClassSize(c));
+}
+
+// Give back a buffer bufferGet() returned for size bytes
+static inline void bufferPut(void* buf, size_t size)
+{
+    if (buf == NULL) {
+        return;
+    }
+    int c = bufferClass(size);
+    if (c < 0 || buffer_cache.bytes + bufferClassSize(c) > BUFFER_CACHE_BYTES) {
+        free(buf);
+        return;
+    }
+    memcpy(buf, &buffer_cache.free[c], sizeof(void*));
+    buffer_cache.free[c] = buf;
+    buffer_cache.bytes += bufferClassSize(c);
+}
+
+/*
+* Move the first len bytes of buf, a buffer for oldSize bytes, into one for
+* newSize bytes. A buffer whose class already fits is kept as it is.
+* Returns NULL, leaving buf alone, if out of memory.
+*/
+static inline void* bufferResize(void* buf, size_t oldSize, size_t len, size_t newSize)
+{
+    int oldClass = bufferClass(oldSize);
+    int newClass = bufferClass(newSize);
+    if (buf != NULL && oldClass >= 0 && oldClass == newClass) {
+        return buf;
+    }
+    // Past the classes realloc() can often grow the mapping in place
+    if (oldClass < 0 && newClass < 0) {
+        return realloc(buf, newSize);
+    }
+    void* newBuf = bufferGet(newSize);
+    if (newBuf == NULL) {
+        return NULL;
+    }
+    if (len > 0) {
+        memcpy(newBuf, buf, len);
+    }
+    bufferPut(buf, oldSize);
+    return newBuf;
+}
+
+#endif
@@ -0,0 +1,452 @@
+/*
+* The one-time pad transform shared by the servers and clients.
+* Characters A-Z map to 0-25 and space maps to 26. Encryption adds the key
+* modulo 27 and decryption subtracts it. Every function takes explicit
+* lengths and writes into a buffer the caller owns, which may be the text
+* itself to transform it in place, so nothing is allocated and nothing is
+* scanned for a terminator. otpEncrypt() and otpDecrypt() pick
+* the widest kernel the CPU supports the first time they are called:
+* AVX-512BW, AVX2 or SSE4.1, with the scalar loop as the reference and the
+* fallback everywhere else. Setting OTP_CIPHER_KERNEL to scalar, sse4.1, avx2
+* or avx512bw in the environment forces a narrower kernel for testing; any
+* other value is warned about and forces the scalar loop.
+* otpScanText() checks input the same way, finding the end of a message and
+* any invalid character in a single pass.
+* Input is meant to be checked before it is transformed, but every kernel
+* treats a byte that is not A-Z as a space all the same, so they give the
+* same output for any input whichever one the CPU picks.
+*/
+
+#ifndef OTP_CIPHER_H
+#define OTP_CIPHER_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OTP_CIPHER_X86 1
+#include <immintrin.h>
+#endif
+
+// A kernel writes len transformed characters of text to out, which may be text itself
+typedef void (*otp_kernel)(char* out, const char* text, const char* key, size_t len);
+
+// A scanner returns the offset of the first of len characters that is not A-Z or space, or len
+typedef size_t (*otp_scanner)(const char* text, size_t len);
+
+// Value of one character: A-Z = 0 - 25, <space> and anything else = 26, as the vector kernels compute it
+static inline int otpCharValue(char c)
+{
+    unsigned char v = (unsigned char)c - 'A';
+    return v < 26 ? v : 26;
+}
+
+// Character for one value: 0 - 25 = A-Z, 26 = <space>
+static inline char otpValueChar(int v)
+{
+    if (v == 26) {
+        return ' ';
+    }
+    return v + 'A';
+}
+
+// Whether each byte is A-Z or space
+static const unsigned char otp_valid_char[256] = {
+    ['A' ... 'Z'] = 1,
+    [' '] = 1,
+};
+
+// Reference scanner, one table lookup per character
+static size_t otpScanScalar(const char* text, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!otp_valid_char[(unsigned char)text[i]]) {
+            return i;
+        }
+    }
+    return len;
+}
+
+// Reference kernels, one character at a time
+static void otpEncryptScalar(char* out, const char* text, const char* key, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        out[i] = otpValueChar((otpCharValue(text[i]) + otpCharValue(key[i])) % 27);
+    }
+}
+
+static void otpDecryptScalar(char* out, const char* text, const char* key, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        out[i] = otpValueChar((otpCharValue(text[i]) - otpCharValue(key[i]) + 27) % 27);
+    }
+}
+
+#ifdef OTP_CIPHER_X86
+
+/*
+* The vector kernels work on unsigned bytes without any branches:
+*   value:   min(c - 'A', 26), since a space wraps around to 223, and so
+*            does every other byte outside A-Z to something past 25
+*   encrypt: s = t + k, then min(s, s - 27), since s - 27 wraps when s < 27
+*   decrypt: d = t - k, then min(d, d + 27), since d + 27 only stays large
+*            when d did not wrap
+*   output:  v + 'A', blended with ' ' wherever v == 26
+* Whatever is left past the last full vector goes through the scalar kernel,
+* except with AVX-512 where the tail is handled with masked loads and stores.
+*/
+
+__attribute__((target("sse4.1")))
+static inline __m128i otpTransform128(__m128i t, __m128i k, int decrypt)
+{
+    const __m128i a = _mm_set1_epi8('A');
+    const __m128i v26 = _mm_set1_epi8(26);
+    const __m128i v27 = _mm_set1_epi8(27);
+
+    t = _mm_min_epu8(_mm_sub_epi8(t, a), v26);
+    k = _mm_min_epu8(_mm_sub_epi8(k, a), v26);
+    __m128i r;
+    if (decrypt) {
+        r = _mm_sub_epi8(t, k);
+        r = _mm_min_epu8(r, _mm_add_epi8(r, v27));
+    } else {
+        r = _mm_add_epi8(t, k);
+        r = _mm_min_epu8(r, _mm_sub_epi8(r, v27));
+    }
+    return _mm_blendv_epi8(_mm_add_epi8(r, a), _mm_set1_epi8(' '), _mm_cmpeq_epi8(r, v26));
+}
+
+__attribute__((target("sse4.1")))
+static inline void otpKernel128(char* out, const char* text, const char* key, size_t len, int decrypt)
+{
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i t = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i k = _mm_loadu_si128((const __m128i*)(key + i));
+        _mm_storeu_si128((__m128i*)(out + i), otpTransform128(t, k, decrypt));
+    }
+    if (decrypt) {
+        otpDecryptScalar(out + i, text + i, key + i, len - i);
+    } else {
+        otpEncryptScalar(out + i, text + i, key + i, len - i);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i otpTransform256(__m256i t, __m256i k, int decrypt)
+{
+    const __m256i a = _mm256_set1_epi8('A');
+    const __m256i v26 = _mm256_set1_epi8(26);
+    const __m256i v27 = _mm256_set1_epi8(27);
+
+    t = _mm256_min_epu8(_mm256_sub_epi8(t, a), v26);
+    k = _mm256_min_epu8(_mm256_sub_epi8(k, a), v26);
+    __m256i r;
+    if (decrypt) {
+        r = _mm256_sub_epi8(t, k);
+        r = _mm256_min_epu8(r, _mm256_add_epi8(r, v27));
+    } else {
+        r = _mm256_add_epi8(t, k);
+        r = _mm256_min_epu8(r, _mm256_sub_epi8(r, v27));
+    }
+    return _mm256_blendv_epi8(_mm256_add_epi8(r, a), _mm256_set1_epi8(' '), _mm256_cmpeq_epi8(r, v26));
+}
+
+__attribute__((target("avx2")))
+static inline void otpKernel256(char* out, const char* text, const char* key, size_t len, int decrypt)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i t = _mm256_loadu_si256((const __m256i*)(text + i));
+        __m256i k = _mm256_loadu_si256((const __m256i*)(key + i));
+        _mm256_storeu_si256((__m256i*)(out + i), otpTransform256(t, k, decrypt));
+    }
+    if (decrypt) {
+        otpDecryptScalar(out + i, text + i, key + i, len - i);
+    } else {
+        otpEncryptScalar(out + i, text + i, key + i, len - i);
+    }
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i otpTransform512(__m512i t, __m512i k, int decrypt)
+{
+    const __m512i a = _mm512_set1_epi8('A');
+    const __m512i v26 = _mm512_set1_epi8(26);
+    const __m512i v27 = _mm512_set1_epi8(27);
+
+    t = _mm512_min_epu8(_mm512_sub_epi8(t, a), v26);
+    k = _mm512_min_epu8(_mm512_sub_epi8(k, a), v26);
+    __m512i r;
+    if (decrypt) {
+        r = _mm512_sub_epi8(t, k);
+        r = _mm512_min_epu8(r, _mm512_add_epi8(r, v27));
+    } else {
+        r = _mm512_add_epi8(t, k);
+        r = _mm512_min_epu8(r, _mm512_sub_epi8(r, v27));
+    }
+    __mmask64 space = _mm512_cmpeq_epi8_mask(r, v26);
+    return _mm512_mask_blend_epi8(space, _mm512_add_epi8(r, a), _mm512_set1_epi8(' '));
+}
+
+__attribute__((target("avx512bw")))
+static inline void otpKernel512(char* out, const char* text, const char* key, size_t len, int decrypt)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m512i t = _mm512_loadu_si512((const void*)(text + i));
+        __m512i k = _mm512_loadu_si512((const void*)(key + i));
+        _mm512_storeu_si512((void*)(out + i), otpTransform512(t, k, decrypt));
+    }
+    if (i < len)
+    {
+        // Masked loads never touch the bytes past the end of the buffers
+        __mmask64 tail = (1ULL << (len - i)) - 1;
+        __m512i t = _mm512_maskz_loadu_epi8(tail, text + i);
+        __m512i k = _mm512_maskz_loadu_epi8(tail, key + i);
+        _mm512_mask_storeu_epi8(out + i, tail, otpTransform512(t, k, decrypt));
+    }
+}
+
+/*
+* The vector scanners use the same range check as the kernels: c is valid
+* when c - 'A' <= 25 as an unsigned byte, or when c is a space. The first
+* invalid byte is the lowest set bit of the inverted mask.
+*/
+
+__attribute__((target("sse4.1")))
+static size_t otpScanSse41(const char* text, size_t len)
+{
+    const __m128i a = _mm_set1_epi8('A');
+    const __m128i v25 = _mm_set1_epi8(25);
+    const __m128i space = _mm_set1_epi8(' ');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i v = _mm_sub_epi8(c, a);
+        __m128i ok = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, v25), v), _mm_cmpeq_epi8(c, space));
+        unsigned stop = ~(unsigned)_mm_movemask_epi8(ok) & 0xFFFF;
+        if (stop != 0) {
+            return i + __builtin_ctz(stop);
+        }
+    }
+    return i + otpScanScalar(text + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t otpScanAvx2(const char* text, size_t len)
+{
+    const __m256i a = _mm256_set1_epi8('A');
+    const __m256i v25 = _mm256_set1_epi8(25);
+    const __m256i space = _mm256_set1_epi8(' ');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(text + i));
+        __m256i v = _mm256_sub_epi8(c, a);
+        __m256i ok = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, v25), v),
+                                     _mm256_cmpeq_epi8(c, space));
+        unsigned stop = ~(unsigned)_mm256_movemask_epi8(ok);
+        if (stop != 0) {
+            return i + __builtin_ctz(stop);
+        }
+    }
+    return i + otpScanScalar(text + i, len - i);
+}
+
+__attribute__((target("avx512bw")))
+static size_t otpScanAvx512(const char* text, size_t len)
+{
+    const __m512i a = _mm512_set1_epi8('A');
+    const __m512i v25 = _mm512_set1_epi8(25);
+    const __m512i space = _mm512_set1_epi8(' ');
+    for (size_t i = 0; i < len; i += 64)
+    {
+        // Masked loads never touch the bytes past the end of the buffer
+        __mmask64 live = len - i >= 64 ? ~0ULL : (1ULL << (len - i)) - 1;
+        __m512i c = _mm512_maskz_loadu_epi8(live, text + i);
+        __mmask64 ok = _mm512_cmple_epu8_mask(_mm512_sub_epi8(c, a), v25) |
+                       _mm512_cmpeq_epi8_mask(c, space);
+        __mmask64 stop = ~ok & live;
+        if (stop != 0) {
+            return i + __builtin_ctzll(stop);
+        }
+    }
+    return len;
+}
+
+__attribute__((target("sse4.1")))
+static void otpEncryptSse41(char* out, const char* text, const char* key, size_t len)
+{
+    otpKernel128(out, text, key, len, 0);
+}
+
+__attribute__((target("sse4.1")))
+static void otpDecryptSse41(char* out, const char* text, const char* key, size_t len)
+{
+    otpKernel128(out, text, key, len, 1);
+}
+
+__attribute__((target("avx2")))
+static void otpEncryptAvx2(char* out, const char* text, const char* key, size_t len)
+{
+    otpKernel256(out, text, key, len, 0);
+}
+
+__attribute__((target("avx2")))
+static void otpDecryptAvx2(char* out, const char* text, const char* key, size_t len)
+{
+    otpKernel256(out, text, key, len, 1);
+}
+
+__attribute__((target("avx512bw")))
+static void otpEncryptAvx512(char* out, const char* text, const char* key, size_t len)
+{
+    otpKernel512(out, text, key, len, 0);
+}
+
+__attribute__((target("avx512bw")))
+static void otpDecryptAvx512(char* out, const char* text, const char* key, size_t len)
+{
+    otpKernel512(out, text, key, len, 1);
+}
+
+#endif
+
+// The kernels in use, chosen by otpCipherInit()
+static otp_kernel otp_encrypt_kernel = NULL;
+static otp_kernel otp_decrypt_kernel = NULL;
+static otp_scanner otp_scan_kernel = NULL;
+
+// Kernel names from narrowest to widest, as OTP_CIPHER_KERNEL takes them
+static const char* otp_kernel_order[] = {"scalar", "sse4.1", "avx2", "avx512bw"};
+
+/*
+* The kernel OTP_CIPHER_KERNEL forces, or NULL if it is not set. A value
+* that names no kernel is warned about and forces the scalar loop, so a
+* typo cannot quietly leave the widest kernel in use.
+*/
+static inline const char* otpKernelForced(void)
+{
+    const char* forced = getenv("OTP_CIPHER_KERNEL");
+    if (forced == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(otp_kernel_order) / sizeof(otp_kernel_order[0]); i++)
+    {
+        if (strcmp(otp_kernel_order[i], forced) == 0) {
+            return forced;
+        }
+    }
+    fprintf(stderr, "OTP_CIPHER_KERNEL: unknown kernel \"%s\", using scalar\n", forced);
+    return otp_kernel_order[0];
+}
+
+// Whether the kernel called name may be used, given the CPU and the forced kernel (NULL = none)
+static inline int otpKernelAllowed(const char* name, int supported, const char* forced)
+{
+    if (!supported) {
+        return 0;
+    }
+    if (forced == NULL) {
+        return 1;
+    }
+    // Anything up to and including the forced kernel is allowed
+    for (size_t i = 0; i < sizeof(otp_kernel_order) / sizeof(otp_kernel_order[0]); i++)
+    {
+        if (strcmp(otp_kernel_order[i], name) == 0) {
+            return 1;
+        }
+        if (strcmp(otp_kernel_order[i], forced) == 0) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+* Pick the widest kernel the CPU supports. Called automatically on first use;
+* calling it up front keeps the CPU detection out of the first request.
+* Returns the name of the kernel chosen.
+*/
+static inline const char* otpCipherInit(void)
+{
+    otp_kernel enc = otpEncryptScalar, dec = otpDecryptScalar;
+    otp_scanner scan = otpScanScalar;
+    const char* name = "scalar";
+#ifdef OTP_CIPHER_X86
+    const char* forced = otpKernelForced();
+    __builtin_cpu_init();
+    if (otpKernelAllowed("avx512bw", __builtin_cpu_supports("avx512bw"), forced)) {
+        enc = otpEncryptAvx512;
+        dec = otpDecryptAvx512;
+        scan = otpScanAvx512;
+        name = "avx512bw";
+    } else if (otpKernelAllowed("avx2", __builtin_cpu_supports("avx2"), forced)) {
+        enc = otpEncryptAvx2;
+        dec = otpDecryptAvx2;
+        scan = otpScanAvx2;
+        name = "avx2";
+    } else if (otpKernelAllowed("sse4.1", __builtin_cpu_supports("sse4.1"), forced)) {
+        enc = otpEncryptSse41;
+        dec = otpDecryptSse41;
+        scan = otpScanSse41;
+        name = "sse4.1";
+    }
+#endif
+    // Every thread picks the same kernels, so racing stores are harmless
+    __atomic_store_n(&otp_decrypt_kernel, dec, __ATOMIC_RELAXED);
+    __atomic_store_n(&otp_scan_kernel, scan, __ATOMIC_RELAXED);
+    __atomic_store_n(&otp_encrypt_kernel, enc, __ATOMIC_RELEASE);
+    return name;
+}
+
+// Write the encryption of len characters of text with key to out (or back over text)
+static inline void otpEncrypt(char* out, const char* text, const char* key, size_t len)
+{
+    otp_kernel kernel = __atomic_load_n(&otp_encrypt_kernel, __ATOMIC_ACQUIRE);
+    if (kernel == NULL) {
+        otpCipherInit();
+        kernel = otp_encrypt_kernel;
+    }
+    kernel(out, text, key, len);
+}
+
+// Write the decryption of len characters of text with key to out (or back over text)
+static inline void otpDecrypt(char* out, const char* text, const char* key, size_t len)
+{
+    if (__atomic_load_n(&otp_encrypt_kernel, __ATOMIC_ACQUIRE) == NULL) {
+        otpCipherInit();
+    }
+    otp_decrypt_kernel(out, text, key, len);
+}
+
+/*
+* Return the offset of the first of len characters of text that is not A-Z
+* or space, or len if there is none. Since a newline is not valid either,
+* this finds the end of a line and checks everything before it in one pass.
+*/
+static inline size_t otpScanText(const char* text, size_t len)
+{
+    if (__atomic_load_n(&otp_encrypt_kernel, __ATOMIC_ACQUIRE) == NULL) {
+        otpCipherInit();
+    }
+    return otp_scan_kernel(text, len);
+}
+
+// True if the len characters at text are all A-Z or space
+static inline int otpValidText(const char* text, size_t len)
+{
+    return otpScanText(text, len) == len;
+}
+
+#endif
@@ -0,0 +1,1832 @@
+/*
+* Shared connection handling for enc_client and dec_client.
+* Each client fills out a client_config describing its name, the handshake
+* it sends and the version 2 opcode it asks for, then uses requestV2() or
+* requestLegacy() to have one message transformed by the server,
+* runStream() for messages too large to hold in memory, runSession() for
+* many messages over one connection, or runBatch() for many files.
+* Given a socket path instead of a port, clients connect over a Unix domain
+* socket, where runShared() and a shared runSession() hand the server their
+* text and key in shared memory rather than sending them.
+* Files are mapped rather than read wherever they can be, so messages are
+* checked and sent straight from the page cache.
+*/
+
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>  // ssize_t
+#include <sys/stat.h>
+#include <sys/mman.h>   // memfd_create(), mmap()
+#include <sys/un.h>     // struct sockaddr_un
+#include <sys/sendfile.h>
+#include <sys/socket.h> // send(),recv()
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <arpa/inet.h>  // inet_pton()
+
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_pack.h"
+
+#define LOCALHOST "127.0.0.1"
+#define SCAN_WINDOW (1u << 20)      // Bytes of a file mapped at a time to check it
+#define SESSION_MAX_LINE 100000     // Longest line the servers take without streaming
+#define SESSION_BATCH 65536         // Requests a session queues up before sending them
+#define BATCH_DEFAULT_INFLIGHT 4    // Requests a batch keeps in flight unless told otherwise
+#define PACKED_CHUNK 65520          // Symbols per packed stream chunk, whole blocks of OTP_PACK_SYMBOLS
+#define SHARED_RING_SIZE (4u << 20) // Shared memory a session cycles its messages through
+#define REPLY_BUSY (-2)             // readReplyV2() found the server too busy to serve the request
+
+struct client_config {
+    const char* name;           // Prefix used in error messages ("ENC_CLIENT")
+    const char* client_name;    // Name sent in the version 1 handshake ("enc_client")
+    uint8_t opcode;             // Version 2 opcode (OTP_OP_ENCRYPT or OTP_OP_DECRYPT)
+    int legacy;                 // Only speak the version 1 protocol
+    int stream;                 // Always send the message as a version 2 stream
+    int session;                // Send every line of the input as its own message
+    int keyref;                 // The key argument names a pad held by the server
+    int packed;                 // Send text and key packed (otp_pack.h) to cut the bytes on the wire
+    uint64_t key_offset;        // Where in that pad to start (OTP_KEY_NEXT for the next unused part)
+    const char* socket_path;    // Unix domain socket to connect to instead of a TCP port (NULL = TCP)
+    int shared;                 // Hand text and key to the server in shared memory (Unix sockets only)
+    int busy_ok;                // readReplyV2() returns REPLY_BUSY for a busy server rather than exiting
+};
+
+/*
+* Take the server argument, a port number or, if it contains a '/', the path
+* of a Unix domain socket. Returns the port, or 0 for a socket path.
+*/
+static inline int clientServerArg(struct client_config* cfg, const char* arg)
+{
+    if (strchr(arg, '/') != NULL) {
+        cfg->socket_path = arg;
+        return 0;
+    }
+    return atoi(arg);
+}
+
+// Set up the address struct
+static inline void setupAddressStruct(struct sockaddr_in* address, int portNumber,
+                                      const struct client_config* cfg)
+{
+    // Clear out the address struct
+    memset((char*) address, '\0', sizeof(*address));
+
+    // The address should be network capable
+    address->sin_family = AF_INET;
+    // Store the port number
+    address->sin_port = htons(portNumber);
+
+    // Convert IP address from text to binary (Citation: Adapted from lecture #13 slides - Sockets)
+    if (inet_pton(AF_INET, LOCALHOST, &address->sin_addr) <= 0) {
+        fprintf(stderr, "%s: Invalid address, address not supported.\n", cfg->name);
+        exit(1);
+    }
+}
+
+// Connect to the server's Unix domain socket at cfg->socket_path, exiting on failure
+static inline int connectUnix(const struct client_config* cfg)
+{
+    struct sockaddr_un serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sun_family = AF_UNIX;
+    if (strlen(cfg->socket_path) >= sizeof(serverAddress.sun_path)) {
+        fprintf(stderr, "%s: socket path \"%s\" is too long\n", cfg->name, cfg->socket_path);
+        exit(1);
+    }
+    strcpy(serverAddress.sun_path, cfg->socket_path);
+
+    int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFD < 0){
+        fprintf(stderr, "%s: ERROR opening socket\n", cfg->name);
+        exit(1);
+    }
+    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
+        fprintf(stderr, "%s: ERROR connecting\n", cfg->name);
+        exit(1);
+    }
+    return socketFD;
+}
+
+/*
+* Create a socket and connect it to the server on portNumber, or on
+* cfg->socket_path if there is one, exiting on failure
+*/
+static inline int connectServer(int portNumber, const struct client_config* cfg)
+{
+    struct sockaddr_in serverAddress;
+
+    if (cfg->socket_path != NULL) {
+        return connectUnix(cfg);
+    }
+
+    // Create a socket
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFD < 0){
+        fprintf(stderr, "%s: ERROR opening socket\n", cfg->name);
+        exit(1);
+    }
+
+    // Set up the server address struct
+    setupAddressStruct(&serverAddress, portNumber, cfg);
+
+    // Connect to server
+    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
+        fprintf(stderr, "%s: ERROR connecting\n", cfg->name);
+        exit(1);
+    }
+    return socketFD;
+}
+
+/*
+* Read a version 2 reply into out, which has room for outCap bytes, and its
+* header into hdr. A packed reply is unpacked into out, and a shared reply
+* has nothing to read since it is already in the shared memory. Returns the
+* length of the reply, or -1 if the server closed the connection without
+* answering. Exits if the request was refused, and if the server was too
+* busy to take it unless cfg->busy_ok asks for REPLY_BUSY instead.
+*/
+static inline ssize_t readReplyV2(int socketFD, const struct client_config* cfg,
+                                  char* out, size_t outCap, struct otp_header* hdr)
+{
+    unsigned char header[OTP_HEADER_SIZE];
+
+    // The reply header says how many bytes of text follow it
+    ssize_t charsRead = otpRecvAll(socketFD, header, sizeof(header));
+    if (charsRead == 0 || (charsRead < 0 && errno == ECONNRESET)) {
+        return -1;
+    }
+    if (charsRead != OTP_HEADER_SIZE || otpDecodeHeader(header, hdr) < 0) {
+        fprintf(stderr, "%s: ERROR reading reply header from server\n", cfg->name);
+        exit(2);
+    }
+    if (hdr->opcode == OTP_OP_ERROR) {
+        char reason[256];
+        size_t reason_len = hdr->payload_len < sizeof(reason) ? hdr->payload_len : sizeof(reason);
+        charsRead = otpRecvAll(socketFD, reason, reason_len);
+        fprintf(stderr, "%s: server refused request: %.*s\n", cfg->name,
+                charsRead > 0 ? (int)charsRead : 0, reason);
+        exit(1);
+    }
+    if (hdr->opcode == OTP_OP_BUSY) {
+        if (cfg->busy_ok) {
+            return REPLY_BUSY;
+        }
+        fprintf(stderr, "%s: server is busy, try again later\n", cfg->name);
+        exit(1);
+    }
+    if (hdr->payload_len > outCap) {
+        fprintf(stderr, "%s: reply from server is too long\n", cfg->name);
+        exit(2);
+    }
+    if (hdr->flags & OTP_FLAG_SHARED) {
+        return hdr->payload_len;
+    }
+    if (hdr->flags & OTP_FLAG_PACKED) {
+        size_t packedLen = otpPackedSize(hdr->payload_len);
+        unsigned char* packed = malloc(packedLen + 1);
+        if (packed == NULL) {
+            fprintf(stderr, "%s: out of memory\n", cfg->name);
+            exit(1);
+        }
+        charsRead = otpRecvAll(socketFD, packed, packedLen);
+        if (charsRead < 0 || (size_t)charsRead != packedLen) {
+            fprintf(stderr, "%s: ERROR reading from socket\n", cfg->name);
+            exit(2);
+        }
+        otpUnpack(out, packed, hdr->payload_len);
+        free(packed);
+        return hdr->payload_len;
+    }
+    charsRead = otpRecvAll(socketFD, out, hdr->payload_len);
+    if (charsRead < 0 || (size_t)charsRead != hdr->payload_len) {
+        fprintf(stderr, "%s: ERROR reading from socket\n", cfg->name);
+        exit(2);
+    }
+    return charsRead;
+}
+
+/*
+* Send text and key to the server with the version 2 protocol and read the
+* reply into out, which has room for outCap bytes. Only text_len bytes of
+* the key are sent since that is all the server will use. With cfg->packed
+* both go packed, and the server has to answer in kind.
+* Returns the length of the reply, or -1 if the server closed the connection
+* without answering, meaning it only speaks version 1. Exits on any other error.
+*/
+static inline ssize_t requestV2(int socketFD, const struct client_config* cfg,
+                                const char* text, size_t text_len, const char* key,
+                                char* out, size_t outCap)
+{
+    struct otp_header hdr;
+    unsigned char header[OTP_HEADER_SIZE];
+
+    // The header tells the server exactly how much text and key follow
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version = OTP_VERSION;
+    hdr.opcode = cfg->opcode;
+    hdr.flags = cfg->packed ? OTP_FLAG_PACKED : 0;
+    hdr.payload_len = text_len;
+    hdr.key_len = text_len;
+    otpEncodeHeader(header, &hdr);
+
+    // Packing writes text and key side by side into one buffer
+    const char* body_text = text;
+    const char* body_key = key;
+    size_t body_len = text_len;
+    unsigned char* packed = NULL;
+    if (cfg->packed) {
+        body_len = otpPackedSize(text_len);
+        packed = malloc(2 * body_len + 1);
+        if (packed == NULL) {
+            fprintf(stderr, "%s: out of memory\n", cfg->name);
+            exit(1);
+        }
+        otpPack(packed, text, text_len);
+        otpPack(packed + body_len, key, text_len);
+        body_text = (const char*)packed;
+        body_key = (const char*)packed + body_len;
+    }
+
+    // A version 1 server may hang up as soon as it sees the header, so write
+    // errors are only reported if the server did not close the connection
+    struct iovec iov[3] = {
+        { header, sizeof(header) },
+        { (void*)body_text, body_len },
+        { (void*)body_key, body_len },
+    };
+    if (otpSendAllv(socketFD, iov, 3) < 0)
+    {
+        if (errno == EPIPE || errno == ECONNRESET) {
+            free(packed);
+            return -1;
+        }
+        fprintf(stderr, "%s: ERROR writing to socket\n", cfg->name);
+        exit(1);
+    }
+    free(packed);
+
+    ssize_t reply_length = readReplyV2(socketFD, cfg, out, outCap, &hdr);
+    if (reply_length >= 0 && cfg->packed && !(hdr.flags & OTP_FLAG_PACKED)) {
+        fprintf(stderr, "%s: server does not support packed messages\n", cfg->name);
+        exit(2);
+    }
+    return reply_length;
+}
+
+/*
+* Send the handshake, text and key to the server with the version 1 protocol
+* and read the reply into out until the server closes the connection.
+* Each of text and key is followed by the '|' that ends it in this protocol.
+* Returns the reply length.
+*/
+static inline ssize_t requestLegacy(int socketFD, const struct client_config* cfg,
+                                    const char* text, size_t text_len,
+                                    const char* key, size_t key_len,
+                                    char* out, size_t outCap)
+{
+    char handshake[32];
+    int handshake_len = snprintf(handshake, sizeof(handshake), "%s|", cfg->client_name);
+
+    // Inform the server which client is trying to connect, then send the
+    // message and key (keep sending fragments until each is fully sent over)
+    struct iovec iov[5] = {
+        { handshake, handshake_len },
+        { (void*)text, text_len },
+        { "|", 1 },
+        { (void*)key, key_len },
+        { "|", 1 },
+    };
+    if (otpSendAllv(socketFD, iov, 5) < 0)
+    {
+        fprintf(stderr, "%s: ERROR writing to socket\n", cfg->name);
+        exit(1);
+    }
+
+    // The server closes the connection once the whole reply has been sent
+    ssize_t charsRead = otpRecvAll(socketFD, out, outCap);
+    if (charsRead < 0){
+        fprintf(stderr, "%s: ERROR reading from socket\n", cfg->name);
+        exit(2);
+    }
+    return charsRead;
+}
+
+// Write all len bytes of buf to fd. Returns 0, or -1 with errno set if that fails.
+static inline int writeFull(int fd, const char* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t charsWritten = write(fd, buf, len);
+        if (charsWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += charsWritten;
+        len -= charsWritten;
+    }
+    return 0;
+}
+
+// Write all len bytes of buf to fd, exiting if that fails
+static inline void writeAll(int fd, const char* buf, size_t len, const struct client_config* cfg)
+{
+    if (writeFull(fd, buf, len) < 0) {
+        fprintf(stderr, "%s: ERROR writing output: %s\n", cfg->name, strerror(errno));
+        exit(1);
+    }
+}
+
+/*
+* Measure the message at the start of a file: everything up to the first
+* newline or the end of the file. The file is mapped SCAN_WINDOW bytes at a
+* time, populated up front rather than a page fault at a time, and each
+* window is checked and searched for the newline in the same pass straight
+* from the page cache, so nothing is copied and memory use does not grow
+* with the file. Returns the length of the message, or -1 if it
+* contains anything other than A-Z and space, in which case *bad is set to
+* the offset of the first such character, or if the file cannot be mapped.
+* A pipe or anything else but a regular file has no length to measure, so
+* it gets -1 with errno set to ESPIPE rather than a length of 0.
+*/
+static inline off_t scanFile(int fd, off_t* bad)
+{
+    struct stat st;
+    off_t length = 0;
+
+    *bad = -1;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = ESPIPE;
+        return -1;
+    }
+    while (length < st.st_size)
+    {
+        size_t window = st.st_size - length < (off_t)SCAN_WINDOW ? (size_t)(st.st_size - length) : SCAN_WINDOW;
+        const char* map = mmap(NULL, window, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, length);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        size_t n = otpScanText(map, window);
+        int stop = n < window;
+        int newline = stop && map[n] == '\n';
+        munmap((void*)map, window);
+        length += n;
+        if (stop) {
+            if (!newline) {
+                *bad = length;
+                return -1;
+            }
+            break;
+        }
+    }
+    return length;
+}
+
+/*
+* Map the first cap bytes of path, or all of it if it is shorter, and check
+* the message at its start in the same pass that finds its end, so it can be
+* sent straight from the page cache. A pipe or other file that cannot be
+* mapped is read into memory instead. Returns the message's bytes, of which
+* there are *mapLen, kept for the life of the process, and sets *length to
+* the length of the message. With whole set the message must end, at a
+* newline or the end of the file, within cap characters, since the rest of
+* it would otherwise be left unsent; a key needs only the part the message
+* uses. Exits if the file cannot be read, the message is too long or it
+* contains anything other than A-Z and space.
+*/
+static inline const char* mapMessage(const struct client_config* cfg, const char* path,
+                                     size_t cap, int whole, size_t* mapLen, size_t* length)
+{
+    // One character past cap tells a message that fits from one that does not
+    size_t limit = whole ? cap + 1 : cap;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: ERROR opening \"%s\"\n", cfg->name, path);
+        exit(1);
+    }
+    const char* map = "";
+    if (S_ISREG(st.st_mode))
+    {
+        *mapLen = st.st_size < (off_t)limit ? (size_t)st.st_size : limit;
+        if (*mapLen > 0) {
+            map = mmap(NULL, *mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+    }
+    else
+    {
+        char* buf = malloc(limit + 1);
+        ssize_t charsRead = 0;
+        *mapLen = 0;
+        while (buf != NULL && *mapLen < limit && (charsRead = read(fd, buf + *mapLen, limit - *mapLen)) != 0) {
+            if (charsRead < 0 && errno != EINTR) {
+                break;
+            }
+            *mapLen += charsRead > 0 ? charsRead : 0;
+        }
+        map = charsRead < 0 ? NULL : buf;
+    }
+    if (map == NULL || map == MAP_FAILED) {
+        fprintf(stderr, "%s: ERROR reading \"%s\": %s\n", cfg->name, path, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+
+    *length = otpScanText(map, *mapLen);
+    if (*length < *mapLen && map[*length] != '\n') {
+        fprintf(stderr, "%s: file \"%s\" contains invalid characters at offset %zu\n",
+                cfg->name, path, *length);
+        exit(1);
+    }
+    if (*length > cap) {
+        fprintf(stderr, "%s: message in \"%s\" is longer than the %zu characters that can be sent in one request\n",
+                cfg->name, path, cap);
+        exit(1);
+    }
+    return map;
+}
+
+/*
+* Read len bytes of fd at *offset into buf and move *offset past them.
+* Returns 0, or -1 once it has reported that the file is short or unreadable.
+*/
+static inline int readAt(int fd, char* buf, size_t len, off_t* offset, const struct client_config* cfg)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t charsRead = pread(fd, buf + got, len - got, *offset + got);
+        if (charsRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (charsRead <= 0) {
+            fprintf(stderr, "%s: ERROR reading input file\n", cfg->name);
+            return -1;
+        }
+        got += charsRead;
+    }
+    *offset += len;
+    return 0;
+}
+
+/*
+* Read up to len bytes of fd into buf, at *offset if that is not -1 and
+* moving it past them, or from wherever a pipe or the like has got to
+* otherwise. Stops short only at the end of the file. Returns the number of
+* bytes read, or -1 once it has reported that the file cannot be read.
+*/
+static inline ssize_t readSome(int fd, char* buf, size_t len, off_t* offset, const struct client_config* cfg)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t charsRead = *offset >= 0 ? pread(fd, buf + got, len - got, *offset + got)
+                                         : read(fd, buf + got, len - got);
+        if (charsRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (charsRead < 0) {
+            fprintf(stderr, "%s: ERROR reading input file: %s\n", cfg->name, strerror(errno));
+            return -1;
+        }
+        if (charsRead == 0) {
+            break;
+        }
+        got += charsRead;
+    }
+    if (*offset >= 0) {
+        *offset += got;
+    }
+    return got;
+}
+
+/*
+* Read the next chunk of a message of unknown length: up to most characters
+* of text from inputFD into text, stopping at its first newline or its end,
+* then as many of the key from keyFD into key, each at its offset unless that
+* is -1 (see readSome()). Sets *ended once the text is over. Returns the
+* number of characters read, or -1 once it has reported that either could
+* not be read or has anything other than A-Z and space in it, or that the
+* key ran out first.
+*/
+static inline ssize_t readStreamChunk(const struct client_config* cfg, int inputFD, int keyFD,
+                                     char* text, char* key, size_t most,
+                                     off_t* textOffset, off_t* keyOffset, int* ended)
+{
+    off_t start = *textOffset;
+    ssize_t got = readSome(inputFD, text, most, textOffset, cfg);
+    if (got < 0) {
+        return -1;
+    }
+    size_t n = got;
+    size_t valid = otpScanText(text, n);
+    if (valid < n && text[valid] != '\n') {
+        fprintf(stderr, "%s: input contains invalid characters\n", cfg->name);
+        return -1;
+    }
+    *ended = valid < most;
+    n = valid;
+    // A file is read again from after the message's last character next time
+    if (start >= 0) {
+        *textOffset = start + n;
+    }
+
+    ssize_t keyRead = readSome(keyFD, key, n, keyOffset, cfg);
+    if (keyRead < 0) {
+        return -1;
+    }
+    size_t keyValid = otpScanText(key, keyRead);
+    if (keyValid < (size_t)keyRead && key[keyValid] != '\n') {
+        fprintf(stderr, "%s: key contains invalid characters\n", cfg->name);
+        return -1;
+    }
+    if (keyValid < n) {
+        fprintf(stderr, "%s: Key length is too short\n", cfg->name);
+        return -1;
+    }
+    return n;
+}
+
+/*
+* Stream text_len bytes of text and key from the two files through the server
+* and write the transformed text to outFD as it comes back, followed by a
+* newline. flags are added to the request, so OTP_FLAG_SESSION keeps the
+* connection open for another stream afterwards. The request goes
+* out in OTP_MAX_CHUNK-sized chunks while the reply is read concurrently, so
+* memory use is bounded by the chunk size rather than the message size.
+* The text and key of each chunk are sent with sendfile(), straight from the
+* page cache, so the client never copies them through its own buffers.
+* With cfg->packed they are read and packed instead, and so is the reply.
+* A text_len of -1 streams a message of unknown length, such as one coming
+* down a pipe: each chunk of text and key is read into memory, from the
+* start of a file or from wherever a pipe has got to, and checked before it
+* is sent, and the message ends at the text's first newline or its end.
+* Returns 0, or once the failure has been reported, the status a client
+* sending just this message exits with: 1 if the server refused or was busy
+* or a file could not be used, 2 if the connection or protocol failed. The
+* connection is then in no state to carry another stream.
+*/
+static inline int streamV2(int socketFD, const struct client_config* cfg,
+                            int inputFD, int keyFD, off_t text_len, int outFD, uint16_t flags)
+{
+    struct otp_header hdr;
+    unsigned char header[OTP_HEADER_SIZE];
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version = OTP_VERSION;
+    hdr.opcode = cfg->opcode;
+    hdr.flags = OTP_FLAG_STREAM | flags | (cfg->packed ? OTP_FLAG_PACKED : 0);
+    hdr.payload_len = text_len;
+    hdr.key_len = text_len;
+    otpEncodeHeader(header, &hdr);
+    if (otpSendAll(socketFD, header, sizeof(header)) < 0) {
+        fprintf(stderr, "%s: ERROR writing to socket\n", cfg->name);
+        return 1;
+    }
+
+    // Chunks are already sent as whole as the socket allows, so Nagle's
+    // algorithm would only hold the tail of each one back until a delayed ACK
+    int one = 1;
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // The chunk being sent: its length, then n bytes from each file
+    unsigned char chunk_out[OTP_CHUNK_HEADER];
+    size_t chunk_n = 0, chunk_len = 0, chunk_sent = 0;
+    off_t text_offset = 0, key_offset = 0;
+    off_t remaining = text_len;
+    int input_done = 0;
+    // A message of unknown length is read through buffers, from pipes as they come
+    int unknown = text_len < 0;
+    int text_ended = 0;
+    off_t text_sent = 0;
+    struct stat st;
+    if (unknown) {
+        text_offset = fstat(inputFD, &st) == 0 && S_ISREG(st.st_mode) ? 0 : -1;
+        key_offset = fstat(keyFD, &st) == 0 && S_ISREG(st.st_mode) ? 0 : -1;
+    }
+
+    // The reply as it is read back
+    char* reply = malloc(OTP_MAX_CHUNK);
+    // With packing, the chunk being sent is built here from the files, and
+    // reply chunks are gathered here until they can be unpacked
+    // A message of unknown length goes out from there too, its text and key
+    // read into plain and key_plain
+    int buffered = cfg->packed || unknown;
+    size_t packed_cap = OTP_CHUNK_HEADER + 2 * (cfg->packed ? otpPackedSize(PACKED_CHUNK) : OTP_MAX_CHUNK);
+    unsigned char* packed_out = buffered ? malloc(packed_cap) : NULL;
+    unsigned char* packed_in = cfg->packed ? malloc(otpPackedSize(OTP_MAX_CHUNK)) : NULL;
+    char* plain = buffered ? malloc(OTP_MAX_CHUNK) : NULL;
+    char* key_plain = unknown ? malloc(OTP_MAX_CHUNK) : NULL;
+    size_t packed_got = 0;
+    size_t chunk_symbols = 0;
+    int rc = 0;
+    if (reply == NULL || (buffered && (packed_out == NULL || plain == NULL)) || (cfg->packed && packed_in == NULL) ||
+        (unknown && key_plain == NULL)) {
+        fprintf(stderr, "%s: out of memory\n", cfg->name);
+        rc = 1;
+        goto done;
+    }
+
+    // Reply parser: the stream header, then chunk lengths and chunk data
+    unsigned char reply_header[OTP_HEADER_SIZE];
+    size_t header_got = 0;
+    unsigned char chunk_header[OTP_CHUNK_HEADER];
+    size_t chunk_header_got = 0;
+    size_t chunk_left = 0;
+    off_t received = 0;
+    int finished = 0;
+
+    fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) | O_NONBLOCK);
+    while (!finished)
+    {
+        // Start the next chunk once the previous one is out; a chunk of
+        // length 0 tells the server the message is over
+        if (chunk_sent == chunk_len && !input_done)
+        {
+            size_t most = cfg->packed ? PACKED_CHUNK : OTP_MAX_CHUNK;
+            if (unknown) {
+                ssize_t got = text_ended ? 0 : readStreamChunk(cfg, inputFD, keyFD, plain, key_plain, most,
+                                                               &text_offset, &key_offset, &text_ended);
+                if (got < 0) {
+                    rc = 1;
+                    goto done;
+                }
+                chunk_n = got;
+                text_sent += chunk_n;
+            } else {
+                chunk_n = remaining < (off_t)most ? (size_t)remaining : most;
+            }
+            otpEncodeChunk(chunk_out, chunk_n);
+            chunk_len = OTP_CHUNK_HEADER + 2 * chunk_n;
+            if (unknown) {
+                size_t body_n = cfg->packed ? otpPackedSize(chunk_n) : chunk_n;
+                if (cfg->packed) {
+                    otpPack(packed_out + OTP_CHUNK_HEADER, plain, chunk_n);
+                    otpPack(packed_out + OTP_CHUNK_HEADER + body_n, key_plain, chunk_n);
+                } else {
+                    memcpy(packed_out + OTP_CHUNK_HEADER, plain, chunk_n);
+                    memcpy(packed_out + OTP_CHUNK_HEADER + chunk_n, key_plain, chunk_n);
+                }
+                memcpy(packed_out, chunk_out, OTP_CHUNK_HEADER);
+                chunk_len = OTP_CHUNK_HEADER + 2 * body_n;
+            } else if (cfg->packed) {
+                size_t packed_n = otpPackedSize(chunk_n);
+                if (readAt(inputFD, plain, chunk_n, &text_offset, cfg) < 0) {
+                    rc = 1;
+                    goto done;
+                }
+                otpPack(packed_out + OTP_CHUNK_HEADER, plain, chunk_n);
+                if (readAt(keyFD, plain, chunk_n, &key_offset, cfg) < 0) {
+                    rc = 1;
+                    goto done;
+                }
+                otpPack(packed_out + OTP_CHUNK_HEADER + packed_n, plain, chunk_n);
+                memcpy(packed_out, chunk_out, OTP_CHUNK_HEADER);
+                chunk_len = OTP_CHUNK_HEADER + 2 * packed_n;
+            }
+            chunk_sent = 0;
+            remaining -= chunk_n;
+            input_done = chunk_n == 0;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = socketFD;
+        pfd.events = POLLIN | (chunk_sent < chunk_len ? POLLOUT : 0);
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: ERROR waiting on socket\n", cfg->name);
+            rc = 1;
+            goto done;
+        }
+
+        // Send as much of the chunk as the socket takes; sendfile() advances
+        // the file offsets by itself
+        while ((pfd.revents & POLLOUT) && chunk_sent < chunk_len)
+        {
+            ssize_t charsWritten;
+            if (buffered) {
+                charsWritten = send(socketFD, packed_out + chunk_sent, chunk_len - chunk_sent, MSG_NOSIGNAL);
+            } else if (chunk_sent < OTP_CHUNK_HEADER) {
+                charsWritten = send(socketFD, chunk_out + chunk_sent, OTP_CHUNK_HEADER - chunk_sent,
+                                    MSG_NOSIGNAL | (chunk_n > 0 ? MSG_MORE : 0));
+            } else if (chunk_sent < OTP_CHUNK_HEADER + chunk_n) {
+                charsWritten = sendfile(socketFD, inputFD, &text_offset, OTP_CHUNK_HEADER + chunk_n - chunk_sent);
+            } else {
+                charsWritten = sendfile(socketFD, keyFD, &key_offset, chunk_len - chunk_sent);
+            }
+            if (charsWritten == 0) {
+                fprintf(stderr, "%s: ERROR reading input file\n", cfg->name);
+                rc = 1;
+                goto done;
+            }
+            if (charsWritten < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                // A version 1 server hangs up on the header without replying
+                if (header_got == 0 && (errno == EPIPE || errno == ECONNRESET)) {
+                    fprintf(stderr, "%s: server does not support streaming\n", cfg->name);
+                } else {
+                    fprintf(stderr, "%s: ERROR writing to socket\n", cfg->name);
+                }
+                rc = 1;
+                goto done;
+            }
+            chunk_sent += charsWritten;
+        }
+
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        ssize_t charsRead = recv(socketFD, reply, OTP_MAX_CHUNK, 0);
+        if (charsRead < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: ERROR reading from socket\n", cfg->name);
+            rc = 2;
+            goto done;
+        }
+        if (charsRead == 0) {
+            if (header_got < OTP_HEADER_SIZE) {
+                fprintf(stderr, "%s: server does not support streaming\n", cfg->name);
+            } else {
+                fprintf(stderr, "%s: server closed the stream early\n", cfg->name);
+            }
+            rc = 2;
+            goto done;
+        }
+
+        // Walk the bytes just received, writing chunk data straight to the output
+        char* p = reply;
+        char* end = reply + charsRead;
+        while (p < end && !finished)
+        {
+            if (header_got < OTP_HEADER_SIZE)
+            {
+                size_t take = OTP_HEADER_SIZE - header_got;
+                if (take > (size_t)(end - p)) {
+                    take = end - p;
+                }
+                memcpy(reply_header + header_got, p, take);
+                header_got += take;
+                p += take;
+                if (header_got < OTP_HEADER_SIZE) {
+                    break;
+                }
+                if (otpDecodeHeader(reply_header, &hdr) < 0) {
+                    fprintf(stderr, "%s: ERROR reading reply header from server\n", cfg->name);
+                    rc = 2;
+                    goto done;
+                }
+                if (hdr.opcode == OTP_OP_ERROR) {
+                    fprintf(stderr, "%s: server refused request: %.*s\n", cfg->name,
+                            (int)(end - p < (long)hdr.payload_len ? end - p : (long)hdr.payload_len), p);
+                    rc = 1;
+                    goto done;
+                }
+                if (hdr.opcode == OTP_OP_BUSY) {
+                    fprintf(stderr, "%s: server is busy, try again later\n", cfg->name);
+                    rc = 1;
+                    goto done;
+                }
+                if (cfg->packed && !(hdr.flags & OTP_FLAG_PACKED)) {
+                    fprintf(stderr, "%s: server does not support packed messages\n", cfg->name);
+                    rc = 2;
+                    goto done;
+                }
+            }
+            else if (chunk_left == 0)
+            {
+                chunk_header[chunk_header_got++] = *p++;
+                if (chunk_header_got < OTP_CHUNK_HEADER) {
+                    continue;
+                }
+                chunk_header_got = 0;
+                chunk_left = otpDecodeChunk(chunk_header);
+                finished = chunk_left == 0;
+                if (cfg->packed) {
+                    if (chunk_left > OTP_MAX_CHUNK) {
+                        fprintf(stderr, "%s: reply chunk from server is too long\n", cfg->name);
+                        rc = 2;
+                        goto done;
+                    }
+                    chunk_symbols = chunk_left;
+                    chunk_left = otpPackedSize(chunk_symbols);
+                    packed_got = 0;
+                }
+            }
+            else
+            {
+                size_t take = chunk_left;
+                if (take > (size_t)(end - p)) {
+                    take = end - p;
+                }
+                if (cfg->packed) {
+                    // A packed chunk is unpacked and written once all of it is in
+                    memcpy(packed_in + packed_got, p, take);
+                    packed_got += take;
+                    if (take == chunk_left) {
+                        otpUnpack(plain, packed_in, chunk_symbols);
+                        if (writeFull(outFD, plain, chunk_symbols) < 0) {
+                            fprintf(stderr, "%s: ERROR writing output: %s\n", cfg->name, strerror(errno));
+                            rc = 1;
+                            goto done;
+                        }
+                        received += chunk_symbols;
+                    }
+                } else {
+                    if (writeFull(outFD, p, take) < 0) {
+                        fprintf(stderr, "%s: ERROR writing output: %s\n", cfg->name, strerror(errno));
+                        rc = 1;
+                        goto done;
+                    }
+                    received += take;
+                }
+                chunk_left -= take;
+                p += take;
+            }
+        }
+    }
+
+    if (unknown) {
+        text_len = text_sent;
+    }
+    if (received != text_len) {
+        fprintf(stderr, "%s: server returned %lld bytes for a %lld byte message\n",
+                cfg->name, (long long)received, (long long)text_len);
+        rc = 2;
+    } else if (writeFull(outFD, "\n", 1) < 0) {
+        fprintf(stderr, "%s: ERROR writing output: %s\n", cfg->name, strerror(errno));
+        rc = 1;
+    }
+
+done:
+    free(reply);
+    free(packed_out);
+    free(packed_in);
+    free(plain);
+    free(key_plain);
+    return rc;
+}
+
+/*
+* Open the message in inputPath and the key in keyPath into *inputFD and
+* *keyFD, and validate and measure both block by block, without reading
+* either into memory. Returns the length of the message; exits if either
+* file cannot be used or the key is too short.
+*/
+static inline off_t openMessageFiles(const struct client_config* cfg, const char* inputPath,
+                                     const char* keyPath, int* inputFD, int* keyFD)
+{
+    *inputFD = open(inputPath, O_RDONLY);
+    *keyFD = open(keyPath, O_RDONLY);
+    if (*inputFD < 0 || *keyFD < 0) {
+        fprintf(stderr, "%s: ERROR opening \"%s\"\n", cfg->name, *inputFD < 0 ? inputPath : keyPath);
+        exit(1);
+    }
+
+    // Output error and exit if the message or key has ANY invalid characters
+    off_t input_bad, key_bad;
+    off_t input_length = scanFile(*inputFD, &input_bad);
+    off_t key_length = scanFile(*keyFD, &key_bad);
+    if (input_length < 0 || key_length < 0) {
+        const char* path = input_length < 0 ? inputPath : keyPath;
+        off_t bad = input_length < 0 ? input_bad : key_bad;
+        if (bad < 0 && errno == ESPIPE) {
+            fprintf(stderr, "%s: \"%s\" is not a regular file\n", cfg->name, path);
+        } else if (bad < 0) {
+            fprintf(stderr, "%s: ERROR reading \"%s\"\n", cfg->name, path);
+        } else {
+            fprintf(stderr, "%s: file \"%s\" contains invalid characters at offset %lld\n",
+                    cfg->name, path, (long long)bad);
+        }
+        exit(1);
+    }
+    // Terminate if the key is shorter than the message
+    if (key_length < input_length) {
+        fprintf(stderr, "%s: Key length is too short\n", cfg->name);
+        exit(1);
+    }
+    return input_length;
+}
+
+/*
+* Transform the message in inputPath with the key in keyPath by streaming both
+* through the server on portNumber. Used for messages that are too large to
+* read into memory, and for ones coming down a pipe, which are checked and
+* sent a chunk at a time as they arrive since they cannot be measured first.
+*/
+static inline void runStream(const struct client_config* cfg, const char* inputPath,
+                             const char* keyPath, int portNumber)
+{
+    int inputFD = open(inputPath, O_RDONLY);
+    int keyFD = open(keyPath, O_RDONLY);
+    struct stat input_stat, key_stat;
+    if (inputFD < 0 || keyFD < 0) {
+        fprintf(stderr, "%s: ERROR opening \"%s\"\n", cfg->name, inputFD < 0 ? inputPath : keyPath);
+        exit(1);
+    }
+    off_t input_length = -1;
+    if (fstat(inputFD, &input_stat) == 0 && S_ISREG(input_stat.st_mode) &&
+        fstat(keyFD, &key_stat) == 0 && S_ISREG(key_stat.st_mode))
+    {
+        close(inputFD);
+        close(keyFD);
+        input_length = openMessageFiles(cfg, inputPath, keyPath, &inputFD, &keyFD);
+    }
+    if (cfg->legacy) {
+        fprintf(stderr, "%s: file \"%s\" is too large for the version 1 protocol\n", cfg->name, inputPath);
+        exit(1);
+    }
+    if (cfg->keyref) {
+        fprintf(stderr, "%s: file \"%s\" is too large to use with a stored key\n", cfg->name, inputPath);
+        exit(1);
+    }
+
+    // sendfile() has no MSG_NOSIGNAL, so a server hanging up must not kill us
+    signal(SIGPIPE, SIG_IGN);
+    int socketFD = connectServer(portNumber, cfg);
+    int rc = streamV2(socketFD, cfg, inputFD, keyFD, input_length, STDOUT_FILENO, 0);
+    if (rc != 0) {
+        exit(rc);
+    }
+    close(socketFD);
+    close(inputFD);
+    close(keyFD);
+}
+
+/*
+* Create size bytes of memory to share with the server and map it at *map.
+* The memfd is sealed at that size, since the server only maps memory that
+* can never shrink under it. Returns the memfd to pass to the server.
+*/
+static inline int sharedCreate(const struct client_config* cfg, size_t size, char** map)
+{
+    int fd = memfd_create("otp_shared", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0 || ftruncate(fd, size) < 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+    {
+        fprintf(stderr, "%s: ERROR creating shared memory: %s\n", cfg->name, strerror(errno));
+        exit(1);
+    }
+    *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*map == MAP_FAILED) {
+        fprintf(stderr, "%s: ERROR mapping shared memory: %s\n", cfg->name, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+// Like send(), but passing passFd to the server along with the bytes unless it is -1
+static inline ssize_t sendWithFd(int socketFD, const void* buf, size_t len, int passFd)
+{
+    if (passFd < 0) {
+        return send(socketFD, buf, len, MSG_NOSIGNAL);
+    }
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { (void*)buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &passFd, sizeof(int));
+    return sendmsg(socketFD, &msg, MSG_NOSIGNAL);
+}
+
+/*
+* Transform the message in inputPath with the key in keyPath through shared
+* memory: both files are read straight into a memfd that goes to the server
+* over its Unix domain socket with a request naming where they are, and the
+* server leaves the result in place of the text. Nothing but the header and
+* the two offsets crosses the socket, so a message of any size up to
+* OTP_SHARED_MAX goes in one request.
+*/
+static inline void runShared(const struct client_config* cfg, const char* inputPath,
+                             const char* keyPath, int portNumber)
+{
+    if (cfg->legacy || cfg->keyref || cfg->packed) {
+        fprintf(stderr, "%s: shared memory takes the key from a file and does not go with -L or -P\n",
+                cfg->name);
+        exit(1);
+    }
+    int inputFD, keyFD;
+    size_t text_len = openMessageFiles(cfg, inputPath, keyPath, &inputFD, &keyFD);
+    if (text_len > OTP_SHARED_MAX / 2) {
+        fprintf(stderr, "%s: file \"%s\" is too large to share with the server\n", cfg->name, inputPath);
+        exit(1);
+    }
+
+    // The text, then as much of the key as the text needs
+    char* shared;
+    int sharedFD = sharedCreate(cfg, text_len > 0 ? 2 * text_len : 1, &shared);
+    off_t offset = 0;
+    off_t key_offset = 0;
+    if (readAt(inputFD, shared, text_len, &offset, cfg) < 0 ||
+        readAt(keyFD, shared + text_len, text_len, &key_offset, cfg) < 0) {
+        exit(1);
+    }
+    close(inputFD);
+    close(keyFD);
+
+    struct otp_header hdr;
+    unsigned char frame[OTP_HEADER_SIZE + OTP_SHARED_REF_SIZE];
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version = OTP_VERSION;
+    hdr.opcode = cfg->opcode;
+    hdr.flags = OTP_FLAG_SHARED;
+    hdr.payload_len = text_len;
+    hdr.key_len = text_len;
+    otpEncodeHeader(frame, &hdr);
+    otpEncodeShared(frame + OTP_HEADER_SIZE, 0, text_len);
+
+    int socketFD = connectServer(portNumber, cfg);
+    ssize_t charsWritten = sendWithFd(socketFD, frame, sizeof(frame), sharedFD);
+    if (charsWritten < 0 || otpSendAll(socketFD, frame + charsWritten, sizeof(frame) - charsWritten) < 0) {
+        fprintf(stderr, "%s: ERROR writing to socket\n", cfg->name);
+        exit(1);
+    }
+    close(sharedFD);
+    ssize_t reply_length = readReplyV2(socketFD, cfg, shared, text_len, &hdr);
+    if (reply_length < 0 || !(hdr.flags & OTP_FLAG_SHARED)) {
+        fprintf(stderr, "%s: server does not support shared memory\n", cfg->name);
+        exit(2);
+    }
+    close(socketFD);
+
+    writeAll(STDOUT_FILENO, shared, reply_length, cfg);
+    writeAll(STDOUT_FILENO, "\n", 1, cfg);
+    munmap(shared, text_len > 0 ? 2 * text_len : 1);
+}
+
+/*
+* The messages of a shared session that are in flight, laid out one after
+* another in a ring of shared memory. Replies come back in order, so the
+* oldest message is always the next to be freed.
+*/
+struct shared_ring {
+    char* base;
+    size_t size;
+    size_t write;           // Where the message after the newest one goes
+    size_t* starts;         // Offset of every message in flight, oldest first, in a circular queue
+    size_t queue_cap;
+    size_t queue_head;
+    size_t queue_count;
+};
+
+/*
+* Find room for len bytes after the newest message in flight, wrapping to
+* the start of the ring if they do not fit before its end. Sets *offset and
+* returns 1, or returns 0 if replies have to free some of the ring first.
+*/
+static inline int sharedRingAlloc(const struct client_config* cfg, struct shared_ring* ring,
+                                  size_t len, size_t* offset)
+{
+    if (ring->queue_count == 0) {
+        ring->write = 0;
+    }
+    size_t read = ring->queue_count > 0 ? ring->starts[ring->queue_head] : 0;
+    size_t at;
+    if (ring->write >= read) {
+        // In flight: [read, write), free on both sides of it
+        if (ring->write + len <= ring->size) {
+            at = ring->write;
+        } else if (len < read) {
+            at = 0;
+        } else {
+            return 0;
+        }
+    } else {
+        // In flight: [read, size) and [0, write), free in between. Keeping
+        // write strictly below read tells this case apart from the first.
+        if (ring->write + len < read) {
+            at = ring->write;
+        } else {
+            return 0;
+        }
+    }
+
+    if (ring->queue_count == ring->queue_cap) {
+        size_t cap = ring->queue_cap > 0 ? 2 * ring->queue_cap : 64;
+        size_t* starts = malloc(cap * sizeof(size_t));
+        if (starts == NULL) {
+            fprintf(stderr, "%s: out of memory\n", cfg->name);
+            exit(1);
+        }
+        for (size_t i = 0; i < ring->queue_count; i++)
+        {
+            starts[i] = ring->starts[(ring->queue_head + i) % ring->queue_cap];
+        }
+        free(ring->starts);
+        ring->starts = starts;
+        ring->queue_cap = cap;
+        ring->queue_head = 0;
+    }
+    ring->starts[(ring->queue_head + ring->queue_count) % ring->queue_cap] = at;
+    ring->queue_count++;
+    ring->write = at + len;
+    *offset = at;
+    return 1;
+}
+
+// Free the oldest message in flight once its reply is in. Returns its offset.
+static inline size_t sharedRingRelease(struct shared_ring* ring)
+{
+    size_t start = ring->starts[ring->queue_head];
+    ring->queue_head = (ring->queue_head + 1) % ring->queue_cap;
+    ring->queue_count--;
+    return start;
+}
+
+/*
+* Transform every line of inputPath as a separate message over one version 2
+* session, and print one line of output per line of input. Each message
+* takes its own stretch of the key in keyPath, starting where the previous
+* one's ended, since reusing any part of a pad gives it away. Requests are pipelined: lines go out as fast as
+* the socket takes them while the replies, which the server sends in order,
+* are read back concurrently. With cfg->shared each line and its key are
+* written into a ring of shared memory instead, and only the header and
+* their offsets are sent. Returns 1 if the server refused any message.
+*/
+static inline int runSession(const struct client_config* cfg, const char* inputPath,
+                             const char* keyPath, int portNumber)
+{
+    FILE* input = fopen(inputPath, "r");
+    FILE* key_file = fopen(keyPath, "r");
+    if (input == NULL || key_file == NULL) {
+        fprintf(stderr, "%s: ERROR opening \"%s\"\n", cfg->name, input == NULL ? inputPath : keyPath);
+        exit(1);
+    }
+    if (cfg->legacy) {
+        fprintf(stderr, "%s: sessions need the version 2 protocol\n", cfg->name);
+        exit(1);
+    }
+    if (cfg->keyref) {
+        fprintf(stderr, "%s: sessions take their key from a file\n", cfg->name);
+        exit(1);
+    }
+    if (cfg->shared && cfg->packed) {
+        fprintf(stderr, "%s: shared memory does not go with -P\n", cfg->name);
+        exit(1);
+    }
+
+    // The key's first line is shared out between the messages in order
+    char* key = NULL;
+    size_t key_cap = 0;
+    ssize_t key_length = getline(&key, &key_cap, key_file);
+    fclose(key_file);
+    if (key_length < 0) {
+        key_length = 0;
+    }
+    if (key_length > 0 && key[key_length - 1] == '\n') {
+        key_length--;
+    }
+    size_t key_bad = otpScanText(key, key_length);
+    if (key_bad < (size_t)key_length) {
+        fprintf(stderr, "%s: file \"%s\" contains invalid characters at offset %zu\n",
+                cfg->name, keyPath, key_bad);
+        exit(1);
+    }
+
+    int socketFD = connectServer(portNumber, cfg);
+    fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) | O_NONBLOCK);
+
+    // The memfd goes to the server with the first request and is closed once it has
+    struct shared_ring ring;
+    int shared_fd = -1;
+    memset(&ring, 0, sizeof(ring));
+    if (cfg->shared) {
+        ring.size = SHARED_RING_SIZE;
+        shared_fd = sharedCreate(cfg, ring.size, &ring.base);
+    }
+
+    // The requests being sent, and a line read but still waiting for room in the ring
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len = 0;
+    int line_held = 0;
+    char* frame = NULL;
+    size_t frame_cap = 0, frame_len = 0, frame_sent = 0;
+    int input_done = 0;
+    int write_shut = 0;
+    long sent = 0;
+    size_t key_used = 0;
+
+    // Reply parser: a header, then payload_len bytes of text or refusal
+    char reply[OTP_MAX_CHUNK];
+    unsigned char reply_header[OTP_HEADER_SIZE];
+    size_t header_got = 0;
+    uint64_t payload_left = 0;
+    int is_error = 0;
+    char refusal[256];
+    size_t refusal_len = 0;
+    long answered = 0;
+    int refused = 0;
+
+    // Packed replies are gathered whole, then unpacked
+    unsigned char* packed_reply = NULL;
+    char* unpacked = NULL;
+    if (cfg->packed) {
+        packed_reply = malloc(otpPackedSize(SESSION_MAX_LINE));
+        unpacked = malloc(SESSION_MAX_LINE);
+        if (packed_reply == NULL || unpacked == NULL) {
+            fprintf(stderr, "%s: out of memory\n", cfg->name);
+            exit(1);
+        }
+    }
+    size_t packed_got = 0;
+    uint64_t reply_symbols = 0;
+
+    while (!input_done || answered < sent)
+    {
+        // Queue lines while less than SESSION_BATCH of requests waits to go
+        // out, so short requests leave many to a send rather than one each
+        if (frame_sent > 0) {
+            memmove(frame, frame + frame_sent, frame_len - frame_sent);
+            frame_len -= frame_sent;
+            frame_sent = 0;
+        }
+        while (!input_done && frame_len - frame_sent < SESSION_BATCH)
+        {
+            if (!line_held)
+            {
+                ssize_t n = getline(&line, &line_cap, input);
+                if (n < 0) {
+                    input_done = 1;
+                    break;
+                }
+                if (n > 0 && line[n - 1] == '\n') {
+                    n--;
+                }
+                size_t bad = otpScanText(line, n);
+                if (bad < (size_t)n) {
+                    fprintf(stderr, "%s: file \"%s\" contains invalid characters on line %ld at column %zu\n",
+                            cfg->name, inputPath, sent + 1, bad + 1);
+                    exit(1);
+                }
+                if (n > SESSION_MAX_LINE) {
+                    fprintf(stderr, "%s: line %ld of \"%s\" is too long for a session\n", cfg->name, sent + 1, inputPath);
+                    exit(1);
+                }
+                if ((size_t)key_length - key_used < (size_t)n) {
+                    fprintf(stderr, "%s: Key length is too short for line %ld of \"%s\"\n",
+                            cfg->name, sent + 1, inputPath);
+                    exit(1);
+                }
+                line_len = n;
+                line_held = 1;
+            }
+            // A full ring holds the line back until replies free some of it
+            size_t slot = 0;
+            if (cfg->shared && !sharedRingAlloc(cfg, &ring, 2 * line_len, &slot)) {
+                break;
+            }
+
+            ssize_t n = line_len;
+            size_t body = cfg->packed ? otpPackedSize(n) : (size_t)n;
+            size_t need = OTP_HEADER_SIZE + (cfg->shared ? OTP_SHARED_REF_SIZE : 2 * body);
+            if (frame_cap < frame_len + need) {
+                size_t cap = frame_len + need > 2 * frame_cap ? frame_len + need : 2 * frame_cap;
+                frame = realloc(frame, cap);
+                if (frame == NULL) {
+                    fprintf(stderr, "%s: out of memory\n", cfg->name);
+                    exit(1);
+                }
+                frame_cap = cap;
+            }
+            char* request = frame + frame_len;
+            struct otp_header hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.version = OTP_VERSION;
+            hdr.opcode = cfg->opcode;
+            hdr.flags = OTP_FLAG_SESSION | (cfg->packed ? OTP_FLAG_PACKED : 0) | (cfg->shared ? OTP_FLAG_SHARED : 0);
+            hdr.payload_len = n;
+            hdr.key_len = n;
+            otpEncodeHeader((unsigned char*)request, &hdr);
+            if (cfg->shared) {
+                memcpy(ring.base + slot, line, n);
+                memcpy(ring.base + slot + n, key + key_used, n);
+                otpEncodeShared((unsigned char*)request + OTP_HEADER_SIZE, slot, slot + n);
+            } else if (cfg->packed) {
+                otpPack((unsigned char*)request + OTP_HEADER_SIZE, line, n);
+                otpPack((unsigned char*)request + OTP_HEADER_SIZE + body, key + key_used, n);
+            } else {
+                memcpy(request + OTP_HEADER_SIZE, line, n);
+                memcpy(request + OTP_HEADER_SIZE + n, key + key_used, n);
+            }
+            key_used += n;
+            frame_len += need;
+            line_held = 0;
+            sent++;
+        }
+        // The write side is shut down after the last request to end the session
+        if (input_done && frame_sent == frame_len && !write_shut) {
+            shutdown(socketFD, SHUT_WR);
+            write_shut = 1;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = socketFD;
+        pfd.events = POLLIN | (frame_sent < frame_len ? POLLOUT : 0);
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: ERROR waiting on socket\n", cfg->name);
+            exit(1);
+        }
+
+        if ((pfd.revents & POLLOUT) && frame_sent < frame_len)
+        {
+            ssize_t charsWritten = sendWithFd(socketFD, frame + frame_sent, frame_len - frame_sent, shared_fd);
+            if (charsWritten < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                // A version 1 server hangs up on the header without replying
+                if (answered == 0 && header_got == 0 && (errno == EPIPE || errno == ECONNRESET)) {
+                    fprintf(stderr, "%s: server does not support sessions\n", cfg->name);
+                } else {
+                    fprintf(stderr, "%s: ERROR writing to socket\n", cfg->name);
+                }
+                exit(1);
+            }
+            if (charsWritten > 0) {
+                frame_sent += charsWritten;
+                if (shared_fd >= 0) {
+                    close(shared_fd);
+                    shared_fd = -1;
+                }
+            }
+        }
+
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        ssize_t charsRead = recv(socketFD, reply, sizeof(reply), 0);
+        if (charsRead < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            if (errno != ECONNRESET) {
+                fprintf(stderr, "%s: ERROR reading from socket\n", cfg->name);
+                exit(2);
+            }
+        }
+        if (charsRead <= 0) {
+            if (answered == 0 && header_got == 0) {
+                fprintf(stderr, "%s: server does not support sessions\n", cfg->name);
+            } else {
+                fprintf(stderr, "%s: server closed the session after %ld of %ld replies\n",
+                        cfg->name, answered, sent);
+            }
+            exit(2);
+        }
+
+        // Walk the bytes just received, one reply at a time
+        char* p = reply;
+        char* end = reply + charsRead;
+        while (p < end)
+        {
+            if (header_got < OTP_HEADER_SIZE)
+            {
+                size_t take = OTP_HEADER_SIZE - header_got;
+                if (take > (size_t)(end - p)) {
+                    take = end - p;
+                }
+                memcpy(reply_header + header_got, p, take);
+                header_got += take;
+                p += take;
+                if (header_got < OTP_HEADER_SIZE) {
+                    break;
+                }
+                struct otp_header hdr;
+                if (otpDecodeHeader(reply_header, &hdr) < 0) {
+                    fprintf(stderr, "%s: ERROR reading reply header from server\n", cfg->name);
+                    exit(2);
+                }
+                // The server hangs up after a busy reply, so the session cannot go on
+                if (hdr.opcode == OTP_OP_BUSY) {
+                    fflush(stdout);
+                    fprintf(stderr, "%s: server is busy, try again later (%ld messages answered)\n",
+                            cfg->name, answered);
+                    exit(1);
+                }
+                payload_left = hdr.payload_len;
+                is_error = hdr.opcode == OTP_OP_ERROR;
+                refusal_len = 0;
+                if ((cfg->packed || cfg->shared) && !is_error) {
+                    if (!(hdr.flags & (cfg->shared ? OTP_FLAG_SHARED : OTP_FLAG_PACKED))) {
+                        fprintf(stderr, "%s: server does not support %s\n", cfg->name,
+                                cfg->shared ? "shared memory" : "packed messages");
+                        exit(2);
+                    }
+                    if (hdr.payload_len > SESSION_MAX_LINE) {
+                        fprintf(stderr, "%s: reply from server is too long\n", cfg->name);
+                        exit(2);
+                    }
+                    // A shared reply is already in the ring, where its text was
+                    reply_symbols = hdr.payload_len;
+                    payload_left = cfg->shared ? 0 : otpPackedSize(reply_symbols);
+                    packed_got = 0;
+                }
+            }
+            else
+            {
+                size_t take = payload_left;
+                if (take > (size_t)(end - p)) {
+                    take = end - p;
+                }
+                if (!is_error && cfg->packed) {
+                    memcpy(packed_reply + packed_got, p, take);
+                    packed_got += take;
+                } else if (!is_error) {
+                    fwrite(p, 1, take, stdout);
+                } else if (refusal_len < sizeof(refusal)) {
+                    size_t keep = take < sizeof(refusal) - refusal_len ? take : sizeof(refusal) - refusal_len;
+                    memcpy(refusal + refusal_len, p, keep);
+                    refusal_len += keep;
+                }
+                payload_left -= take;
+                p += take;
+            }
+
+            // A refused message leaves an empty line so the output stays aligned
+            if (header_got == OTP_HEADER_SIZE && payload_left == 0)
+            {
+                size_t start = cfg->shared ? sharedRingRelease(&ring) : 0;
+                if (is_error) {
+                    fprintf(stderr, "%s: server refused message %ld: %.*s\n", cfg->name,
+                            answered + 1, (int)refusal_len, refusal);
+                    refused = 1;
+                } else if (cfg->shared) {
+                    fwrite(ring.base + start, 1, reply_symbols, stdout);
+                } else if (cfg->packed) {
+                    otpUnpack(unpacked, packed_reply, reply_symbols);
+                    fwrite(unpacked, 1, reply_symbols, stdout);
+                }
+                putchar('\n');
+                answered++;
+                header_got = 0;
+            }
+        }
+    }
+
+    close(socketFD);
+    fclose(input);
+    free(line);
+    free(frame);
+    free(key);
+    free(packed_reply);
+    free(unpacked);
+    if (cfg->shared) {
+        munmap(ring.base, ring.size);
+        free(ring.starts);
+    }
+    return refused;
+}
+
+/*
+* Have the server transform text with a pad from its key store rather than a
+* key from a file, so only the pad's ID and an offset go over the wire. The
+* result goes to stdout; after encryption the offset the server used goes to
+* stderr, since the matching decryption has to name it.
+*/
+static inline void runKeyRef(const struct client_config* cfg, const char* text, size_t text_len,
+                             const char* keyID, int portNumber)
+{
+    size_t bad = otpScanText(text, text_len);
+    if (bad < text_len) {
+        fprintf(stderr, "%s: input contains invalid characters at offset %zu\n", cfg->name, bad);
+        exit(1);
+    }
+    if (cfg->legacy) {
+        fprintf(stderr, "%s: stored keys need the version 2 protocol\n", cfg->name);
+        exit(1);
+    }
+    size_t idLen = strlen(keyID);
+    if (idLen == 0 || idLen > OTP_KEY_ID_MAX) {
+        fprintf(stderr, "%s: key ID \"%s\" must be 1 to %d characters\n", cfg->name, keyID, OTP_KEY_ID_MAX);
+        exit(1);
+    }
+
+    struct otp_header hdr;
+    unsigned char header[OTP_HEADER_SIZE];
+    unsigned char ref[OTP_KEY_OFFSET_SIZE + OTP_KEY_ID_MAX];
+    size_t refLen = otpEncodeKeyRef(ref, cfg->key_offset, keyID, idLen);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version = OTP_VERSION;
+    hdr.opcode = cfg->opcode;
+    hdr.flags = OTP_FLAG_KEYREF;
+    hdr.payload_len = text_len;
+    hdr.key_len = refLen;
+    otpEncodeHeader(header, &hdr);
+
+    int socketFD = connectServer(portNumber, cfg);
+    char* out = malloc(text_len + 1);
+    ssize_t reply_length = -1;
+    if (out == NULL) {
+        fprintf(stderr, "%s: out of memory\n", cfg->name);
+        exit(1);
+    }
+    if (otpSendAll(socketFD, header, sizeof(header)) == 0 &&
+        otpSendAll(socketFD, text, text_len) == 0 &&
+        otpSendAll(socketFD, ref, refLen) == 0)
+    {
+        reply_length = readReplyV2(socketFD, cfg, out, text_len, &hdr);
+    }
+    if (reply_length < 0) {
+        fprintf(stderr, "%s: server does not support stored keys\n", cfg->name);
+        exit(1);
+    }
+    close(socketFD);
+
+    out[reply_length] = '\n';
+    writeAll(STDOUT_FILENO, out, reply_length + 1, cfg);
+    if (cfg->opcode == OTP_OP_ENCRYPT) {
+        fprintf(stderr, "%s: used key \"%s\" at offset %llu\n", cfg->name, keyID,
+                (unsigned long long)hdr.key_len);
+    }
+    free(out);
+}
+
+// One file of a batch: transform input with key and write the result to output
+struct batch_job {
+    char* input;
+    char* key;
+    char* output;
+};
+
+// A batch shared by its worker threads
+struct batch {
+    const struct client_config* cfg;
+    int port;
+    struct batch_job* jobs;
+    size_t count;
+    size_t cap;
+    size_t next;                // Next job to claim, updated atomically
+    int failed;                 // Set once any job fails
+};
+
+// Add a job to the batch, copying its paths
+static inline void batchAdd(struct batch* b, const char* input, const char* key, const char* output)
+{
+    if (b->count == b->cap) {
+        b->cap = b->cap > 0 ? 2 * b->cap : 64;
+        b->jobs = realloc(b->jobs, b->cap * sizeof(*b->jobs));
+        if (b->jobs == NULL) {
+            fprintf(stderr, "%s: out of memory\n", b->cfg->name);
+            exit(1);
+        }
+    }
+    struct batch_job* job = &b->jobs[b->count++];
+    job->input = strdup(input);
+    job->key = strdup(key);
+    job->output = strdup(output);
+    if (job->input == NULL || job->key == NULL || job->output == NULL) {
+        fprintf(stderr, "%s: out of memory\n", b->cfg->name);
+        exit(1);
+    }
+}
+
+/*
+* Read a manifest of "input key output" lines into the batch. Blank lines and
+* lines starting with '#' are skipped. An input containing *, ? or [ is a
+* glob; every file it matches is a job, and output names the directory its
+* result goes to, under the same file name.
+*/
+static inline void batchLoad(struct batch* b, const char* manifestPath)
+{
+    FILE* manifest = fopen(manifestPath, "r");
+    if (manifest == NULL) {
+        fprintf(stderr, "%s: ERROR opening \"%s\"\n", b->cfg->name, manifestPath);
+        exit(1);
+    }
+
+    char* line = NULL;
+    size_t line_cap = 0;
+    long line_number = 0;
+    while (getline(&line, &line_cap, manifest) >= 0)
+    {
+        line_number++;
+        char* save = NULL;
+        char* input = strtok_r(line, " \t\r\n", &save);
+        if (input == NULL || input[0] == '#') {
+            continue;
+        }
+        char* key = strtok_r(NULL, " \t\r\n", &save);
+        char* output = strtok_r(NULL, " \t\r\n", &save);
+        if (key == NULL || output == NULL || strtok_r(NULL, " \t\r\n", &save) != NULL) {
+            fprintf(stderr, "%s: line %ld of \"%s\" must be \"input key output\"\n",
+                    b->cfg->name, line_number, manifestPath);
+            exit(1);
+        }
+        if (strpbrk(input, "*?[") == NULL) {
+            batchAdd(b, input, key, output);
+            continue;
+        }
+
+        glob_t matches;
+        if (glob(input, 0, NULL, &matches) != 0) {
+            fprintf(stderr, "%s: \"%s\" matches no files\n", b->cfg->name, input);
+            continue;
+        }
+        for (size_t i = 0; i < matches.gl_pathc; i++)
+        {
+            const char* match = matches.gl_pathv[i];
+            const char* base = strrchr(match, '/');
+            base = base != NULL ? base + 1 : match;
+            size_t need = strlen(output) + strlen(base) + 2;
+            char* path = malloc(need);
+            if (path == NULL) {
+                fprintf(stderr, "%s: out of memory\n", b->cfg->name);
+                exit(1);
+            }
+            snprintf(path, need, "%s/%s", output, base);
+            batchAdd(b, match, key, path);
+            free(path);
+        }
+        globfree(&matches);
+    }
+    free(line);
+    fclose(manifest);
+}
+
+/*
+* Run one job of the batch over *socketFD, connecting first if the worker has
+* no connection yet. Files are checked the same way as for a single message;
+* a job that fails those checks, or that the server refuses or is too busy
+* for, is reported and skipped, so the rest of the batch still runs. A job
+* whose stream failed leaves no output file behind, and drops the connection
+* so the next job starts a fresh one. Returns -1 if the job was skipped.
+*/
+static inline int batchRun(struct batch* b, const struct batch_job* job, int* socketFD)
+{
+    const struct client_config* cfg = b->cfg;
+    int inputFD = open(job->input, O_RDONLY);
+    int keyFD = open(job->key, O_RDONLY);
+    int outFD = -1;
+    int rc = -1;
+    if (inputFD < 0 || keyFD < 0) {
+        fprintf(stderr, "%s: ERROR opening \"%s\"\n", cfg->name, inputFD < 0 ? job->input : job->key);
+        goto done;
+    }
+
+    // The key is only scanned once the text is good, so errno is still that of the failing file
+    off_t input_bad, key_bad = -1;
+    off_t input_length = scanFile(inputFD, &input_bad);
+    off_t key_length = input_length < 0 ? -1 : scanFile(keyFD, &key_bad);
+    if (input_length < 0 || key_length < 0) {
+        const char* path = input_length < 0 ? job->input : job->key;
+        off_t bad = input_length < 0 ? input_bad : key_bad;
+        if (bad >= 0) {
+            fprintf(stderr, "%s: file \"%s\" contains invalid characters at offset %lld\n", cfg->name,
+                    path, (long long)bad);
+        } else if (errno == ESPIPE) {
+            fprintf(stderr, "%s: \"%s\" is not a regular file\n", cfg->name, path);
+        } else {
+            fprintf(stderr, "%s: ERROR reading \"%s\": %s\n", cfg->name, path, strerror(errno));
+        }
+        goto done;
+    }
+    if (key_length < input_length) {
+        fprintf(stderr, "%s: Key \"%s\" is too short for \"%s\"\n", cfg->name, job->key, job->input);
+        goto done;
+    }
+    outFD = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFD < 0) {
+        fprintf(stderr, "%s: ERROR opening \"%s\": %s\n", cfg->name, job->output, strerror(errno));
+        goto done;
+    }
+
+    // Every job is a stream in the worker's session, so files of any size
+    // share the connection and only one chunk of each is held in memory
+    if (*socketFD < 0) {
+        *socketFD = connectServer(b->port, cfg);
+    }
+    if (streamV2(*socketFD, cfg, inputFD, keyFD, input_length, outFD, OTP_FLAG_SESSION) != 0) {
+        fprintf(stderr, "%s: skipping \"%s\"\n", cfg->name, job->input);
+        close(*socketFD);
+        *socketFD = -1;
+        unlink(job->output);
+        goto done;
+    }
+    rc = 0;
+
+done:
+    if (inputFD >= 0) {
+        close(inputFD);
+    }
+    if (keyFD >= 0) {
+        close(keyFD);
+    }
+    if (outFD >= 0) {
+        close(outFD);
+    }
+    return rc;
+}
+
+// Body of a batch worker: claim jobs until there are none left, reusing one connection
+static void* batchWorker(void* arg)
+{
+    struct batch* b = arg;
+    int socketFD = -1;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count)
+    {
+        if (batchRun(b, &b->jobs[i], &socketFD) < 0) {
+            __atomic_store_n(&b->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    // Closing between requests ends the session cleanly
+    if (socketFD >= 0) {
+        close(socketFD);
+    }
+    return NULL;
+}
+
+/*
+* Transform every file named in the manifest at manifestPath and write each
+* result to its own output file. inflight workers each keep one connection
+* to the server on portNumber open for the whole batch and take the next
+* file as soon as their last one is done, so up to inflight requests are in
+* flight at once. A file that cannot be used is reported and skipped, and
+* the rest of the batch carries on. Returns 1 if any file was skipped.
+*/
+static inline int runBatch(const struct client_config* cfg, const char* manifestPath,
+                           int portNumber, int inflight)
+{
+    if (cfg->legacy || cfg->session || cfg->keyref || cfg->shared) {
+        fprintf(stderr, "%s: batches take keys from files, need the version 2 protocol"
+                " and do not use shared memory\n", cfg->name);
+        exit(1);
+    }
+
+    struct batch b;
+    memset(&b, 0, sizeof(b));
+    b.cfg = cfg;
+    b.port = portNumber;
+    batchLoad(&b, manifestPath);
+    if ((size_t)inflight > b.count) {
+        inflight = b.count > 0 ? (int)b.count : 1;
+    }
+
+    // sendfile() has no MSG_NOSIGNAL, so a server hanging up must not kill us
+    signal(SIGPIPE, SIG_IGN);
+    pthread_t* workers = calloc(inflight, sizeof(pthread_t));
+    if (workers == NULL) {
+        fprintf(stderr, "%s: out of memory\n", cfg->name);
+        exit(1);
+    }
+    int started = 0;
+    while (started < inflight && pthread_create(&workers[started], NULL, batchWorker, &b) == 0) {
+        started++;
+    }
+    // With no threads at all the batch still runs, just one file at a time
+    if (started == 0) {
+        batchWorker(&b);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (size_t i = 0; i < b.count; i++)
+    {
+        free(b.jobs[i].input);
+        free(b.jobs[i].key);
+        free(b.jobs[i].output);
+    }
+    free(b.jobs);
+    free(workers);
+    return b.failed;
+}
+
+#endif
@@ -0,0 +1,134 @@
+/*
+* Deadlines for the servers' connections.
+* Every deadline of one kind (reading a request, writing a reply) runs for
+* the same duration, so the one armed last always expires last. Each kind
+* therefore keeps its armed deadlines in an intrusive list that stays in
+* expiry order just by appending: arming, cancelling and finding the next
+* deadline to expire all take constant time, with no heap or timer wheel.
+* Deadlines are armed with the coarse clock, which costs next to nothing,
+* and checked against the precise one, which is never behind it, so a loop
+* that sleeps until a deadline finds it expired when it wakes up.
+*/
+
+#ifndef OTP_DEADLINE_H
+#define OTP_DEADLINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+struct deadline_list;
+
+struct deadline {
+    uint64_t at;                    // When it expires, in CLOCK_MONOTONIC ns
+    struct deadline* prev;
+    struct deadline* next;
+    struct deadline_list* list;     // The list it is armed in, or NULL
+};
+
+struct deadline_list {
+    uint64_t duration_ns;           // How long each deadline runs (0 = deadlines of this kind are off)
+    struct deadline* head;          // Expires first
+    struct deadline* tail;          // Expires last
+};
+
+static inline uint64_t deadlineClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t deadlineCoarseClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void deadlineInit(struct deadline_list* list, uint64_t duration_ns)
+{
+    list->duration_ns = duration_ns;
+    list->head = NULL;
+    list->tail = NULL;
+}
+
+static inline void deadlineCancel(struct deadline* d)
+{
+    struct deadline_list* list = d->list;
+    if (list == NULL) {
+        return;
+    }
+    if (d->prev != NULL) {
+        d->prev->next = d->next;
+    } else {
+        list->head = d->next;
+    }
+    if (d->next != NULL) {
+        d->next->prev = d->prev;
+    } else {
+        list->tail = d->prev;
+    }
+    d->prev = NULL;
+    d->next = NULL;
+    d->list = NULL;
+}
+
+// Start d running from now for the list's duration, in place of whatever it was armed for
+static inline void deadlineArm(struct deadline_list* list, struct deadline* d)
+{
+    deadlineCancel(d);
+    if (list->duration_ns == 0) {
+        return;
+    }
+    d->at = deadlineCoarseClock() + list->duration_ns;
+    d->prev = list->tail;
+    d->next = NULL;
+    d->list = list;
+    if (list->tail != NULL) {
+        list->tail->next = d;
+    } else {
+        list->head = d;
+    }
+    list->tail = d;
+}
+
+// When the first of count lists' deadlines expires, or 0 if none is armed
+static inline uint64_t deadlineNext(const struct deadline_list* lists, int count)
+{
+    uint64_t next = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (lists[i].head != NULL && (next == 0 || lists[i].head->at < next)) {
+            next = lists[i].head->at;
+        }
+    }
+    return next;
+}
+
+// Milliseconds to sleep until the first deadline expires, or -1 to sleep until woken
+static inline int deadlineTimeout(const struct deadline_list* lists, int count)
+{
+    uint64_t next = deadlineNext(lists, count);
+    if (next == 0) {
+        return -1;
+    }
+    uint64_t now = deadlineClock();
+    return next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+}
+
+// Take a deadline of the lists that has expired by now out of its list, or NULL if none has
+static inline struct deadline* deadlineExpired(struct deadline_list* lists, int count, uint64_t now)
+{
+    for (int i = 0; i < count; i++)
+    {
+        struct deadline* d = lists[i].head;
+        if (d != NULL && d->at <= now) {
+            deadlineCancel(d);
+            return d;
+        }
+    }
+    return NULL;
+}
+
+#endif
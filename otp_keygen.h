@@ -0,0 +1,131 @@
+/*
+* Key generation shared by keygen and the microbenchmarks.
+* Keys come from ChaCha20 under a 256-bit seed. Random bytes are mapped to
+* the 27 symbols by rejection sampling: only bytes below 243 (9 * 27) are
+* used, which keeps every symbol equally likely. Each part of a key is cut
+* from its own ChaCha stream, so parts can be generated in any order and on
+* any thread and still add up to the same key.
+*/
+
+#ifndef OTP_KEYGEN_H
+#define OTP_KEYGEN_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define CHACHA_BLOCK 64
+#define LANES 8                     // ChaCha20 blocks computed side by side
+#define SAMPLE_LIMIT 243            // Largest multiple of 27 that fits in a byte
+
+// One 32-bit word from each of the LANES blocks
+typedef uint32_t lanes_t __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+static const char keygen_symbols[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+// The ChaCha20 key, set by keygenSeed()
+static uint32_t keygen_seed[8];
+
+// Symbol for every random byte below SAMPLE_LIMIT
+static char keygen_sample_symbol[256];
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL(d, 16); \
+    c += d; b ^= c; b = ROTL(b, 12); \
+    a += b; d ^= a; d = ROTL(d, 8); \
+    c += d; b ^= c; b = ROTL(b, 7);
+
+/*
+* Compute LANES consecutive ChaCha20 blocks of the stream numbered nonce,
+* starting at block counter, into out. The 64-bit counter and 64-bit nonce
+* follow the original ChaCha layout.
+*/
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void chachaBlocks(uint8_t* out, uint64_t nonce, uint64_t counter)
+{
+    const lanes_t lane = {0, 1, 2, 3, 4, 5, 6, 7};
+    lanes_t s[16], x[16];
+
+    s[0] = (lanes_t){} + 0x61707865;
+    s[1] = (lanes_t){} + 0x3320646e;
+    s[2] = (lanes_t){} + 0x79622d32;
+    s[3] = (lanes_t){} + 0x6b206574;
+    for (int i = 0; i < 8; i++)
+    {
+        s[4 + i] = (lanes_t){} + keygen_seed[i];
+    }
+    // A lane whose low counter word wrapped carries into the high word
+    s[12] = (lanes_t){} + (uint32_t)counter + lane;
+    s[13] = ((lanes_t){} + (uint32_t)(counter >> 32)) - (s[12] < (uint32_t)counter);
+    s[14] = (lanes_t){} + (uint32_t)nonce;
+    s[15] = (lanes_t){} + (uint32_t)(nonce >> 32);
+
+    memcpy(x, s, sizeof(x));
+    for (int round = 0; round < 10; round++)
+    {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    // Each lane is one block of little-endian words
+    uint32_t words[LANES][16];
+    for (int w = 0; w < 16; w++)
+    {
+        lanes_t v = x[w] + s[w];
+        for (int l = 0; l < LANES; l++)
+        {
+            words[l][w] = htole32(v[l]);
+        }
+    }
+    memcpy(out, words, sizeof(words));
+}
+
+// Set the ChaCha20 key and build the sampling table; call before keygenFill()
+static inline void keygenSeed(const uint32_t seed[8])
+{
+    memcpy(keygen_seed, seed, sizeof(keygen_seed));
+    for (int b = 0; b < SAMPLE_LIMIT; b++)
+    {
+        keygen_sample_symbol[b] = keygen_symbols[b % 27];
+    }
+}
+
+// Fill out with n key symbols from the stream numbered stream
+static inline void keygenFill(char* out, size_t n, uint64_t stream)
+{
+    uint8_t block[LANES * CHACHA_BLOCK];
+    char spill[LANES * CHACHA_BLOCK];
+    uint64_t counter = 0;
+    size_t have = 0;
+
+    while (have < n)
+    {
+        chachaBlocks(block, stream, counter);
+        counter += LANES;
+
+        // Every byte is stored, but the position only advances past bytes
+        // below the limit. Near the end of the output the batch goes through
+        // a scratch buffer so nothing is written past n.
+        char* dst = n - have >= sizeof(block) ? out + have : spill;
+        size_t kept = 0;
+        for (size_t i = 0; i < sizeof(block); i++)
+        {
+            dst[kept] = keygen_sample_symbol[block[i]];
+            kept += block[i] < SAMPLE_LIMIT;
+        }
+        if (dst == spill) {
+            kept = kept < n - have ? kept : n - have;
+            memcpy(out + have, spill, kept);
+        }
+        have += kept;
+    }
+}
+
+#endif
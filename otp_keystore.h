@@ -0,0 +1,263 @@
+/*
+* Server-side store of one-time pads, so clients can name a key instead of
+* uploading it with every message.
+* Every regular file in the key directory is a pad, as written by keygen, and
+* its file name is the pad's ID. Pads are memory-mapped read-only and shared
+* by every worker and thread. Next to them sits an index file that is mapped
+* MAP_SHARED and records, for each pad, how much of it encryption has
+* already consumed. Reservations advance that offset atomically, so no
+* region of a pad is ever handed out twice, even across worker processes,
+* and because the index lives on disk this holds across restarts as well.
+*/
+
+#ifndef OTP_KEYSTORE_H
+#define OTP_KEYSTORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "otp_proto.h"
+
+#define KEYSTORE_INDEX ".otp_index"
+#define KEYSTORE_MAGIC "OTPKEYS1"
+#define KEYSTORE_MAX_PADS 1024
+
+// One pad's record in the on-disk index
+struct keystore_entry {
+    char id[OTP_KEY_ID_MAX + 1];    // File name of the pad, NUL terminated
+    uint64_t size;                  // Usable length of the pad
+    uint64_t consumed;              // Bytes already handed out for encryption
+};
+
+// Layout of the index file
+struct keystore_index {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    struct keystore_entry entries[KEYSTORE_MAX_PADS];
+};
+
+struct keystore_pad {
+    const char* data;               // The mapped pad
+    size_t size;                    // Usable length, without the trailing newline
+    struct keystore_entry* entry;   // Its record in the mapped index
+};
+
+struct keystore {
+    struct keystore_index* index;
+    int count;
+    struct keystore_pad pads[KEYSTORE_MAX_PADS];
+};
+
+// Find the index record for id, adding one if the pad is new. Returns NULL if the index is full.
+static inline struct keystore_entry* keystoreEntry(struct keystore_index* index, const char* id)
+{
+    for (uint32_t i = 0; i < index->count; i++)
+    {
+        if (strcmp(index->entries[i].id, id) == 0) {
+            return &index->entries[i];
+        }
+    }
+    if (index->count >= KEYSTORE_MAX_PADS) {
+        return NULL;
+    }
+    struct keystore_entry* entry = &index->entries[index->count++];
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->id, id);
+    return entry;
+}
+
+// Map one pad file into the store. Returns -1 if it cannot be used.
+static inline int keystoreAddPad(struct keystore* ks, int dirFD, const char* id, const char* name)
+{
+    int fd = openat(dirFD, id, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "%s: ERROR opening key \"%s\"\n", name, id);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: ERROR mapping key \"%s\": %s\n", name, id, strerror(errno));
+        return -1;
+    }
+
+    // The pad is the run of A-Z and space at the start of the file, which
+    // normally ends at keygen's newline
+    const char* newline = memchr(data, '\n', st.st_size);
+    size_t line = newline != NULL ? (size_t)(newline - data) : (size_t)st.st_size;
+    size_t size = 0;
+    while (size < line && ((data[size] >= 'A' && data[size] <= 'Z') || data[size] == ' ')) {
+        size++;
+    }
+    if (size == 0) {
+        fprintf(stderr, "%s: key \"%s\" is empty, skipping it\n", name, id);
+        munmap((void*)data, st.st_size);
+        return -1;
+    }
+    if (size < line) {
+        fprintf(stderr, "%s: key \"%s\" has invalid characters after position %zu, using only those\n",
+                name, id, size);
+    }
+
+    struct keystore_entry* entry = keystoreEntry(ks->index, id);
+    if (entry == NULL) {
+        fprintf(stderr, "%s: key index is full, skipping \"%s\"\n", name, id);
+        munmap((void*)data, st.st_size);
+        return -1;
+    }
+    entry->size = size;
+    ks->pads[ks->count].data = data;
+    ks->pads[ks->count].size = size;
+    ks->pads[ks->count].entry = entry;
+    ks->count++;
+    return 0;
+}
+
+/*
+* Load every pad in dir and its index, creating the index on first use.
+* The index is locked while it is loaded, so an encryption and a decryption
+* server can share one key directory. Exits if the directory is unusable.
+*/
+static inline struct keystore* keystoreOpen(const char* dir, const char* name)
+{
+    struct keystore* ks = calloc(1, sizeof(*ks));
+    int dirFD = open(dir, O_RDONLY | O_DIRECTORY);
+    if (ks == NULL || dirFD < 0) {
+        fprintf(stderr, "%s: ERROR opening key directory \"%s\"\n", name, dir);
+        exit(1);
+    }
+
+    int indexFD = openat(dirFD, KEYSTORE_INDEX, O_RDWR | O_CREAT, 0600);
+    if (indexFD < 0 || flock(indexFD, LOCK_EX) < 0 ||
+        ftruncate(indexFD, sizeof(struct keystore_index)) < 0)
+    {
+        fprintf(stderr, "%s: ERROR opening key index in \"%s\": %s\n", name, dir, strerror(errno));
+        exit(1);
+    }
+    ks->index = mmap(NULL, sizeof(struct keystore_index), PROT_READ | PROT_WRITE, MAP_SHARED, indexFD, 0);
+    if (ks->index == MAP_FAILED) {
+        fprintf(stderr, "%s: ERROR mapping key index: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    // A new (all zero) index gets its magic; anything else must already have it
+    if (ks->index->count == 0 && ks->index->magic[0] == '\0') {
+        memcpy(ks->index->magic, KEYSTORE_MAGIC, sizeof(ks->index->magic));
+    }
+    if (memcmp(ks->index->magic, KEYSTORE_MAGIC, sizeof(ks->index->magic)) != 0) {
+        fprintf(stderr, "%s: \"%s/%s\" is not a key index\n", name, dir, KEYSTORE_INDEX);
+        exit(1);
+    }
+
+    DIR* d = fdopendir(dup(dirFD));
+    struct dirent* de;
+    while (d != NULL && (de = readdir(d)) != NULL)
+    {
+        // Hidden files, the index among them, are not pads
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirFD, de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (strlen(de->d_name) > OTP_KEY_ID_MAX) {
+            fprintf(stderr, "%s: key name \"%s\" is too long, skipping it\n", name, de->d_name);
+            continue;
+        }
+        if (ks->count < KEYSTORE_MAX_PADS) {
+            keystoreAddPad(ks, dirFD, de->d_name, name);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    msync(ks->index, sizeof(struct keystore_index), MS_SYNC);
+    flock(indexFD, LOCK_UN);
+    close(indexFD);
+    close(dirFD);
+    return ks;
+}
+
+// Look up a pad by ID. Returns NULL if the store has no such pad.
+static inline struct keystore_pad* keystoreFind(struct keystore* ks, const char* id, size_t idLen)
+{
+    for (int i = 0; i < ks->count; i++)
+    {
+        const char* padID = ks->pads[i].entry->id;
+        if (strlen(padID) == idLen && memcmp(padID, id, idLen) == 0) {
+            return &ks->pads[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+* Reserve len bytes of the pad for encryption, starting at offset or, for
+* OTP_KEY_NEXT, wherever the unused part of the pad begins. A region is only
+* granted if nothing at or after it has been handed out yet, and only once
+* the new offset is on disk, so a crash or restart cannot hand it out again.
+* Stores the start of the region in *start. Returns NULL on success or the
+* reason the reservation was refused.
+*/
+static inline const char* keystoreReserve(struct keystore_pad* pad, uint64_t offset,
+                                          size_t len, uint64_t* start)
+{
+    uint64_t consumed = __atomic_load_n(&pad->entry->consumed, __ATOMIC_ACQUIRE);
+    while (1)
+    {
+        uint64_t from = offset == OTP_KEY_NEXT ? consumed : offset;
+        if (from < consumed) {
+            return "that part of the key has already been used";
+        }
+        if (from > pad->size || len > pad->size - from) {
+            return "not enough unused key left";
+        }
+        // Another worker may have reserved in the meantime; retry with its offset
+        if (__atomic_compare_exchange_n(&pad->entry->consumed, &consumed, from + len, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            // msync() wants a page-aligned start; the entry may straddle two pages
+            uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+            uintptr_t first = (uintptr_t)&pad->entry->consumed & ~(page - 1);
+            uintptr_t end = (uintptr_t)(&pad->entry->consumed + 1);
+            if (msync((void*)first, end - first, MS_SYNC) < 0) {
+                // The region stays consumed, so it is lost rather than reused
+                return "could not record the use of the key";
+            }
+            *start = from;
+            return NULL;
+        }
+    }
+}
+
+/*
+* Check that len bytes at offset lie inside the pad, for decryption, which
+* reads a region that encryption already consumed and consumes nothing.
+* Returns NULL if they do or the reason the request was refused.
+*/
+static inline const char* keystoreCheck(const struct keystore_pad* pad, uint64_t offset, size_t len)
+{
+    if (offset == OTP_KEY_NEXT) {
+        return "decryption needs the offset the message was encrypted at";
+    }
+    if (offset > pad->size || len > pad->size - offset) {
+        return "offset is past the end of the key";
+    }
+    return NULL;
+}
+
+#endif
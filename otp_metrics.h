@@ -0,0 +1,468 @@
+/*
+* Server metrics and the per-request trace log.
+*
+* Metrics are counters and latency histograms kept in shards: every thread
+* that serves clients claims a cache-line aligned shard the first time it
+* records anything and only ever adds to that one, with relaxed atomic adds,
+* so recording takes no lock and no two threads fight over a cache line.
+* The shards live in one shared anonymous mapping made before the pool
+* forks, so worker processes record into it too and a shard of a worker
+* that exited keeps counting towards the totals. metricsServeAdmin() runs a
+* thread that answers HTTP requests on 127.0.0.1 with the shards summed up,
+* in the Prometheus text format.
+*
+* The trace log gets one line per reply. The serving thread only copies a
+* record into a ring of its own; a writer thread in the same process turns
+* the records into text and writes them out in batches. A record that finds
+* the ring full is dropped and counted rather than waited for.
+*/
+
+#ifndef OTP_METRICS_H
+#define OTP_METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define METRICS_SHARDS 256
+#define METRICS_BUCKETS 24          // Latency buckets of 1us, 2us, 4us, ... 2^23us (about 8s)
+#define METRICS_ADMIN_REQUEST 1024
+#define TRACE_RING 4096             // Records each thread can have waiting (a power of two)
+#define TRACE_FLUSH_NS 10000000     // How often the writer thread empties the rings
+#define TRACE_BUFFER 65536
+
+enum metrics_counter {
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_REQUESTS,
+    METRIC_REQUESTS_REJECTED,
+    METRIC_HANDSHAKE_FAILURES,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_WORKER_EXITS,
+    METRIC_TRACE_DROPPED,
+    METRIC_BUSY,
+    METRIC_TIMEOUTS,
+    METRIC_COUNTERS
+};
+
+enum metrics_phase {
+    PHASE_REASSEMBLY,               // First byte of a request to the whole request
+    PHASE_CIPHER,                   // Transforming it
+    PHASE_SEND,                     // Writing the reply
+    PHASE_COUNT
+};
+
+struct metrics_histogram {
+    uint64_t buckets[METRICS_BUCKETS + 1];  // The last one counts everything slower
+    uint64_t count;
+    uint64_t sum_ns;
+};
+
+struct metrics_shard {
+    uint64_t counters[METRIC_COUNTERS];
+    struct metrics_histogram phases[PHASE_COUNT];
+} __attribute__((aligned(64)));
+
+struct otp_metrics {
+    uint32_t shards_claimed;
+    struct metrics_shard shards[METRICS_SHARDS];
+};
+
+// One reply, as written to the trace log
+struct trace_record {
+    uint64_t time_ns;               // Wall clock time the reply was sent
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t bytes;                 // Length of the message or chunk
+    int32_t fd;
+    uint8_t version;
+    uint8_t kind;                   // enum trace_kind
+    uint8_t rejected;
+};
+
+enum trace_kind {
+    TRACE_MESSAGE,
+    TRACE_STREAM,                   // The header that opens a stream
+    TRACE_CHUNK
+};
+
+// A single-producer, single-consumer ring of records owned by one thread
+struct trace_ring {
+    struct trace_record records[TRACE_RING];
+    uint32_t head;                  // Next record the writer takes
+    uint32_t tail;                  // Next slot the serving thread fills
+    struct trace_ring* next;        // Every ring of the process, for the writer
+};
+
+static const char* const metrics_phase_names[PHASE_COUNT] = {"reassembly", "cipher", "send"};
+static const char* const trace_kind_names[] = {"message", "stream", "chunk"};
+
+// NULL unless metrics are on; set up before any worker or thread starts
+static struct otp_metrics* otp_metrics = NULL;
+static __thread struct metrics_shard* metrics_shard = NULL;
+
+// -1 unless the trace log is on
+static int otp_trace_fd = -1;
+static __thread struct trace_ring* trace_ring = NULL;
+static struct trace_ring* trace_rings = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_writer_started = 0;
+static pid_t trace_writer_pid = 0;
+
+// Whether replies need timing at all
+static inline int metricsTiming(void)
+{
+    return otp_metrics != NULL || otp_trace_fd >= 0;
+}
+
+static inline uint64_t metricsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Map the shared shards. Must be called before the servers fork or start threads.
+static inline void metricsInit(const char* name)
+{
+    void* shared = mmap(NULL, sizeof(struct otp_metrics), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "%s: ERROR mapping metrics: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    otp_metrics = shared;
+}
+
+// The calling thread's shard, claimed on first use
+static inline struct metrics_shard* metricsShard(void)
+{
+    if (metrics_shard == NULL) {
+        uint32_t i = __atomic_fetch_add(&otp_metrics->shards_claimed, 1, __ATOMIC_RELAXED);
+        // Past METRICS_SHARDS threads share shards, which the atomic adds allow
+        metrics_shard = &otp_metrics->shards[i % METRICS_SHARDS];
+    }
+    return metrics_shard;
+}
+
+static inline void metricsAdd(enum metrics_counter counter, uint64_t n)
+{
+    if (otp_metrics != NULL) {
+        __atomic_fetch_add(&metricsShard()->counters[counter], n, __ATOMIC_RELAXED);
+    }
+}
+
+// Bucket i counts latencies up to 2^i microseconds
+static inline int metricsBucket(uint64_t ns)
+{
+    uint64_t us = (ns + 999) / 1000;
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS;
+}
+
+static inline void metricsTime(enum metrics_phase phase, uint64_t ns)
+{
+    if (otp_metrics == NULL) {
+        return;
+    }
+    struct metrics_histogram* h = &metricsShard()->phases[phase];
+    __atomic_fetch_add(&h->buckets[metricsBucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+}
+
+// Append a formatted line to buf, which has cap bytes and *len already used
+__attribute__((format(printf, 4, 5)))
+static inline void metricsAppend(char* buf, size_t cap, size_t* len, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + *len, cap - *len, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        *len = *len + n < cap ? *len + n : cap - 1;
+    }
+}
+
+static inline void metricsCounter(char* buf, size_t cap, size_t* len, const char* name,
+                                  const char* type, const char* help, uint64_t value)
+{
+    metricsAppend(buf, cap, len, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+                  name, help, name, type, name, (unsigned long long)value);
+}
+
+// Sum every shard into the Prometheus text format. Returns the length written to buf.
+static inline size_t metricsFormat(char* buf, size_t cap)
+{
+    uint64_t counters[METRIC_COUNTERS] = {0};
+    static struct metrics_histogram phases[PHASE_COUNT];
+    memset(phases, 0, sizeof(phases));
+    for (int s = 0; s < METRICS_SHARDS; s++)
+    {
+        const struct metrics_shard* shard = &otp_metrics->shards[s];
+        for (int i = 0; i < METRIC_COUNTERS; i++)
+        {
+            counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int p = 0; p < PHASE_COUNT; p++)
+        {
+            for (int b = 0; b <= METRICS_BUCKETS; b++)
+            {
+                phases[p].buckets[b] += __atomic_load_n(&shard->phases[p].buckets[b], __ATOMIC_RELAXED);
+            }
+            phases[p].count += __atomic_load_n(&shard->phases[p].count, __ATOMIC_RELAXED);
+            phases[p].sum_ns += __atomic_load_n(&shard->phases[p].sum_ns, __ATOMIC_RELAXED);
+        }
+    }
+
+    size_t len = 0;
+    uint64_t opened = counters[METRIC_CONNECTIONS_OPENED];
+    uint64_t closed = counters[METRIC_CONNECTIONS_CLOSED];
+    metricsCounter(buf, cap, &len, "otp_connections_opened_total", "counter",
+                   "Client connections accepted.", opened);
+    metricsCounter(buf, cap, &len, "otp_connections_active", "gauge",
+                   "Client connections currently open.", opened > closed ? opened - closed : 0);
+    metricsCounter(buf, cap, &len, "otp_requests_total", "counter",
+                   "Requests and streams received, not counting stream chunks.", counters[METRIC_REQUESTS]);
+    metricsCounter(buf, cap, &len, "otp_requests_rejected_total", "counter",
+                   "Requests answered with an error.", counters[METRIC_REQUESTS_REJECTED]);
+    metricsCounter(buf, cap, &len, "otp_handshake_failures_total", "counter",
+                   "Connections dropped for a wrong client name or protocol version.",
+                   counters[METRIC_HANDSHAKE_FAILURES]);
+    metricsCounter(buf, cap, &len, "otp_bytes_in_total", "counter",
+                   "Bytes read from clients.", counters[METRIC_BYTES_IN]);
+    metricsCounter(buf, cap, &len, "otp_bytes_out_total", "counter",
+                   "Bytes written to clients.", counters[METRIC_BYTES_OUT]);
+    metricsCounter(buf, cap, &len, "otp_worker_exits_total", "counter",
+                   "Pool workers that exited and had to be replaced.", counters[METRIC_WORKER_EXITS]);
+    metricsCounter(buf, cap, &len, "otp_trace_dropped_total", "counter",
+                   "Trace records dropped because the writer fell behind.", counters[METRIC_TRACE_DROPPED]);
+    metricsCounter(buf, cap, &len, "otp_busy_total", "counter",
+                   "Connections and requests turned away because the server was saturated.",
+                   counters[METRIC_BUSY]);
+    metricsCounter(buf, cap, &len, "otp_timeouts_total", "counter",
+                   "Connections dropped for running past a read or write deadline.", counters[METRIC_TIMEOUTS]);
+
+    metricsAppend(buf, cap, &len, "# HELP otp_phase_seconds Time spent per reply in each phase.\n"
+                  "# TYPE otp_phase_seconds histogram\n");
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            cumulative += phases[p].buckets[b];
+            metricsAppend(buf, cap, &len, "otp_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+                          metrics_phase_names[p], (double)(1ull << b) / 1e6, (unsigned long long)cumulative);
+        }
+        metricsAppend(buf, cap, &len, "otp_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n",
+                      metrics_phase_names[p], (unsigned long long)phases[p].count);
+        metricsAppend(buf, cap, &len, "otp_phase_seconds_sum{phase=\"%s\"} %.9f\n",
+                      metrics_phase_names[p], phases[p].sum_ns / 1e9);
+        metricsAppend(buf, cap, &len, "otp_phase_seconds_count{phase=\"%s\"} %llu\n",
+                      metrics_phase_names[p], (unsigned long long)phases[p].count);
+    }
+    return len;
+}
+
+// Answer one admin connection: GET /metrics gets the metrics, anything else a 404
+static inline void metricsAnswer(int fd)
+{
+    char request[METRICS_ADMIN_REQUEST];
+    size_t got = 0;
+    // A slow or silent client cannot hold the admin thread for long
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (got < sizeof(request) - 1)
+    {
+        ssize_t charsRead = recv(fd, request + got, sizeof(request) - 1 - got, 0);
+        if (charsRead <= 0) {
+            break;
+        }
+        got += charsRead;
+        request[got] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    request[got] = '\0';
+
+    static char body[32768];
+    char head[256];
+    size_t body_len = 0;
+    int head_len;
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        body_len = metricsFormat(body, sizeof(body));
+        head_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+    } else {
+        head_len = snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\n"
+                            "Content-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+    send(fd, head, head_len, MSG_NOSIGNAL);
+    send(fd, body, body_len, MSG_NOSIGNAL);
+}
+
+static void* metricsAdminMain(void* arg)
+{
+    int listenSocket = (int)(intptr_t)arg;
+    while (1)
+    {
+        int fd = accept(listenSocket, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        metricsAnswer(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+* Serve the metrics on 127.0.0.1:port from a thread of the calling process.
+* The thread blocks every signal, so a supervisor waiting for signals still
+* gets all of them.
+*/
+static inline void metricsServeAdmin(int port, const char* name)
+{
+    int listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int on = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (listenSocket < 0 || bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(listenSocket, 16) < 0)
+    {
+        fprintf(stderr, "%s: ERROR opening admin port %d: %s\n", name, port, strerror(errno));
+        exit(1);
+    }
+
+    sigset_t all, orig;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &orig);
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, metricsAdminMain, (void*)(intptr_t)listenSocket);
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "%s: could not start admin thread: %s\n", name, strerror(rc));
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+// Format and write out every record waiting in the process's rings
+static inline void traceFlush(char* buf)
+{
+    size_t len = 0;
+    pid_t pid = getpid();
+    for (struct trace_ring* ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        uint32_t head = ring->head;
+        uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const struct trace_record* t = &ring->records[head & (TRACE_RING - 1)];
+            if (len > TRACE_BUFFER - 256) {
+                if (write(otp_trace_fd, buf, len) < 0) {
+                    // Nothing sensible to do but lose the batch
+                }
+                len = 0;
+            }
+            len += snprintf(buf + len, TRACE_BUFFER - len,
+                            "ts=%llu.%09llu pid=%d fd=%d proto=%u kind=%s bytes=%llu"
+                            " reassembly_us=%.1f cipher_us=%.1f send_us=%.1f status=%s\n",
+                            (unsigned long long)(t->time_ns / 1000000000ull),
+                            (unsigned long long)(t->time_ns % 1000000000ull), (int)pid, t->fd,
+                            t->version, trace_kind_names[t->kind], (unsigned long long)t->bytes,
+                            t->phase_ns[PHASE_REASSEMBLY] / 1e3, t->phase_ns[PHASE_CIPHER] / 1e3,
+                            t->phase_ns[PHASE_SEND] / 1e3, t->rejected ? "rejected" : "ok");
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    if (len > 0 && write(otp_trace_fd, buf, len) < 0) {
+        // As above
+    }
+}
+
+static void* traceWriterMain(void* arg)
+{
+    (void)arg;
+    char* buf = malloc(TRACE_BUFFER);
+    if (buf == NULL) {
+        return NULL;
+    }
+    struct timespec pause = {0, TRACE_FLUSH_NS};
+    while (1)
+    {
+        nanosleep(&pause, NULL);
+        traceFlush(buf);
+    }
+    return NULL;
+}
+
+// The calling thread's ring, created on first use along with the process's writer thread
+static inline struct trace_ring* traceRing(void)
+{
+    if (trace_ring != NULL) {
+        return trace_ring;
+    }
+    struct trace_ring* ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&trace_lock);
+    // A forked worker inherits the list but not the writer that drained it
+    if (trace_writer_pid != getpid()) {
+        trace_rings = NULL;
+        trace_writer_started = 0;
+        trace_writer_pid = getpid();
+    }
+    ring->next = trace_rings;
+    __atomic_store_n(&trace_rings, ring, __ATOMIC_RELEASE);
+    if (!trace_writer_started) {
+        sigset_t all, orig;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &orig);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, traceWriterMain, NULL) == 0) {
+            pthread_detach(thread);
+            trace_writer_started = 1;
+        }
+        pthread_sigmask(SIG_SETMASK, &orig, NULL);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    trace_ring = ring;
+    return ring;
+}
+
+// Queue a record for the trace log, dropping it if the writer has fallen behind
+static inline void traceRecord(const struct trace_record* record)
+{
+    struct trace_ring* ring = traceRing();
+    if (ring == NULL) {
+        return;
+    }
+    uint32_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == TRACE_RING) {
+        metricsAdd(METRIC_TRACE_DROPPED, 1);
+        return;
+    }
+    ring->records[tail & (TRACE_RING - 1)] = *record;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif
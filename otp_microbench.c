@@ -0,0 +1,490 @@
+/*
+* Name: Christian DeVore
+* Description: Microbenchmarks for the hot paths of the clients and servers,
+* each measured on its own at message sizes from 16 bytes up to 1 GB:
+*   encrypt, decrypt - every otp_cipher.h kernel the CPU supports
+*   scan             - the validation scanners the clients run on input
+*   reassembly       - the server's parser putting a '|'-delimited request
+*                      back together from 16 KB reads
+*   keygen           - key generation, against a one-block-at-a-time
+*                      reference ChaCha20
+*   pack, unpack     - the otp_pack.h wire encoding, checked by a round trip
+*   packed-encrypt,  - the cipher run on packed text and key, checked
+*   packed-decrypt     against the scalar kernel once unpacked
+* Every variant's output is compared byte for byte with the scalar or
+* reference version before it is timed, and the cipher kernels' also on
+* input full of bytes that are not A-Z or space. Results are given per byte of
+* message, in TSC cycles (on x86) and GB/s, as a table or with -f csv.
+* Sizes go up 16x at a time; -m sets the largest, 64 MB unless told otherwise.
+* The exit status is 1 if any variant's output did not match.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "otp_server.h"
+#include "otp_keygen.h"
+
+#define MICRO_DEFAULT_MAX (64ull << 20)
+#define MICRO_DEFAULT_SECONDS 0.2   // Time spent repeating each case
+#define MICRO_MIN_SIZE 16
+#define MICRO_VERIFY_SLICE (1 << 20)
+#define MICRO_FRAGMENT 16384        // Bytes handed to the request parser at a time
+#define MICRO_REASSEMBLY_MAX (256ull << 20) // The parser holds two copies of the request
+
+struct variant {
+    const char* name;
+    otp_kernel encrypt;
+    otp_kernel decrypt;
+    otp_scanner scan;
+};
+
+// One benchmark at one size
+struct micro_case {
+    const struct variant* variant;
+    char* text;
+    char* key;
+    char* out;
+    size_t len;
+    struct msg_reader* reader;
+    unsigned char* packed_text; // text, key and out in the packed encoding
+    unsigned char* packed_key;
+    unsigned char* packed_out;
+    size_t sink;                // Results nothing else reads, so they are not optimized away
+};
+
+typedef void (*micro_fn)(struct micro_case* c);
+
+static const struct server_config micro_server = {
+    .name = "OTP_MICROBENCH",
+    .ops = {&server_encrypt},
+};
+
+static int csv = 0;
+static double min_seconds = MICRO_DEFAULT_SECONDS;
+static int mismatches = 0;
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef OTP_CIPHER_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+* Run fn on c repeatedly for at least min_seconds, and at least once, and
+* print the fastest run per byte of message.
+*/
+static void timeCase(const char* bench, const char* variant, micro_fn fn, struct micro_case* c, int ok)
+{
+    uint64_t best_ns = UINT64_MAX, best_cycles = UINT64_MAX;
+    uint64_t start = nowNs();
+    do {
+        uint64_t t0 = nowNs();
+        uint64_t c0 = cycles();
+        fn(c);
+        uint64_t c1 = cycles();
+        uint64_t t1 = nowNs();
+        if (t1 - t0 < best_ns) {
+            best_ns = t1 - t0;
+        }
+        if (c1 - c0 < best_cycles) {
+            best_cycles = c1 - c0;
+        }
+    } while (nowNs() - start < (uint64_t)(min_seconds * 1e9));
+
+    double per_byte = (double)best_cycles / c->len;
+    double gbps = best_ns > 0 ? (double)c->len / best_ns : 0;
+    if (csv) {
+        printf("%s,%s,%zu,%.4f,%.3f,%s\n", bench, variant, c->len, per_byte, gbps, ok ? "ok" : "MISMATCH");
+    } else {
+        printf("%-11s %-9s %11zu %10.4f %9.3f  %s\n", bench, variant, c->len, per_byte, gbps,
+               ok ? "ok" : "MISMATCH");
+    }
+    fflush(stdout);
+    if (!ok) {
+        mismatches++;
+    }
+}
+
+static void runEncrypt(struct micro_case* c)
+{
+    c->variant->encrypt(c->out, c->text, c->key, c->len);
+}
+
+static void runDecrypt(struct micro_case* c)
+{
+    c->variant->decrypt(c->out, c->text, c->key, c->len);
+}
+
+static void runScan(struct micro_case* c)
+{
+    c->sink += c->variant->scan(c->text, c->len);
+}
+
+// Compare a kernel's output with the scalar kernel's, one slice at a time
+static int checkKernel(const struct micro_case* c, otp_kernel reference)
+{
+    static char expect[MICRO_VERIFY_SLICE];
+    for (size_t at = 0; at < c->len; at += MICRO_VERIFY_SLICE)
+    {
+        size_t n = c->len - at < MICRO_VERIFY_SLICE ? c->len - at : MICRO_VERIFY_SLICE;
+        reference(expect, c->text + at, c->key + at, n);
+        if (memcmp(expect, c->out + at, n) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+* A kernel must also match the scalar one on bytes outside A-Z and space,
+* whole vectors and tail alike. Every byte value is paired with many others
+* in text and key, in buffers of their own so the valid text stays put.
+*/
+static int checkInvalid(const struct micro_case* c, otp_kernel kernel, otp_kernel reference)
+{
+    static char text[MICRO_VERIFY_SLICE], key[MICRO_VERIFY_SLICE];
+    static char got[MICRO_VERIFY_SLICE], expect[MICRO_VERIFY_SLICE];
+    size_t n = c->len < MICRO_VERIFY_SLICE ? c->len : MICRO_VERIFY_SLICE;
+    for (size_t i = 0; i < n; i++)
+    {
+        text[i] = (char)i;
+        key[i] = (char)(i * 97 + i / 256);
+    }
+    // The full length and one short of it, so a tail is covered whatever the vector width
+    for (size_t len = n; len + 1 >= n && len > 0; len--)
+    {
+        kernel(got, text, key, len);
+        reference(expect, text, key, len);
+        if (memcmp(got, expect, len) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// A scanner must find the end of valid text and the same invalid byte as the scalar one
+static int checkScan(struct micro_case* c)
+{
+    size_t spots[3] = {0, c->len / 2, c->len - 1};
+    if (c->variant->scan(c->text, c->len) != c->len) {
+        return 0;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        char saved = c->text[spots[i]];
+        c->text[spots[i]] = '\n';
+        size_t got = c->variant->scan(c->text, c->len);
+        size_t expect = otpScanScalar(c->text, c->len);
+        c->text[spots[i]] = saved;
+        if (got != expect || expect != spots[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Hand n bytes to the parser in MICRO_FRAGMENT-sized reads, as a socket would
+static void feedReader(struct msg_reader* r, const char* data, size_t n)
+{
+    while (n > 0)
+    {
+        size_t take = n < MICRO_FRAGMENT ? n : MICRO_FRAGMENT;
+        if (readerAppend(r, data, take, &micro_server) < 0 || readerParse(r, &micro_server) < 0) {
+            exit(1);
+        }
+        data += take;
+        n -= take;
+    }
+}
+
+// Parse "enc_client|<text>|<key>|" the way a server receives it
+static void runReassembly(struct micro_case* c)
+{
+    struct msg_reader* r = c->reader;
+    readerReset(r);
+    feedReader(r, "enc_client|", 11);
+    feedReader(r, c->text, c->len);
+    feedReader(r, "|", 1);
+    feedReader(r, c->key, c->len);
+    feedReader(r, "|", 1);
+    c->sink += r->key_len;
+}
+
+static int checkReassembly(struct micro_case* c)
+{
+    runReassembly(c);
+    struct msg_reader* r = c->reader;
+    return r->phase == MSG_RESPONSE && r->text_len == c->len && r->key_len == c->len &&
+           memcmp(r->buf + r->text_start, c->text, c->len) == 0 &&
+           memcmp(r->buf + r->key_start, c->key, c->len) == 0;
+}
+
+static void runPack(struct micro_case* c)
+{
+    otpPack(c->packed_out, c->text, c->len);
+}
+
+static void runUnpack(struct micro_case* c)
+{
+    otpUnpack(c->out, c->packed_text, c->len);
+}
+
+// Packing the text and unpacking it again has to give the text back
+static int checkPack(struct micro_case* c)
+{
+    runPack(c);
+    otpUnpack(c->out, c->packed_out, c->len);
+    return memcmp(c->out, c->text, c->len) == 0;
+}
+
+static void runPackedEncrypt(struct micro_case* c)
+{
+    otpPackedEncrypt((char*)c->packed_out, (char*)c->packed_text, (char*)c->packed_key, c->len);
+}
+
+static void runPackedDecrypt(struct micro_case* c)
+{
+    otpPackedDecrypt((char*)c->packed_out, (char*)c->packed_text, (char*)c->packed_key, c->len);
+}
+
+// Unpack a packed kernel's output and compare it with the scalar kernel's
+static int checkPacked(struct micro_case* c, micro_fn fn, otp_kernel reference)
+{
+    fn(c);
+    otpUnpack(c->out, c->packed_out, c->len);
+    return checkKernel(c, reference);
+}
+
+// Reference ChaCha20 block function, one block at a time
+static void chachaBlockRef(uint8_t* out, uint64_t nonce, uint64_t counter)
+{
+    uint32_t s[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+        keygen_seed[0], keygen_seed[1], keygen_seed[2], keygen_seed[3],
+        keygen_seed[4], keygen_seed[5], keygen_seed[6], keygen_seed[7],
+        (uint32_t)counter, (uint32_t)(counter >> 32), (uint32_t)nonce, (uint32_t)(nonce >> 32),
+    };
+    uint32_t x[16];
+    memcpy(x, s, sizeof(x));
+    for (int round = 0; round < 10; round++)
+    {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int w = 0; w < 16; w++)
+    {
+        uint32_t v = htole32(x[w] + s[w]);
+        memcpy(out + 4 * w, &v, sizeof(v));
+    }
+}
+
+// Reference key generation: the same stream sampled one byte at a time
+static void runKeygenRef(struct micro_case* c)
+{
+    uint8_t block[CHACHA_BLOCK];
+    uint64_t counter = 0;
+    size_t have = 0;
+    while (have < c->len)
+    {
+        chachaBlockRef(block, 0, counter++);
+        for (int i = 0; i < CHACHA_BLOCK && have < c->len; i++)
+        {
+            if (block[i] < SAMPLE_LIMIT) {
+                c->out[have++] = keygen_symbols[block[i] % 27];
+            }
+        }
+    }
+}
+
+static void runKeygen(struct micro_case* c)
+{
+    keygenFill(c->out, c->len, 0);
+}
+
+// Compare keygenFill() with the reference, keeping the reference output in c->text
+static int checkKeygen(struct micro_case* c)
+{
+    char* out = c->out;
+    c->out = c->text;
+    runKeygenRef(c);
+    c->out = out;
+    runKeygen(c);
+    return memcmp(c->text, c->out, c->len) == 0;
+}
+
+// Parse a size such as "4096", "64k", "16m" or "1g"
+static size_t parseSize(const char* s)
+{
+    char* end;
+    unsigned long long n = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'g': case 'G':
+        n <<= 10;
+        // fall through
+    case 'm': case 'M':
+        n <<= 10;
+        // fall through
+    case 'k': case 'K':
+        n <<= 10;
+        end++;
+        break;
+    }
+    return *end == '\0' ? n : 0;
+}
+
+static int wanted(const char* filter, const char* bench)
+{
+    return filter == NULL || strstr(bench, filter) != NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max_size = MICRO_DEFAULT_MAX;
+    const char* filter = NULL;
+
+    int opt;
+    int bad = 0;
+    while ((opt = getopt(argc, argv, "m:b:t:f:")) != -1) {
+        switch (opt) {
+        case 'm':
+            max_size = parseSize(optarg);
+            break;
+        case 'b':
+            filter = optarg;
+            break;
+        case 't':
+            min_seconds = atof(optarg);
+            break;
+        case 'f':
+            csv = strcmp(optarg, "csv") == 0;
+            bad |= !csv && strcmp(optarg, "table") != 0;
+            break;
+        default:
+            bad = 1;
+            break;
+        }
+    }
+    if (bad || optind != argc || max_size < MICRO_MIN_SIZE) {
+        fprintf(stderr, "USAGE: %s [-m max_size] [-b benchmark] [-t seconds] [-f table|csv]\n", argv[0]);
+        return 1;
+    }
+
+    // Every variant this CPU can run, scalar first as the reference
+    struct variant variants[4];
+    int variant_count = 0;
+    variants[variant_count++] = (struct variant){"scalar", otpEncryptScalar, otpDecryptScalar, otpScanScalar};
+#ifdef OTP_CIPHER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        variants[variant_count++] = (struct variant){"sse4.1", otpEncryptSse41, otpDecryptSse41, otpScanSse41};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        variants[variant_count++] = (struct variant){"avx2", otpEncryptAvx2, otpDecryptAvx2, otpScanAvx2};
+    }
+    if (__builtin_cpu_supports("avx512bw")) {
+        variants[variant_count++] = (struct variant){"avx512bw", otpEncryptAvx512, otpDecryptAvx512, otpScanAvx512};
+    }
+#endif
+
+    // The text and key are real keys, so every byte is a valid symbol
+    const uint32_t seed[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    keygenSeed(seed);
+    struct micro_case c;
+    memset(&c, 0, sizeof(c));
+    struct msg_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    c.reader = &reader;
+    c.text = malloc(max_size);
+    c.key = malloc(max_size);
+    c.out = malloc(max_size);
+    c.packed_text = malloc(otpPackedSize(max_size));
+    c.packed_key = malloc(otpPackedSize(max_size));
+    c.packed_out = malloc(otpPackedSize(max_size));
+    if (c.text == NULL || c.key == NULL || c.out == NULL || c.packed_text == NULL ||
+        c.packed_key == NULL || c.packed_out == NULL) {
+        fprintf(stderr, "OTP_MICROBENCH: out of memory for %zu byte buffers\n", max_size);
+        return 1;
+    }
+    keygenFill(c.text, max_size, 1);
+    keygenFill(c.key, max_size, 2);
+    // A shorter case uses the start of these; a packed prefix unpacks to the same symbols
+    otpPack(c.packed_text, c.text, max_size);
+    otpPack(c.packed_key, c.key, max_size);
+
+    if (csv) {
+        printf("benchmark,variant,bytes,cycles_per_byte,gb_per_s,output\n");
+    } else {
+        printf("%-11s %-9s %11s %10s %9s  %s\n", "benchmark", "variant", "bytes", "cycles/B", "GB/s", "output");
+    }
+    // Sizes go up 16x at a time and end with max_size itself
+    for (size_t len = MICRO_MIN_SIZE; ; len = len < max_size / 16 ? len * 16 : max_size)
+    {
+        c.len = len;
+        for (int v = 0; v < variant_count; v++)
+        {
+            c.variant = &variants[v];
+            if (wanted(filter, "encrypt")) {
+                runEncrypt(&c);
+                int ok = checkKernel(&c, otpEncryptScalar) && checkInvalid(&c, c.variant->encrypt, otpEncryptScalar);
+                timeCase("encrypt", c.variant->name, runEncrypt, &c, ok);
+            }
+            if (wanted(filter, "decrypt")) {
+                runDecrypt(&c);
+                int ok = checkKernel(&c, otpDecryptScalar) && checkInvalid(&c, c.variant->decrypt, otpDecryptScalar);
+                timeCase("decrypt", c.variant->name, runDecrypt, &c, ok);
+            }
+            if (wanted(filter, "scan")) {
+                timeCase("scan", c.variant->name, runScan, &c, checkScan(&c));
+            }
+        }
+        if (wanted(filter, "reassembly") && len <= MICRO_REASSEMBLY_MAX) {
+            timeCase("reassembly", "legacy", runReassembly, &c, checkReassembly(&c));
+        }
+        if (wanted(filter, "pack")) {
+            timeCase("pack", "table", runPack, &c, checkPack(&c));
+            timeCase("unpack", "table", runUnpack, &c, checkPack(&c));
+        }
+        if (wanted(filter, "packed-encrypt")) {
+            int ok = checkPacked(&c, runPackedEncrypt, otpEncryptScalar);
+            timeCase("packed-encrypt", "table", runPackedEncrypt, &c, ok);
+        }
+        if (wanted(filter, "packed-decrypt")) {
+            int ok = checkPacked(&c, runPackedDecrypt, otpDecryptScalar);
+            timeCase("packed-decrypt", "table", runPackedDecrypt, &c, ok);
+        }
+        if (wanted(filter, "keygen")) {
+            // The check leaves the reference output over the text, so put it back afterwards
+            int ok = checkKeygen(&c);
+            timeCase("keygen", "reference", runKeygenRef, &c, ok);
+            timeCase("keygen", "chacha8x", runKeygen, &c, ok);
+            keygenFill(c.text, len, 1);
+        }
+        if (len == max_size) {
+            break;
+        }
+    }
+    readerRelease(&reader);
+    return mismatches > 0;
+}
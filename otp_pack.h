@@ -0,0 +1,234 @@
+/*
+* Packed encoding of the 27 symbols for the wire.
+* Three symbols (values 0-26, as in otp_cipher.h) make one 15-bit group,
+* 729 * s0 + 27 * s1 + s2 < 2^15, and eight groups make a block of 24
+* symbols in 15 bytes: a little-endian 120-bit number with group g in bits
+* 15g to 15g + 14. A message whose length is not a multiple of 24 ends in a
+* short block of just the bytes its last groups need, padded with A, so n
+* symbols take otpPackedSize(n) bytes, 37.5% fewer than one byte each.
+*
+* otpPackedEncrypt() and otpPackedDecrypt() apply the cipher to packed text
+* and key directly. Each group is split into its three symbols by one table
+* lookup, the symbols of text and key are combined three at a time in the
+* bytes of one word, and the result is packed again, so the text never goes
+* back to ASCII. They have the otp_kernel signature, with len counting
+* symbols rather than bytes.
+*/
+
+#ifndef OTP_PACK_H
+#define OTP_PACK_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "otp_cipher.h"
+
+#define OTP_PACK_SYMBOLS 24             // Symbols in a packed block
+#define OTP_PACK_BLOCK 15               // Bytes in a packed block
+#define OTP_PACK_GROUPS 8               // 15-bit groups in a block
+
+// The three symbol values of every 15-bit group, s0 in the low byte; set by otpPackInit()
+static uint32_t otp_pack_digits[1 << 15];
+// Symbol value of every character, 0 for anything but A-Z and space
+static uint8_t otp_pack_value[256];
+static int otp_pack_ready = 0;
+
+/*
+* Build the tables. Called automatically on first use; every thread builds
+* the same tables, so racing with another one is harmless.
+*/
+static inline void otpPackInit(void)
+{
+    for (uint32_t v = 0; v < (1 << 15); v++)
+    {
+        // Groups past 26 26 26 never come from a valid message; they decode as A A A
+        uint32_t g = v < 27 * 27 * 27 ? v : 0;
+        otp_pack_digits[v] = (g / 729) | ((g / 27 % 27) << 8) | ((g % 27) << 16);
+    }
+    for (int c = 0; c < 256; c++)
+    {
+        otp_pack_value[c] = otp_valid_char[c] ? otpCharValue(c) : 0;
+    }
+    __atomic_store_n(&otp_pack_ready, 1, __ATOMIC_RELEASE);
+}
+
+static inline void otpPackReady(void)
+{
+    if (!__atomic_load_n(&otp_pack_ready, __ATOMIC_ACQUIRE)) {
+        otpPackInit();
+    }
+}
+
+// Bytes taken by n packed symbols
+static inline size_t otpPackedSize(size_t n)
+{
+    size_t tailGroups = (n % OTP_PACK_SYMBOLS + 2) / 3;
+    return n / OTP_PACK_SYMBOLS * OTP_PACK_BLOCK + (tailGroups * 15 + 7) / 8;
+}
+
+// Split the block at in into its eight groups
+static inline void otpPackLoad(const unsigned char* in, uint32_t g[OTP_PACK_GROUPS])
+{
+    uint64_t lo, hi;
+    memcpy(&lo, in, 8);
+    memcpy(&hi, in + 7, 8);
+    lo = le64toh(lo);
+    hi = le64toh(hi) >> 4;
+    for (int i = 0; i < 4; i++)
+    {
+        g[i] = (lo >> (15 * i)) & 0x7fff;
+        g[i + 4] = (hi >> (15 * i)) & 0x7fff;
+    }
+}
+
+// Write eight groups as the block at out
+static inline void otpPackStore(unsigned char* out, const uint32_t g[OTP_PACK_GROUPS])
+{
+    uint64_t lo = 0, hi = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        lo |= (uint64_t)g[i] << (15 * i);
+        hi |= (uint64_t)g[i + 4] << (15 * i);
+    }
+    // Byte 7 is shared: the top 4 bits of lo and the bottom 4 of hi
+    uint64_t first = htole64(lo | (hi << 60));
+    uint64_t second = htole64((lo >> 56) | (hi << 4));
+    memcpy(out, &first, 8);
+    memcpy(out + 7, &second, 8);
+}
+
+// The group made of three symbol values held in the low three bytes of d
+static inline uint32_t otpPackGroup(uint32_t d)
+{
+    return (d & 0xff) * 729 + ((d >> 8) & 0xff) * 27 + (d >> 16);
+}
+
+// Pack the 24 characters at text into the block at out
+static inline void otpPackBlock(unsigned char* out, const char* text)
+{
+    uint32_t g[OTP_PACK_GROUPS];
+    for (int i = 0; i < OTP_PACK_GROUPS; i++)
+    {
+        const unsigned char* t = (const unsigned char*)text + 3 * i;
+        g[i] = otp_pack_value[t[0]] * 729 + otp_pack_value[t[1]] * 27 + otp_pack_value[t[2]];
+    }
+    otpPackStore(out, g);
+}
+
+// Unpack the block at in into 24 characters at out
+static inline void otpUnpackBlock(char* out, const unsigned char* in)
+{
+    uint32_t g[OTP_PACK_GROUPS];
+    otpPackLoad(in, g);
+    for (int i = 0; i < OTP_PACK_GROUPS; i++)
+    {
+        uint32_t d = otp_pack_digits[g[i]];
+        // 'A' + value, except that 26 is a space: values of 26 have the top
+        // bit set after adding 102, and those bytes move from '[' down to ' '
+        uint32_t space = ((d + 0x666666) >> 7) & 0x010101;
+        uint32_t ascii = d + 0x414141 - space * ('[' - ' ');
+        out[3 * i] = ascii & 0xff;
+        out[3 * i + 1] = (ascii >> 8) & 0xff;
+        out[3 * i + 2] = ascii >> 16;
+    }
+}
+
+// Pack n characters of text (A-Z and space) into otpPackedSize(n) bytes at out
+static inline void otpPack(unsigned char* out, const char* text, size_t n)
+{
+    otpPackReady();
+    size_t full = n / OTP_PACK_SYMBOLS;
+    for (size_t b = 0; b < full; b++)
+    {
+        otpPackBlock(out + b * OTP_PACK_BLOCK, text + b * OTP_PACK_SYMBOLS);
+    }
+    size_t tail = n % OTP_PACK_SYMBOLS;
+    if (tail > 0) {
+        char last[OTP_PACK_SYMBOLS];
+        unsigned char block[OTP_PACK_BLOCK + 1];
+        memset(last, 'A', sizeof(last));
+        memcpy(last, text + full * OTP_PACK_SYMBOLS, tail);
+        otpPackBlock(block, last);
+        memcpy(out + full * OTP_PACK_BLOCK, block, otpPackedSize(n) - full * OTP_PACK_BLOCK);
+    }
+}
+
+// Unpack n symbols from the otpPackedSize(n) bytes at in into characters at out
+static inline void otpUnpack(char* out, const unsigned char* in, size_t n)
+{
+    otpPackReady();
+    size_t full = n / OTP_PACK_SYMBOLS;
+    for (size_t b = 0; b < full; b++)
+    {
+        otpUnpackBlock(out + b * OTP_PACK_SYMBOLS, in + b * OTP_PACK_BLOCK);
+    }
+    size_t tail = n % OTP_PACK_SYMBOLS;
+    if (tail > 0) {
+        unsigned char block[OTP_PACK_BLOCK + 1] = {0};
+        char last[OTP_PACK_SYMBOLS];
+        memcpy(block, in + full * OTP_PACK_BLOCK, otpPackedSize(n) - full * OTP_PACK_BLOCK);
+        otpUnpackBlock(last, block);
+        memcpy(out + full * OTP_PACK_SYMBOLS, last, tail);
+    }
+}
+
+/*
+* Combine one packed block of text and key into out, which may be the text.
+* Symbols are added (or subtracted, plus 27) in the bytes of one word, where
+* they cannot carry into each other, and 27 is taken off every byte that
+* reached it: adding 101 sets the top bit of exactly those bytes.
+*/
+static inline void otpPackedBlock(unsigned char* out, const unsigned char* text,
+                                  const unsigned char* key, int decrypt)
+{
+    uint32_t t[OTP_PACK_GROUPS], k[OTP_PACK_GROUPS];
+    otpPackLoad(text, t);
+    otpPackLoad(key, k);
+    for (int i = 0; i < OTP_PACK_GROUPS; i++)
+    {
+        uint32_t dt = otp_pack_digits[t[i]];
+        uint32_t dk = otp_pack_digits[k[i]];
+        uint32_t s = decrypt ? dt + 0x1b1b1b - dk : dt + dk;
+        s -= (((s + 0x656565) >> 7) & 0x010101) * 27;
+        t[i] = otpPackGroup(s);
+    }
+    otpPackStore(out, t);
+}
+
+static inline void otpPackedTransform(char* out, const char* text, const char* key, size_t len, int decrypt)
+{
+    otpPackReady();
+    unsigned char* o = (unsigned char*)out;
+    const unsigned char* t = (const unsigned char*)text;
+    const unsigned char* k = (const unsigned char*)key;
+    size_t full = len / OTP_PACK_SYMBOLS;
+    for (size_t b = 0; b < full; b++)
+    {
+        otpPackedBlock(o + b * OTP_PACK_BLOCK, t + b * OTP_PACK_BLOCK, k + b * OTP_PACK_BLOCK, decrypt);
+    }
+    size_t tailBytes = otpPackedSize(len) - full * OTP_PACK_BLOCK;
+    if (tailBytes > 0) {
+        // A short block is worked on in full; whatever its padding turns
+        // into is never unpacked
+        unsigned char tb[OTP_PACK_BLOCK + 1] = {0}, kb[OTP_PACK_BLOCK + 1] = {0};
+        memcpy(tb, t + full * OTP_PACK_BLOCK, tailBytes);
+        memcpy(kb, k + full * OTP_PACK_BLOCK, tailBytes);
+        otpPackedBlock(tb, tb, kb, decrypt);
+        memcpy(o + full * OTP_PACK_BLOCK, tb, tailBytes);
+    }
+}
+
+// Encrypt len packed symbols of text with the packed key into out (or back over text)
+static inline void otpPackedEncrypt(char* out, const char* text, const char* key, size_t len)
+{
+    otpPackedTransform(out, text, key, len, 0);
+}
+
+// Decrypt len packed symbols of text with the packed key into out (or back over text)
+static inline void otpPackedDecrypt(char* out, const char* text, const char* key, size_t len)
+{
+    otpPackedTransform(out, text, key, len, 1);
+}
+
+#endif
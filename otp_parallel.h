@@ -0,0 +1,198 @@
+/*
+* A shared thread pool that splits large transforms across cores.
+* A one-time pad has no dependency between positions, so a payload is cut
+* into OTP_PARALLEL_BLOCK-sized blocks, small enough that a block of text,
+* key and output stays in cache, and helper threads and the caller claim
+* blocks from a shared counter until none are left.
+* The pool runs one job at a time. A caller that finds it busy transforms
+* its payload on its own instead of queueing behind another request, and
+* payloads shorter than the threshold never use it at all. Helper threads
+* are started on the first large payload, so forked workers each get their
+* own pool, and can be pinned to CPUs of their own (otp_affinity.h).
+*/
+
+#ifndef OTP_PARALLEL_H
+#define OTP_PARALLEL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "otp_cipher.h"
+#include "otp_affinity.h"
+
+#define OTP_PARALLEL_BLOCK 16384
+#define OTP_PARALLEL_DEFAULT_MIN 262144
+
+struct otp_parallel {
+    pthread_mutex_t submit;     // Held by the caller whose job is running
+    pthread_mutex_t lock;       // Guards everything below
+    pthread_cond_t work;        // Signalled when a job is posted
+    pthread_cond_t idle;        // Signalled when a helper finishes with a job
+    int threads;                // Helper threads wanted
+    int started;                // Helper threads running
+    const int* cpus;            // CPUs helpers are pinned to in turn (NULL = anywhere)
+    int cpu_count;
+    size_t min_len;             // Shorter payloads are transformed by the caller alone
+    unsigned long generation;   // Bumped for every job so helpers notice new work
+    int active;                 // Helpers working on the current job
+
+    // The current job
+    otp_kernel kernel;
+    char* out;
+    const char* text;
+    const char* key;
+    size_t len;
+    size_t blocks;
+    size_t next_block;          // Next block to claim, updated atomically
+    size_t blocks_done;         // Blocks finished, updated atomically
+};
+
+static struct otp_parallel otp_parallel = {
+    .submit = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+    .min_len = OTP_PARALLEL_DEFAULT_MIN,
+};
+
+/*
+* Set the number of helper threads and the shortest payload worth splitting.
+* threads = 0 or minLen = 0 turns parallel transforms off. Must be called
+* before the first transform.
+*/
+static inline void otpParallelConfigure(int threads, size_t minLen)
+{
+    otp_parallel.threads = threads;
+    otp_parallel.min_len = minLen;
+}
+
+/*
+* Pin the n-th helper thread to cpus[n % count] once it starts; count = 0
+* leaves them to the scheduler. cpus must outlive the pool. Must be called
+* before the first transform.
+*/
+static inline void otpParallelPlace(const int* cpus, int count)
+{
+    otp_parallel.cpus = count > 0 ? cpus : NULL;
+    otp_parallel.cpu_count = count;
+}
+
+// Claim and transform blocks of the current job until there are none left
+static inline void otpParallelRun(otp_kernel kernel, char* out, const char* text,
+                                  const char* key, size_t len, size_t blocks)
+{
+    size_t block;
+    while ((block = __atomic_fetch_add(&otp_parallel.next_block, 1, __ATOMIC_RELAXED)) < blocks)
+    {
+        size_t start = block * OTP_PARALLEL_BLOCK;
+        size_t n = len - start < OTP_PARALLEL_BLOCK ? len - start : OTP_PARALLEL_BLOCK;
+        kernel(out + start, text + start, key + start, n);
+        __atomic_fetch_add(&otp_parallel.blocks_done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Body of the helper thread numbered by arg: wait for a job, help with it, repeat
+static void* otpParallelHelper(void* arg)
+{
+    int index = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+    if (otp_parallel.cpus != NULL) {
+        affinityPin(otp_parallel.cpus[index % otp_parallel.cpu_count], "otp_parallel");
+    }
+
+    pthread_mutex_lock(&otp_parallel.lock);
+    while (1)
+    {
+        while (otp_parallel.generation == seen) {
+            pthread_cond_wait(&otp_parallel.work, &otp_parallel.lock);
+        }
+        seen = otp_parallel.generation;
+
+        // The job cannot change while any helper is active
+        otp_parallel.active++;
+        otp_kernel kernel = otp_parallel.kernel;
+        char* out = otp_parallel.out;
+        const char* text = otp_parallel.text;
+        const char* key = otp_parallel.key;
+        size_t len = otp_parallel.len;
+        size_t blocks = otp_parallel.blocks;
+        pthread_mutex_unlock(&otp_parallel.lock);
+
+        otpParallelRun(kernel, out, text, key, len, blocks);
+
+        pthread_mutex_lock(&otp_parallel.lock);
+        otp_parallel.active--;
+        pthread_cond_signal(&otp_parallel.idle);
+    }
+    return NULL;
+}
+
+// Start the helper threads. Called with otp_parallel.submit held.
+static inline void otpParallelStart(void)
+{
+    while (otp_parallel.started < otp_parallel.threads)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, otpParallelHelper, (void*)(intptr_t)otp_parallel.started) != 0) {
+            fprintf(stderr, "otp_parallel: could not start helper thread\n");
+            break;
+        }
+        pthread_detach(thread);
+        otp_parallel.started++;
+    }
+    // Without helpers there is nothing to gain from splitting payloads
+    if (otp_parallel.started == 0) {
+        otp_parallel.min_len = 0;
+    }
+}
+
+/*
+* Transform len characters of text with key into out using kernel, spreading
+* the work over the thread pool when the payload is long enough and the pool
+* is free. out may be text itself, as with the kernels.
+*/
+static inline void otpParallelTransform(otp_kernel kernel, char* out, const char* text,
+                                        const char* key, size_t len)
+{
+    if (otp_parallel.min_len == 0 || otp_parallel.threads <= 0 || len < otp_parallel.min_len ||
+        pthread_mutex_trylock(&otp_parallel.submit) != 0)
+    {
+        kernel(out, text, key, len);
+        return;
+    }
+    if (otp_parallel.started < otp_parallel.threads) {
+        otpParallelStart();
+    }
+
+    size_t blocks = (len + OTP_PARALLEL_BLOCK - 1) / OTP_PARALLEL_BLOCK;
+    pthread_mutex_lock(&otp_parallel.lock);
+    // A helper that woke up late for the previous job may still be leaving it
+    while (otp_parallel.active > 0) {
+        pthread_cond_wait(&otp_parallel.idle, &otp_parallel.lock);
+    }
+    otp_parallel.kernel = kernel;
+    otp_parallel.out = out;
+    otp_parallel.text = text;
+    otp_parallel.key = key;
+    otp_parallel.len = len;
+    otp_parallel.blocks = blocks;
+    otp_parallel.next_block = 0;
+    otp_parallel.blocks_done = 0;
+    otp_parallel.generation++;
+    pthread_cond_broadcast(&otp_parallel.work);
+    pthread_mutex_unlock(&otp_parallel.lock);
+
+    // The caller works through blocks too, then waits for the helpers still busy
+    otpParallelRun(kernel, out, text, key, len, blocks);
+    pthread_mutex_lock(&otp_parallel.lock);
+    while (otp_parallel.active > 0 ||
+           __atomic_load_n(&otp_parallel.blocks_done, __ATOMIC_ACQUIRE) < blocks)
+    {
+        pthread_cond_wait(&otp_parallel.idle, &otp_parallel.lock);
+    }
+    pthread_mutex_unlock(&otp_parallel.lock);
+    pthread_mutex_unlock(&otp_parallel.submit);
+}
+
+#endif
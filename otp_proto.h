@@ -0,0 +1,311 @@
+/*
+* Wire protocol shared by the clients and servers.
+*
+* Version 1 is the original ASCII protocol: the client sends "enc_client|" or
+* "dec_client|", then "<text>|<key>|", and the server replies with the bare
+* transformed text and closes the socket.
+*
+* Version 2 replaces the delimiters with a fixed 24-byte header so both sides
+* know up front exactly how many bytes to expect:
+*
+*   offset  size  field
+*   0       4     magic        "OTP2"
+*   4       1     version      OTP_VERSION
+*   5       1     opcode       OTP_OP_*
+*   6       2     flags        OTP_FLAG_*
+*   8       8     payload_len  bytes of text that follow the header
+*   16      8     key_len      bytes of key that follow the text
+*
+* All fields are in network byte order. A request is a header with opcode
+* OTP_OP_ENCRYPT or OTP_OP_DECRYPT followed by the text and the key. The
+* reply is a header with opcode OTP_OP_RESULT followed by payload_len bytes
+* of transformed text, or OTP_OP_ERROR followed by a message. A server that
+* only speaks version 1 closes the connection without replying, which tells
+* the client to fall back to version 1.
+*
+* A request with OTP_FLAG_STREAM set carries no body of its own. Instead the
+* client sends any number of chunks, each a 4-byte length n (at most
+* OTP_MAX_CHUNK) followed by n bytes of text and then n bytes of key, and ends
+* with a chunk of length 0. The server answers with a OTP_OP_RESULT header
+* that also has OTP_FLAG_STREAM set, then one chunk of n transformed bytes for
+* every chunk it receives and a final chunk of length 0, so neither side has
+* to hold more than one chunk of a message in memory.
+*
+* A request with OTP_FLAG_SESSION set asks the server to keep the connection
+* open once it has replied and read another request from it. The client can
+* send any number of such requests back to back without waiting for replies,
+* and the server answers them in the order they were sent. The session ends
+* when the client closes its side between requests, or sends a request
+* without the flag.
+*
+* A request with OTP_FLAG_KEYREF carries a reference to a pad held by the
+* server in place of the key: key_len bytes made of an 8-byte offset into the
+* pad followed by the pad's ID. An encryption request may give OTP_KEY_NEXT
+* as the offset to take the next unused part of the pad. The reply also has
+* OTP_FLAG_KEYREF set, with key_len holding the offset that was used, which
+* is what the matching decryption request has to name.
+*
+* A request with OTP_FLAG_PACKED carries its text and key in the packed
+* encoding of otp_pack.h, 24 symbols to 15 bytes. payload_len, key_len and
+* chunk lengths still count symbols, and otpPackedSize() of each is what
+* goes over the wire. A server that understands the flag echoes it in its
+* reply and packs the reply the same way; the stream chunks follow suit.
+* Packing does not go with OTP_FLAG_KEYREF.
+*
+* Over a Unix domain socket a request with OTP_FLAG_SHARED leaves its text
+* and key in memory shared with the server instead of sending them. The
+* memory is a memfd sealed against shrinking, at most OTP_SHARED_MAX bytes,
+* that the client passes with SCM_RIGHTS alongside the bytes of that request
+* or of an earlier one on the same connection. The body is two 8-byte
+* offsets into it, where payload_len bytes of text and key_len bytes of key
+* start. The server transforms the text where it lies and replies with a
+* header that also has OTP_FLAG_SHARED set and no payload, so the result is
+* read from the shared memory too. Sharing does not go with any other flag
+* but OTP_FLAG_SESSION.
+*
+* A server that is out of room for another connection or request answers
+* with OTP_OP_BUSY instead, followed by a message, and then closes the
+* connection. The body of a refused request is still read, and thrown away
+* as it arrives, so the client can finish sending it and see the reply
+* before the connection is closed; a stream is refused at its header, and
+* its chunks are not read. Nothing was done with the request, so the client
+* can send it again later.
+*/
+
+#ifndef OTP_PROTO_H
+#define OTP_PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define OTP_MAGIC "OTP2"
+#define OTP_MAGIC_LEN 4
+#define OTP_VERSION 2
+#define OTP_HEADER_SIZE 24
+#define OTP_CHUNK_HEADER 4
+#define OTP_MAX_CHUNK 65536
+#define OTP_KEY_OFFSET_SIZE 8
+#define OTP_KEY_ID_MAX 64
+#define OTP_KEY_NEXT UINT64_MAX
+#define OTP_SHARED_REF_SIZE 16
+#define OTP_SHARED_MAX (1ull << 30)
+
+enum otp_opcode {
+    OTP_OP_ENCRYPT = 1,     // Request: encrypt the text with the key
+    OTP_OP_DECRYPT = 2,     // Request: decrypt the text with the key
+    OTP_OP_RESULT = 3,      // Reply: the transformed text
+    OTP_OP_ERROR = 4,       // Reply: the request was refused, payload is the reason
+    OTP_OP_BUSY = 5         // Reply: the server is saturated, try again later; payload is the reason
+};
+
+enum otp_flags {
+    OTP_FLAG_STREAM = 0x0001,   // The text and key follow as a series of chunks
+    OTP_FLAG_SESSION = 0x0002,  // Keep the connection open for another request
+    OTP_FLAG_KEYREF = 0x0004,   // The key is a reference to a pad held by the server
+    OTP_FLAG_PACKED = 0x0008,   // Text and key are packed 24 symbols to 15 bytes
+    OTP_FLAG_SHARED = 0x0010    // Text and key are in memory shared with the server
+};
+
+struct otp_header {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint64_t payload_len;
+    uint64_t key_len;
+};
+
+// Serialize hdr into the OTP_HEADER_SIZE bytes at out
+static inline void otpEncodeHeader(unsigned char* out, const struct otp_header* hdr)
+{
+    uint16_t flags = htobe16(hdr->flags);
+    uint64_t payload_len = htobe64(hdr->payload_len);
+    uint64_t key_len = htobe64(hdr->key_len);
+
+    memcpy(out, OTP_MAGIC, OTP_MAGIC_LEN);
+    out[4] = hdr->version;
+    out[5] = hdr->opcode;
+    memcpy(out + 6, &flags, sizeof(flags));
+    memcpy(out + 8, &payload_len, sizeof(payload_len));
+    memcpy(out + 16, &key_len, sizeof(key_len));
+}
+
+// Parse the OTP_HEADER_SIZE bytes at in. Returns -1 if they are not a version 2 header.
+static inline int otpDecodeHeader(const unsigned char* in, struct otp_header* hdr)
+{
+    uint16_t flags;
+    uint64_t payload_len, key_len;
+
+    if (memcmp(in, OTP_MAGIC, OTP_MAGIC_LEN) != 0 || in[4] != OTP_VERSION) {
+        return -1;
+    }
+    memcpy(&flags, in + 6, sizeof(flags));
+    memcpy(&payload_len, in + 8, sizeof(payload_len));
+    memcpy(&key_len, in + 16, sizeof(key_len));
+    hdr->version = in[4];
+    hdr->opcode = in[5];
+    hdr->flags = be16toh(flags);
+    hdr->payload_len = be64toh(payload_len);
+    hdr->key_len = be64toh(key_len);
+    return 0;
+}
+
+// Serialize the length that starts a stream chunk into the OTP_CHUNK_HEADER bytes at out
+static inline void otpEncodeChunk(unsigned char* out, uint32_t len)
+{
+    uint32_t be_len = htobe32(len);
+    memcpy(out, &be_len, sizeof(be_len));
+}
+
+// Parse the length at the start of a stream chunk
+static inline uint32_t otpDecodeChunk(const unsigned char* in)
+{
+    uint32_t be_len;
+    memcpy(&be_len, in, sizeof(be_len));
+    return be32toh(be_len);
+}
+
+/*
+* Serialize a reference to idLen bytes of pad ID at offset into out, which
+* needs room for OTP_KEY_OFFSET_SIZE + OTP_KEY_ID_MAX bytes.
+* Returns the length of the reference, which goes in key_len.
+*/
+static inline size_t otpEncodeKeyRef(unsigned char* out, uint64_t offset, const char* id, size_t idLen)
+{
+    uint64_t be_offset = htobe64(offset);
+    memcpy(out, &be_offset, sizeof(be_offset));
+    memcpy(out + OTP_KEY_OFFSET_SIZE, id, idLen);
+    return OTP_KEY_OFFSET_SIZE + idLen;
+}
+
+// Parse a key reference of len bytes at in. Returns -1 if it is malformed.
+static inline int otpDecodeKeyRef(const unsigned char* in, size_t len, uint64_t* offset,
+                                  const char** id, size_t* idLen)
+{
+    uint64_t be_offset;
+    if (len <= OTP_KEY_OFFSET_SIZE || len > OTP_KEY_OFFSET_SIZE + OTP_KEY_ID_MAX) {
+        return -1;
+    }
+    memcpy(&be_offset, in, sizeof(be_offset));
+    *offset = be64toh(be_offset);
+    *id = (const char*)in + OTP_KEY_OFFSET_SIZE;
+    *idLen = len - OTP_KEY_OFFSET_SIZE;
+    return 0;
+}
+
+// Serialize the offsets of the text and key in shared memory into the OTP_SHARED_REF_SIZE bytes at out
+static inline void otpEncodeShared(unsigned char* out, uint64_t textOffset, uint64_t keyOffset)
+{
+    uint64_t be_text = htobe64(textOffset);
+    uint64_t be_key = htobe64(keyOffset);
+    memcpy(out, &be_text, sizeof(be_text));
+    memcpy(out + 8, &be_key, sizeof(be_key));
+}
+
+// Parse the offsets of the text and key in shared memory
+static inline void otpDecodeShared(const unsigned char* in, uint64_t* textOffset, uint64_t* keyOffset)
+{
+    uint64_t be_text, be_key;
+    memcpy(&be_text, in, sizeof(be_text));
+    memcpy(&be_key, in + 8, sizeof(be_key));
+    *textOffset = be64toh(be_text);
+    *keyOffset = be64toh(be_key);
+}
+
+// True if the len bytes at buf could be the start of a version 2 header
+static inline int otpIsMagicPrefix(const char* buf, size_t len)
+{
+    if (len > OTP_MAGIC_LEN) {
+        len = OTP_MAGIC_LEN;
+    }
+    return memcmp(buf, OTP_MAGIC, len) == 0;
+}
+
+/*
+* Write all len bytes of buf to the socket, retrying after short writes.
+* Returns 0 on success and -1 with errno set if the socket failed.
+*/
+static inline int otpSendAll(int fd, const void* buf, size_t len)
+{
+    const char* p = buf;
+    while (len > 0)
+    {
+        ssize_t charsWritten = send(fd, p, len, MSG_NOSIGNAL);
+        if (charsWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += charsWritten;
+        len -= charsWritten;
+    }
+    return 0;
+}
+
+/*
+* Write every byte of the count buffers in iov to the socket in as few
+* sendmsg() calls as it takes, so the parts of a request leave together
+* rather than each waiting behind the last. iov is advanced past what was
+* sent. Returns 0 on success and -1 with errno set if the socket failed.
+*/
+static inline int otpSendAllv(int fd, struct iovec* iov, int count)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t charsWritten = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (charsWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)charsWritten >= msg.msg_iov->iov_len) {
+            charsWritten -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + charsWritten;
+            msg.msg_iov->iov_len -= charsWritten;
+        }
+    }
+    return 0;
+}
+
+/*
+* Read exactly len bytes from the socket into buf.
+* Returns the number of bytes read, which is short only if the peer closed
+* the connection, or -1 with errno set if the socket failed.
+*/
+static inline ssize_t otpRecvAll(int fd, void* buf, size_t len)
+{
+    char* p = buf;
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t charsRead = recv(fd, p + total, len - total, 0);
+        if (charsRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (charsRead == 0) {
+            break;
+        }
+        total += charsRead;
+    }
+    return total;
+}
+
+#endif
@@ -0,0 +1,262 @@
+/*
+* Name: Christian DeVore
+* Description: Regression checks for the servers and clients. Each check
+* feeds input that is easy to get wrong to the same code the servers run,
+* in-process, and says whether it is handled. Prints one line per check
+* and exits with status 1 if any of them failed.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "otp_server.h"
+
+#define REGRESS_TEXT_LEN 3000   // Longer than the parser's first buffer, so a short key reads past it
+#define REGRESS_PACK_MAX 48     // Two packed blocks, so every tail length is met after a full block too
+
+static const struct server_config regress_server = {
+    .name = "OTP_REGRESS",
+    .ops = {&server_encrypt},
+};
+
+// The same server with room for nothing beyond each connection's first buffer
+static const struct server_config regress_full_server = {
+    .name = "OTP_REGRESS",
+    .ops = {&server_encrypt},
+    .max_bytes = 1,
+};
+
+static int failures = 0;
+
+static void report(const char* check, int ok)
+{
+    printf("%-40s %s\n", check, ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+/*
+* Parse "enc_client|<text>|<key>|" with text_len A's and key_len B's, as a
+* version 1 server receives it. Returns what the parser returned: -1 if the
+* client is dropped, otherwise 0 with the reader's phase showing how far it got.
+*/
+static int parseV1(struct msg_reader* r, size_t text_len, size_t key_len)
+{
+    size_t len = strlen("enc_client|") + text_len + 1 + key_len + 1;
+    char* req = malloc(len);
+    if (req == NULL) {
+        fprintf(stderr, "OTP_REGRESS: out of memory\n");
+        exit(2);
+    }
+    size_t n = sprintf(req, "enc_client|");
+    memset(req + n, 'A', text_len);
+    n += text_len;
+    req[n++] = '|';
+    memset(req + n, 'B', key_len);
+    n += key_len;
+    req[n++] = '|';
+
+    readerReset(r);
+    int rc = readerAppend(r, req, n, &regress_server);
+    if (rc >= 0) {
+        rc = readerParse(r, &regress_server);
+    }
+    free(req);
+    return rc;
+}
+
+// A version 1 key shorter than its text must never reach the transform
+static void checkV1ShortKey(struct msg_reader* r)
+{
+    report("v1 empty key is dropped", parseV1(r, REGRESS_TEXT_LEN, 0) < 0);
+    report("v1 key one short is dropped", parseV1(r, REGRESS_TEXT_LEN, REGRESS_TEXT_LEN - 1) < 0);
+    report("v1 key as long as the text is served",
+           parseV1(r, REGRESS_TEXT_LEN, REGRESS_TEXT_LEN) == 0 && r->phase == MSG_RESPONSE);
+    report("v1 key longer than the text is served",
+           parseV1(r, REGRESS_TEXT_LEN, REGRESS_TEXT_LEN + 1) == 0 && r->phase == MSG_RESPONSE);
+}
+
+/*
+* Write a version 2 header followed by body bytes of text to out, which must
+* have room for both. Returns the length of the frame.
+*/
+static size_t v2Frame(unsigned char* out, uint8_t opcode, uint16_t flags,
+                      uint64_t payload_len, uint64_t key_len, size_t body)
+{
+    struct otp_header hdr = {OTP_VERSION, opcode, flags, payload_len, key_len};
+    otpEncodeHeader(out, &hdr);
+    memset(out + OTP_HEADER_SIZE, 'A', body);
+    return OTP_HEADER_SIZE + body;
+}
+
+/*
+* Parse the len bytes of frame as the start of a new connection to cfg, with
+* busy set if the server is out of connections. Each parse starts from an
+* empty buffer, so refusals for buffer space do not depend on the one before.
+* Returns what the parser returned, as parseV1() does.
+*/
+static int parseFrame(struct msg_reader* r, const struct server_config* cfg,
+                      const unsigned char* frame, size_t len, int busy)
+{
+    readerRelease(r);
+    readerReset(r);
+    r->busy = busy;
+    int rc = readerAppend(r, (const char*)frame, len, cfg);
+    if (rc >= 0) {
+        rc = readerParse(r, cfg);
+    }
+    return rc;
+}
+
+// Whether the request was refused with a reply that says why
+static int refused(const struct msg_reader* r, const char* why)
+{
+    return r->reject != NULL && strstr(r->reject, why) != NULL && r->phase == MSG_RESPONSE;
+}
+
+// Every version 2 header is either served, refused with a reply or dropped, never misread
+static void checkV2Header(struct msg_reader* r)
+{
+    static unsigned char frame[OTP_HEADER_SIZE + 2 * OTP_KEY_ID_MAX + 2 * REGRESS_TEXT_LEN];
+    const struct server_config* cfg = &regress_server;
+    size_t n;
+
+    n = v2Frame(frame, OTP_OP_ENCRYPT, 0, REGRESS_TEXT_LEN, REGRESS_TEXT_LEN, 2 * REGRESS_TEXT_LEN);
+    report("v2 request is served",
+           parseFrame(r, cfg, frame, n, 0) == 0 && r->phase == MSG_RESPONSE && r->reject == NULL &&
+           r->text_len == REGRESS_TEXT_LEN && r->consumed == n);
+    report("v2 header alone waits for its body",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE, 0) == 0 && r->phase == MSG_BODY &&
+           r->need == n);
+    report("v2 body one short waits for the rest",
+           parseFrame(r, cfg, frame, n - 1, 0) == 0 && r->phase == MSG_BODY);
+    report("v2 header one short waits for the rest",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE - 1, 0) == 0 && r->phase == MSG_HANDSHAKE);
+
+    v2Frame(frame, OTP_OP_ENCRYPT, OTP_FLAG_SESSION, 0, 0, 0);
+    report("v2 empty session request is served",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE, 0) == 0 && r->phase == MSG_RESPONSE &&
+           r->reject == NULL && r->session);
+
+    v2Frame(frame, OTP_OP_ENCRYPT, 0, 0, 0, 0);
+    frame[OTP_MAGIC_LEN - 1] = 'X';
+    report("v2 bad magic is dropped", parseFrame(r, cfg, frame, OTP_HEADER_SIZE, 0) < 0);
+    v2Frame(frame, OTP_OP_ENCRYPT, 0, 0, 0, 0);
+    frame[4] = OTP_VERSION + 1;
+    report("v2 unknown version is dropped", parseFrame(r, cfg, frame, OTP_HEADER_SIZE, 0) < 0);
+
+    v2Frame(frame, OTP_OP_DECRYPT, 0, 1, 1, 2);
+    report("v2 other server's opcode is refused",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE + 2, 0) == 0 && refused(r, "wrong operation"));
+    v2Frame(frame, OTP_OP_BUSY + 1, 0, 1, 1, 2);
+    report("v2 unknown opcode is refused",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE + 2, 0) == 0 && refused(r, "wrong operation"));
+
+    v2Frame(frame, OTP_OP_ENCRYPT, 0, MAX_MESSAGE + 1, MAX_MESSAGE + 1, 0);
+    report("v2 text too long is refused at once",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE, 0) == 0 && refused(r, "too long"));
+    v2Frame(frame, OTP_OP_ENCRYPT, 0, 1, UINT64_MAX, 0);
+    report("v2 key too long is refused at once",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE, 0) == 0 && refused(r, "too long"));
+    v2Frame(frame, OTP_OP_ENCRYPT, 0, 2, 1, 3);
+    report("v2 key shorter than the text is refused",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE + 3, 0) == 0 && refused(r, "key is shorter"));
+
+    v2Frame(frame, OTP_OP_ENCRYPT, OTP_FLAG_STREAM, 0, 0, 0);
+    report("v2 stream header starts the stream",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE, 0) == 0 && r->phase == MSG_RESPONSE &&
+           r->reject == NULL && r->stream && r->consumed == OTP_HEADER_SIZE);
+    v2Frame(frame, OTP_OP_ENCRYPT, OTP_FLAG_STREAM | OTP_FLAG_KEYREF, 0, 0, 0);
+    report("v2 streamed key reference is refused",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE, 0) == 0 && refused(r, "cannot be streamed"));
+
+    n = v2Frame(frame, OTP_OP_ENCRYPT, OTP_FLAG_KEYREF, 1, OTP_KEY_OFFSET_SIZE + 3, 1 + OTP_KEY_OFFSET_SIZE + 3);
+    report("v2 key reference is served",
+           parseFrame(r, cfg, frame, n, 0) == 0 && r->phase == MSG_RESPONSE && r->reject == NULL &&
+           r->keyref && r->key_len == OTP_KEY_OFFSET_SIZE + 3);
+    n = v2Frame(frame, OTP_OP_ENCRYPT, OTP_FLAG_KEYREF, 1, OTP_KEY_OFFSET_SIZE, 1 + OTP_KEY_OFFSET_SIZE);
+    report("v2 key reference with no ID is refused",
+           parseFrame(r, cfg, frame, n, 0) == 0 && refused(r, "malformed key reference"));
+    n = v2Frame(frame, OTP_OP_ENCRYPT, OTP_FLAG_KEYREF, 1, OTP_KEY_OFFSET_SIZE + OTP_KEY_ID_MAX + 1,
+                1 + OTP_KEY_OFFSET_SIZE + OTP_KEY_ID_MAX + 1);
+    report("v2 key reference ID too long is refused",
+           parseFrame(r, cfg, frame, n, 0) == 0 && refused(r, "malformed key reference"));
+    n = v2Frame(frame, OTP_OP_ENCRYPT, OTP_FLAG_KEYREF | OTP_FLAG_PACKED, 1, OTP_KEY_OFFSET_SIZE + 3,
+                otpPackedSize(1) + OTP_KEY_OFFSET_SIZE + 3);
+    report("v2 packed key reference is refused",
+           parseFrame(r, cfg, frame, n, 0) == 0 && refused(r, "cannot be packed"));
+
+    v2Frame(frame, OTP_OP_ENCRYPT, 0, 1, 1, 0);
+    // What is left to throw away is the body the header announced
+    report("v2 busy for connections is refused",
+           parseFrame(r, cfg, frame, OTP_HEADER_SIZE, 1) == 0 && r->busy && r->phase == MSG_DISCARD &&
+           r->need == 2);
+    v2Frame(frame, OTP_OP_ENCRYPT, 0, REGRESS_TEXT_LEN, REGRESS_TEXT_LEN, 0);
+    report("v2 busy for buffers is refused",
+           parseFrame(r, &regress_full_server, frame, OTP_HEADER_SIZE, 0) == 0 && r->busy &&
+           r->phase == MSG_DISCARD);
+    v2Frame(frame, OTP_OP_ENCRYPT, OTP_FLAG_STREAM, 0, 0, 0);
+    report("v2 busy stream is refused at its header",
+           parseFrame(r, &regress_full_server, frame, OTP_HEADER_SIZE, 0) == 0 && r->busy &&
+           r->phase == MSG_RESPONSE && !r->stream);
+}
+
+// Fill len characters at out with A-Z and space, the same each run
+static void fillSymbols(char* out, size_t len, unsigned* seed)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        *seed = *seed * 1103515245 + 12345;
+        out[i] = otpValueChar((*seed >> 16) % 27);
+    }
+}
+
+/*
+* Packed text and key, for every length up to two blocks, must encrypt to
+* what the character kernel gives once unpacked, and decrypt back to the
+* text. Lengths that are not a multiple of 24 end in a short block.
+*/
+static void checkPackedRoundTrip(void)
+{
+    char text[REGRESS_PACK_MAX], key[REGRESS_PACK_MAX], want[REGRESS_PACK_MAX], got[REGRESS_PACK_MAX];
+    unsigned char pt[OTP_PACK_BLOCK * 2], pk[OTP_PACK_BLOCK * 2], pc[OTP_PACK_BLOCK * 2];
+    unsigned seed = 27;
+    int unpacked = 1, encrypted = 1, decrypted = 1;
+
+    for (size_t len = 0; len <= REGRESS_PACK_MAX; len++)
+    {
+        fillSymbols(text, len, &seed);
+        fillSymbols(key, len, &seed);
+        otpEncryptScalar(want, text, key, len);
+
+        otpPack(pt, text, len);
+        otpPack(pk, key, len);
+        otpUnpack(got, pt, len);
+        unpacked &= memcmp(got, text, len) == 0;
+
+        otpPackedEncrypt((char*)pc, (const char*)pt, (const char*)pk, len);
+        otpUnpack(got, pc, len);
+        encrypted &= memcmp(got, want, len) == 0;
+
+        otpPackedDecrypt((char*)pc, (const char*)pc, (const char*)pk, len);
+        otpUnpack(got, pc, len);
+        decrypted &= memcmp(got, text, len) == 0;
+    }
+    report("packed text unpacks to itself", unpacked);
+    report("packed encrypt matches the scalar kernel", encrypted);
+    report("packed decrypt gives the text back", decrypted);
+}
+
+int main(void)
+{
+    struct msg_reader reader;
+    memset(&reader, 0, sizeof(reader));
+
+    checkV1ShortKey(&reader);
+    checkV2Header(&reader);
+    checkPackedRoundTrip();
+
+    readerRelease(&reader);
+    return failures > 0;
+}
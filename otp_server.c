@@ -0,0 +1,28 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "otp_server.h"
+
+/*
+* Main program for the combined server: encrypts for enc_client and decrypts
+* for dec_client on one port, with one set of workers or threads for both
+*/
+int main(int argc, char *argv[]){
+    struct server_config cfg = {
+        .name = "OTP_SERVER",
+        .ops = {&server_encrypt, &server_decrypt},
+    };
+
+    // Check usage & args
+    parseServerArgs(argc, argv, &cfg);
+
+    // Pick the cipher kernel once so every worker inherits the choice
+    otpCipherInit();
+
+    // Serve clients until we are asked to shut down
+    runServer(&cfg);
+    return 0;
+}
@@ -0,0 +1,2656 @@
+/*
+* Shared connection handling for enc_server, dec_server and otp_server.
+* Each server fills out a server_config describing its name and the
+* operations it serves - for each, the client it will talk to and the
+* otp_cipher.h kernel it applies - then calls runServer(), which
+* serves clients in one of three modes:
+*   pool  - a fixed pool of pre-forked workers that all accept on one
+*           listening socket, each serving one blocking connection at a time
+*   epoll - one non-blocking event loop per thread, each with its own
+*           SO_REUSEPORT listening socket, multiplexing many connections
+*   uring - like epoll, but each thread drives its connections through an
+*           io_uring (otp_uring.h); falls back to epoll where that is missing
+* All modes speak the original '|'-delimited protocol and the length-prefixed
+* version 2 protocol from otp_proto.h, telling them apart by the first bytes.
+* A server with more than one operation picks it per request, from the
+* client's name or the version 2 opcode.
+* With -a every mode keeps the counters and phase timings of otp_metrics.h
+* and serves them on a local admin port; with -T every reply is traced.
+* With -u every mode also listens on a Unix domain socket, where same-host
+* clients skip the TCP stack and can hand over their text and key in shared
+* memory (OTP_FLAG_SHARED) instead of sending them.
+* Every mode gives a connection a deadline for each request to arrive in
+* full (-R) and for each reply to be written (-W), so a slow or vanished
+* client cannot hold a worker or a connection slot for ever. The epoll and
+* uring modes also admit at most -c connections and -B bytes of request
+* buffers at a time; past that they answer OTP_OP_BUSY straight away rather
+* than queueing work they cannot keep up with. A pool has no admission
+* check and will not start with -c or -B: it is bounded by its workers,
+* each serving one connection, and its listen backlog instead.
+* With -A the loops or workers are pinned to the given CPUs or NUMA nodes
+* and allocate from their own node, and with -J so are the cipher helpers
+* (otp_affinity.h). Event loops with a CPU each also have the kernel steer
+* every connection to the loop on the CPU that received it.
+*/
+
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/resource.h>
+
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_parallel.h"
+#include "otp_keystore.h"
+#include "otp_uring.h"
+#include "otp_pack.h"
+#include "otp_metrics.h"
+#include "otp_buffer.h"
+#include "otp_deadline.h"
+#include "otp_affinity.h"
+
+#define MAX_MESSAGE 100000
+#define DEFAULT_WORKERS 5
+#define DEFAULT_BACKLOG 128     // Pool mode, where a long queue only keeps clients waiting
+#define EVENT_BACKLOG 4096      // Epoll and uring modes, which accept all that queue and turn away the excess
+#define EPOLL_BATCH 256
+#define READER_INITIAL_BUFFER 4096
+#define ZEROCOPY_MIN 16384      // Smallest reply worth sending with MSG_ZEROCOPY
+#define URING_ENTRIES 256       // Submission queue size of each io_uring
+#define URING_BUFFERS 256       // Provided receive buffers per io_uring (a power of two)
+#define URING_BUFFER_SIZE 16384
+// Largest request a reader will accept: the handshake or header, a full message and a full key
+#define READER_MAX (2 * MAX_MESSAGE + OTP_HEADER_SIZE)
+#define SERVER_OPS 2            // Most operations one server can serve
+#define DEFAULT_READ_TIMEOUT_MS 30000   // Time a request has to arrive in full
+#define DEFAULT_WRITE_TIMEOUT_MS 30000  // Time a reply has to be taken by the client
+#define DEFAULT_MAX_CONNS 10000         // Connections served at once (epoll and uring modes)
+#define DEFAULT_MAX_BYTES (256u << 20)  // Request buffer bytes held at once (epoll and uring modes)
+#define BUSY_MAX_CONNS 256      // Connections past the limit kept open to be told the server is busy
+#define FD_RESERVE 64           // Descriptors kept for listening sockets, epoll, pads and the like
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+enum server_mode {
+    MODE_POOL,
+    MODE_EPOLL,
+    MODE_URING
+};
+
+// An operation a server performs, and the client allowed to ask for it
+struct server_op {
+    const char* client_name;            // Name the client must send in the handshake ("enc_client")
+    otp_kernel transform;               // otpEncrypt() or otpDecrypt(), run in place
+    uint8_t opcode;                     // Version 2 opcode (OTP_OP_ENCRYPT or OTP_OP_DECRYPT)
+    otp_kernel packed_transform;        // The same on packed text and key (otp_pack.h)
+};
+
+static const struct server_op server_encrypt = {"enc_client", otpEncrypt, OTP_OP_ENCRYPT, otpPackedEncrypt};
+static const struct server_op server_decrypt = {"dec_client", otpDecrypt, OTP_OP_DECRYPT, otpPackedDecrypt};
+
+struct server_config {
+    const char* name;                   // Prefix used in log messages ("ENC_SERVER")
+    const struct server_op* ops[SERVER_OPS];    // Operations served; unused slots are NULL
+    enum server_mode mode;              // How connections are served
+    int workers;                        // Number of pre-forked worker processes (pool mode)
+    int threads;                        // Number of event loop threads (epoll and uring modes)
+    int backlog;                        // Connections allowed to queue in listen()
+    int cipher_threads;                 // Helper threads for transforming large payloads
+    size_t parallel_min;                // Shortest payload split across them (0 = never)
+    int zerocopy;                       // Send large replies with MSG_ZEROCOPY
+    struct keystore* keys;              // Pads clients can refer to (NULL without -k)
+    int port;                           // Port to listen on
+    const char* unix_path;              // Unix domain socket to listen on as well (NULL = none)
+    int admin_port;                     // Port on 127.0.0.1 serving the metrics (0 = none)
+    const char* trace_path;             // File every reply is traced to (NULL = none)
+    int read_ms;                        // Deadline for each request to arrive in full (0 = none)
+    int write_ms;                       // Deadline for each reply to be written (0 = none)
+    int max_conns;                      // Connections served at once (0 = no limit)
+    size_t max_bytes;                   // Request buffer bytes held at once (0 = no limit)
+    struct cpu_list cpus;               // CPUs the loops or workers run on, in order (-A)
+    struct cpu_list cipher_cpus;        // CPUs the cipher helpers run on, in order (-J)
+};
+
+// The deadlines a connection can be waiting on, one list of each per loop or worker
+enum conn_deadline {
+    DEADLINE_READ,
+    DEADLINE_WRITE,
+    DEADLINE_KINDS
+};
+
+/*
+* What the process holds across all its loops, for admission control:
+* connections being served, connections only waiting to be told the server
+* is busy, and bytes of request buffers past the small one every connection
+* may hold.
+*/
+static int64_t server_conns = 0;
+static int64_t server_busy_conns = 0;
+static int64_t server_bytes = 0;
+
+// The operation served to clients calling themselves name, or NULL
+static inline const struct server_op* serverOpByName(const struct server_config* cfg,
+                                                     const char* name, size_t len)
+{
+    for (int i = 0; i < SERVER_OPS && cfg->ops[i] != NULL; i++)
+    {
+        const char* client = cfg->ops[i]->client_name;
+        if (strlen(client) == len && memcmp(client, name, len) == 0) {
+            return cfg->ops[i];
+        }
+    }
+    return NULL;
+}
+
+// The operation served for a version 2 opcode, or NULL
+static inline const struct server_op* serverOpByCode(const struct server_config* cfg, uint8_t opcode)
+{
+    for (int i = 0; i < SERVER_OPS && cfg->ops[i] != NULL; i++)
+    {
+        if (cfg->ops[i]->opcode == opcode) {
+            return cfg->ops[i];
+        }
+    }
+    return NULL;
+}
+
+// Log a client that did not name itself as one the server talks to
+static inline void serverBadClient(const struct server_config* cfg)
+{
+    char names[128];
+    size_t len = 0;
+    for (int i = 0; i < SERVER_OPS && cfg->ops[i] != NULL; i++)
+    {
+        int n = snprintf(names + len, sizeof(names) - len, "%s\"%s\"", i > 0 ? " or " : "",
+                         cfg->ops[i]->client_name);
+        if (n < 0 || (size_t)n >= sizeof(names) - len) {
+            break;
+        }
+        len += n;
+    }
+    fprintf(stderr, "%s: ERROR verifying client (must be %s)\n", cfg->name, names);
+    metricsAdd(METRIC_HANDSHAKE_FAILURES, 1);
+}
+
+/*
+* Count a connection or request turned away because the server is saturated.
+* Overload is exactly when logging every one of them would hurt most, so
+* each thread logs at most one line a second.
+*/
+static inline void serverBusy(const struct server_config* cfg, const char* what)
+{
+    static __thread uint64_t logged_at = 0;
+    static __thread uint64_t unlogged = 0;
+    metricsAdd(METRIC_BUSY, 1);
+    unlogged++;
+    uint64_t now = deadlineCoarseClock();
+    if (logged_at == 0 || now - logged_at >= 1000000000ull) {
+        fprintf(stderr, "%s: server busy, turned away %llu client%s (out of %s)\n", cfg->name,
+                (unsigned long long)unlogged, unlogged == 1 ? "" : "s", what);
+        logged_at = now;
+        unlogged = 0;
+    }
+}
+
+// Error function used for reporting issues
+static inline void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+// Set up the address struct for the server socket
+static inline void setupAddressStruct(struct sockaddr_in* address,
+                                      int portNumber){
+
+    // Clear out the address struct
+    memset((char*) address, '\0', sizeof(*address));
+
+    // The address should be network capable
+    address->sin_family = AF_INET;
+    // Store the port number
+    address->sin_port = htons(portNumber);
+    // Allow a client at any address to connect to this server
+    address->sin_addr.s_addr = INADDR_ANY;
+}
+
+/*
+* Create a socket listening on cfg->port. With reusePort set, several sockets
+* can bind the same port and the kernel load balances new connections across them.
+*/
+static inline int openListenSocket(const struct server_config* cfg, int reusePort, int nonBlocking)
+{
+    char msg[64];
+    struct sockaddr_in serverAddress;
+
+    // Create the socket that will listen for connections
+    int listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (nonBlocking ? SOCK_NONBLOCK : 0), 0);
+    if (listenSocket < 0) {
+        snprintf(msg, sizeof(msg), "%s: ERROR opening socket", cfg->name);
+        error(msg);
+    }
+
+    // Let a restarted server bind while old connections sit in TIME_WAIT
+    int on = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        snprintf(msg, sizeof(msg), "%s: ERROR setting SO_REUSEPORT", cfg->name);
+        error(msg);
+    }
+
+    // Set up the address struct for the server socket
+    setupAddressStruct(&serverAddress, cfg->port);
+
+    // Associate the socket to the port
+    if (bind(listenSocket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0){
+        snprintf(msg, sizeof(msg), "%s: ERROR on binding", cfg->name);
+        error(msg);
+    }
+
+    // Start listening for connetions, allowing up to cfg->backlog to queue up
+    if (listen(listenSocket, cfg->backlog) < 0){
+        snprintf(msg, sizeof(msg), "%s: ERROR on listen", cfg->name);
+        error(msg);
+    }
+    return listenSocket;
+}
+
+/*
+* Have the kernel hand connections on listenSocket, the index-th of the
+* loops' SO_REUSEPORT sockets, to the loop on the CPU that received them.
+* Only done when every loop is pinned to a CPU of its own (-A); otherwise
+* the kernel keeps spreading connections by their addresses.
+*/
+static inline void steerListenSocket(const struct server_config* cfg, int listenSocket, int index)
+{
+    if (!affinityDistinct(&cfg->cpus, cfg->threads)) {
+        return;
+    }
+    if (affinitySteer(listenSocket, &cfg->cpus, index, cfg->threads) < 0) {
+        fprintf(stderr, "%s: could not steer connections to the loop on CPU %d: %s\n",
+                cfg->name, affinityCpu(&cfg->cpus, index), strerror(errno));
+    }
+}
+
+/*
+* Create the socket listening on cfg->unix_path. Unix domain sockets have no
+* SO_REUSEPORT, so every loop or worker shares this one. A socket left
+* behind by an earlier server is replaced; any other file is not.
+*/
+static inline int openUnixListenSocket(const struct server_config* cfg, int nonBlocking)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(cfg->unix_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: socket path %s is too long\n", cfg->name, cfg->unix_path);
+        exit(1);
+    }
+    strcpy(address.sun_path, cfg->unix_path);
+
+    struct stat st;
+    if (lstat(cfg->unix_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s: %s exists and is not a socket\n", cfg->name, cfg->unix_path);
+            exit(1);
+        }
+        unlink(cfg->unix_path);
+    }
+
+    int listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | (nonBlocking ? SOCK_NONBLOCK : 0), 0);
+    if (listenSocket < 0 ||
+        bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(listenSocket, cfg->backlog) < 0)
+    {
+        fprintf(stderr, "%s: ERROR listening on %s: %s\n", cfg->name, cfg->unix_path, strerror(errno));
+        exit(1);
+    }
+    return listenSocket;
+}
+
+/*
+* Incremental parser for a request, either "<client_name>|<text>|<key>|" or a
+* version 2 header followed by exactly payload_len + key_len bytes, and for
+* the chunks of a version 2 stream.
+* Everything received is appended in place to one buffer, and each call to
+* readerParse() only scans the bytes that arrived since the previous call,
+* so reading a request costs time linear in its size. The text and key are
+* left where they landed in the buffer rather than being copied out.
+*/
+
+enum msg_phase {
+    MSG_HANDSHAKE,      // Waiting for "<client_name>|" or a version 2 header
+    MSG_PLAINTEXT,      // Reading the message up to its '|'
+    MSG_KEY,            // Reading the key up to its '|'
+    MSG_BODY,           // Reading the text and key announced by a version 2 header
+    MSG_CHUNK,          // Reading one chunk of a version 2 stream
+    MSG_DISCARD,        // Reading past the body of a request refused as busy
+    MSG_RESPONSE        // Request complete, writing the transformed message back
+};
+
+struct msg_reader {
+    enum msg_phase phase;
+    char* buf;          // Everything received from the client so far
+    size_t len;         // Bytes used in buf
+    size_t cap;         // Size of buf
+    size_t scanned;     // Bytes of buf already searched for '|'
+    size_t field_start; // Offset in buf where the current field starts
+    size_t text_start;  // Offset of the message in buf
+    size_t text_len;    // Length of the message
+    size_t key_start;   // Offset of the key in buf
+    size_t key_len;     // Length of the key
+    int version;        // Protocol version the client is speaking
+    size_t need;        // Total bytes of a version 2 request or chunk, once its length is in
+    size_t consumed;    // Bytes of buf taken up by the request that was just parsed
+    int stream;         // The client asked for a chunked stream
+    int is_chunk;       // The request that was just parsed is a stream chunk
+    int keyref;         // The key field names a pad in the key store
+    int session;        // The last version 2 header asked to keep the connection open
+    int packed;         // The last version 2 header's text and key are packed (otp_pack.h)
+    int shared;         // The request's text and key are in the connection's shared memory
+    int passed_fd;      // Shared memory the client passed, not yet mapped (-1 = none)
+    const char* reject; // Why a version 2 request was refused, sent back in the reply
+    int busy;           // No room for the request: refuse it with OTP_OP_BUSY, or drop a version 1 client
+    const struct server_op* op; // Operation the client asked for, once known
+    uint64_t arrived;   // When the first byte of the request came in (0 = not yet or not timed)
+};
+
+// Start reading a new connection, keeping whatever buffer the reader already has
+static inline void readerReset(struct msg_reader* r)
+{
+    r->phase = MSG_HANDSHAKE;
+    r->len = 0;
+    r->scanned = 0;
+    r->field_start = 0;
+    r->version = 1;
+    r->need = 0;
+    r->consumed = 0;
+    r->stream = 0;
+    r->is_chunk = 0;
+    r->keyref = 0;
+    r->session = 0;
+    r->packed = 0;
+    r->shared = 0;
+    r->passed_fd = -1;
+    r->reject = NULL;
+    r->busy = 0;
+    r->op = NULL;
+    r->arrived = 0;
+}
+
+/*
+* Bytes of a reader buffer of cap bytes that count against cfg->max_bytes.
+* Every connection may hold one small buffer regardless, so serving small
+* requests never touches the shared count.
+*/
+static inline size_t readerCharged(size_t cap)
+{
+    return cap > READER_INITIAL_BUFFER ? cap - READER_INITIAL_BUFFER : 0;
+}
+
+// Account for the reader's buffer going from oldCap to newCap bytes
+static inline void readerCharge(size_t oldCap, size_t newCap)
+{
+    int64_t delta = (int64_t)readerCharged(newCap) - (int64_t)readerCharged(oldCap);
+    if (delta != 0) {
+        __atomic_add_fetch(&server_bytes, delta, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+* Whether the reader may grow its buffer to newCap bytes without taking the
+* process past cfg->max_bytes. The check is not a reservation, so threads
+* growing at the same moment can overshoot by a request each.
+*/
+static inline int readerAdmit(const struct msg_reader* r, size_t newCap, const struct server_config* cfg)
+{
+    if (cfg->max_bytes == 0 || readerCharged(newCap) <= readerCharged(r->cap)) {
+        return 1;
+    }
+    int64_t held = __atomic_load_n(&server_bytes, __ATOMIC_RELAXED);
+    return (uint64_t)held + readerCharged(newCap) - readerCharged(r->cap) <= cfg->max_bytes;
+}
+
+// Give the reader's buffer back to the pool
+static inline void readerRelease(struct msg_reader* r)
+{
+    readerCharge(r->cap, 0);
+    bufferPut(r->buf, r->cap);
+    r->buf = NULL;
+    r->cap = 0;
+    r->len = 0;
+}
+
+/*
+* Drop the request that was just parsed and start reading the next one in
+* the given phase. Bytes the client already sent past the end of that
+* request are moved to the front of the buffer rather than thrown away.
+* The buffer goes back to the pool when none of the next request is in yet,
+* and a large one is swapped for a small one when only a little is, so a
+* connection between requests only holds what it needs.
+*/
+static inline void readerNext(struct msg_reader* r, enum msg_phase phase)
+{
+    size_t leftover = r->len - r->consumed;
+    if (leftover == 0) {
+        readerRelease(r);
+    } else if (r->cap > READER_INITIAL_BUFFER && leftover <= READER_INITIAL_BUFFER) {
+        char* small = bufferGet(READER_INITIAL_BUFFER);
+        if (small != NULL) {
+            memcpy(small, r->buf + r->consumed, leftover);
+            readerCharge(r->cap, READER_INITIAL_BUFFER);
+            bufferPut(r->buf, r->cap);
+            r->buf = small;
+            r->cap = READER_INITIAL_BUFFER;
+        } else {
+            memmove(r->buf, r->buf + r->consumed, leftover);
+        }
+    } else {
+        memmove(r->buf, r->buf + r->consumed, leftover);
+    }
+    r->len = leftover;
+    r->phase = phase;
+    r->scanned = 0;
+    r->field_start = 0;
+    r->need = 0;
+    r->consumed = 0;
+    r->is_chunk = 0;
+    r->keyref = 0;
+    r->shared = 0;
+    r->reject = NULL;
+    r->busy = 0;
+    // Pipelined bytes mean the next request has already started arriving
+    r->arrived = leftover > 0 && metricsTiming() ? metricsNow() : 0;
+    if (phase == MSG_HANDSHAKE) {
+        r->stream = 0;
+    }
+}
+
+/*
+* Keep the first file descriptor passed with a receive, for the connection
+* to map as its shared memory. Anything else passed is closed.
+*/
+static inline void readerTakeFds(struct msg_reader* r, struct msghdr* msg)
+{
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm))
+    {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(fd));
+            if (r->passed_fd >= 0) {
+                close(r->passed_fd);
+            }
+            r->passed_fd = fd;
+        }
+    }
+}
+
+// Account for n bytes received from the client
+static inline void readerReceived(struct msg_reader* r, size_t n)
+{
+    metricsAdd(METRIC_BYTES_IN, n);
+    if (r->arrived == 0 && metricsTiming()) {
+        r->arrived = metricsNow();
+    }
+}
+
+/*
+* Move the reader into a buffer with room for newCap bytes, from the pool.
+* Returns -1 if out of memory.
+*/
+static inline int readerGrow(struct msg_reader* r, size_t newCap, const struct server_config* cfg)
+{
+    char* newBuf = bufferResize(r->buf, r->cap, r->len, newCap);
+    if (newBuf == NULL) {
+        fprintf(stderr, "%s: out of memory for client buffer\n", cfg->name);
+        return -1;
+    }
+    readerCharge(r->cap, newCap);
+    r->buf = newBuf;
+    r->cap = newCap;
+    return 0;
+}
+
+/*
+* Make sure there is free space at the end of the buffer, growing it
+* geometrically up to READER_MAX. A version 2 request or chunk gets a buffer
+* of the size it announced. Returns -1 if the request is too long.
+*/
+static inline int readerReserve(struct msg_reader* r, const struct server_config* cfg)
+{
+    if ((r->phase == MSG_BODY || r->phase == MSG_CHUNK) && r->cap < r->need) {
+        if (readerGrow(r, r->need, cfg) < 0) {
+            return -1;
+        }
+    }
+    if (r->len < r->cap) {
+        return 0;
+    }
+    if (r->cap >= READER_MAX) {
+        fprintf(stderr, "%s: message from client is too long\n", cfg->name);
+        return -1;
+    }
+    size_t newCap = r->cap ? r->cap * 2 : READER_INITIAL_BUFFER;
+    if (newCap > READER_MAX) {
+        newCap = READER_MAX;
+    }
+    // A version 1 client cannot be told the server is busy, only dropped
+    if ((r->phase == MSG_PLAINTEXT || r->phase == MSG_KEY) && !readerAdmit(r, newCap, cfg)) {
+        serverBusy(cfg, "request buffers");
+        return -1;
+    }
+    return readerGrow(r, newCap, cfg);
+}
+
+/*
+* Refuse the request whose header was just parsed with OTP_OP_BUSY and close
+* the connection once that is sent. A body the header announced (r->need)
+* is read first but thrown away as it arrives, so the refusal holds no
+* buffer and closing does not reset the connection before the client has
+* seen the reply. A stream is refused straight away.
+*/
+static inline int readerRefuseBusy(struct msg_reader* r, const struct server_config* cfg, const char* what)
+{
+    serverBusy(cfg, what);
+    r->busy = 1;
+    r->reject = "server busy, try again later";
+    r->consumed = 0;
+    r->phase = r->stream || r->len >= r->need ? MSG_RESPONSE : MSG_DISCARD;
+    r->stream = 0;
+    return 0;
+}
+
+// Parse a version 2 request header once all of it has arrived
+static inline int readerParseHeader(struct msg_reader* r, const struct server_config* cfg)
+{
+    if (r->len < OTP_HEADER_SIZE) {
+        return 0;
+    }
+    struct otp_header hdr;
+    if (otpDecodeHeader((unsigned char*)r->buf, &hdr) < 0) {
+        fprintf(stderr, "%s: ERROR unsupported protocol version from client\n", cfg->name);
+        metricsAdd(METRIC_HANDSHAKE_FAILURES, 1);
+        return -1;
+    }
+    r->version = OTP_VERSION;
+    r->session = (hdr.flags & OTP_FLAG_SESSION) != 0;
+    r->packed = (hdr.flags & OTP_FLAG_PACKED) != 0;
+    r->op = serverOpByCode(cfg, hdr.opcode);
+
+    // A stream header has no body; its chunks are read one at a time afterwards
+    if (hdr.flags & OTP_FLAG_STREAM)
+    {
+        // A stream holds one chunk at a time, so it is admitted if one fits
+        r->stream = 1;
+        if (r->busy || !readerAdmit(r, OTP_CHUNK_HEADER + 2 * OTP_MAX_CHUNK, cfg)) {
+            return readerRefuseBusy(r, cfg, r->busy ? "connections" : "request buffers");
+        }
+        if (r->op == NULL) {
+            r->reject = "wrong operation for this server";
+        } else if (hdr.flags & OTP_FLAG_KEYREF) {
+            r->reject = "key references cannot be streamed";
+        } else if (hdr.flags & OTP_FLAG_SHARED) {
+            r->reject = "shared memory cannot be streamed";
+        }
+        if (r->reject != NULL) {
+            fprintf(stderr, "%s: ERROR refusing request: %s\n", cfg->name, r->reject);
+        }
+        r->consumed = OTP_HEADER_SIZE;
+        r->phase = MSG_RESPONSE;
+        return 0;
+    }
+
+    // A shared request's body only says where its text and key are; they
+    // are looked up once the connection's shared memory is known
+    r->shared = (hdr.flags & OTP_FLAG_SHARED) != 0;
+    if (r->shared)
+    {
+        r->text_len = hdr.payload_len;
+        r->key_len = hdr.key_len;
+        if (r->op == NULL) {
+            r->reject = "wrong operation for this server";
+        } else if (hdr.flags & (OTP_FLAG_KEYREF | OTP_FLAG_PACKED)) {
+            r->reject = "shared memory does not go with key references or packing";
+        } else if (hdr.key_len < hdr.payload_len) {
+            r->reject = "key is shorter than the message";
+        }
+        if (r->reject != NULL) {
+            fprintf(stderr, "%s: ERROR refusing request: %s\n", cfg->name, r->reject);
+        }
+        r->need = OTP_HEADER_SIZE + OTP_SHARED_REF_SIZE;
+        if (r->busy) {
+            return readerRefuseBusy(r, cfg, "connections");
+        }
+        r->phase = MSG_BODY;
+        return 0;
+    }
+
+    r->keyref = (hdr.flags & OTP_FLAG_KEYREF) != 0;
+    size_t textBytes = r->packed ? otpPackedSize(hdr.payload_len) : hdr.payload_len;
+    size_t keyBytes = r->packed && !r->keyref ? otpPackedSize(hdr.key_len) : hdr.key_len;
+    r->text_start = OTP_HEADER_SIZE;
+    r->text_len = hdr.payload_len;
+    r->key_start = OTP_HEADER_SIZE + textBytes;
+    r->key_len = hdr.key_len;
+
+    // A body that is too long to buffer is refused straight away. Other
+    // refusals are sent once the body has been read, so the client is not
+    // reset while it is still writing and gets to see the reason.
+    if (hdr.payload_len > MAX_MESSAGE || hdr.key_len > MAX_MESSAGE) {
+        r->reject = "message too long, use a stream";
+        fprintf(stderr, "%s: ERROR refusing request: %s\n", cfg->name, r->reject);
+        r->phase = MSG_RESPONSE;
+        return 0;
+    }
+    if (r->op == NULL) {
+        r->reject = "wrong operation for this server";
+    } else if (r->keyref && r->packed) {
+        r->reject = "key references cannot be packed";
+    } else if (r->keyref) {
+        if (hdr.key_len <= OTP_KEY_OFFSET_SIZE || hdr.key_len > OTP_KEY_OFFSET_SIZE + OTP_KEY_ID_MAX) {
+            r->reject = "malformed key reference";
+        }
+    } else if (hdr.key_len < hdr.payload_len) {
+        r->reject = "key is shorter than the message";
+    }
+    if (r->reject != NULL) {
+        fprintf(stderr, "%s: ERROR refusing request: %s\n", cfg->name, r->reject);
+    }
+    r->need = OTP_HEADER_SIZE + textBytes + keyBytes;
+    if (r->busy || (r->reject == NULL && !readerAdmit(r, r->need, cfg))) {
+        return readerRefuseBusy(r, cfg, r->busy ? "connections" : "request buffers");
+    }
+    r->phase = MSG_BODY;
+    return 0;
+}
+
+// Parse the length of a stream chunk once it has arrived
+static inline int readerParseChunk(struct msg_reader* r, const struct server_config* cfg)
+{
+    if (r->need == 0)
+    {
+        if (r->len < OTP_CHUNK_HEADER) {
+            return 0;
+        }
+        uint32_t chunkLen = otpDecodeChunk((unsigned char*)r->buf);
+        if (chunkLen > OTP_MAX_CHUNK) {
+            fprintf(stderr, "%s: ERROR stream chunk of %u bytes is too long\n", cfg->name, chunkLen);
+            return -1;
+        }
+        size_t chunkBytes = r->packed ? otpPackedSize(chunkLen) : chunkLen;
+        r->text_start = OTP_CHUNK_HEADER;
+        r->text_len = chunkLen;
+        r->key_start = OTP_CHUNK_HEADER + chunkBytes;
+        r->key_len = chunkLen;
+        r->need = OTP_CHUNK_HEADER + 2 * chunkBytes;
+    }
+    if (r->len >= r->need) {
+        r->consumed = r->need;
+        r->is_chunk = 1;
+        r->phase = MSG_RESPONSE;
+    }
+    return 0;
+}
+
+/*
+* Advance the parser over the bytes that arrived since the last call.
+* Once the key's '|' is seen both fields are NUL terminated in place and
+* the phase becomes MSG_RESPONSE. Returns -1 if the client has to be dropped.
+*/
+static inline int readerParse(struct msg_reader* r, const struct server_config* cfg)
+{
+    size_t nameLen = 0;
+    for (int i = 0; i < SERVER_OPS && cfg->ops[i] != NULL; i++)
+    {
+        size_t len = strlen(cfg->ops[i]->client_name);
+        nameLen = len > nameLen ? len : nameLen;
+    }
+
+    if (r->len == 0) {
+        return 0;
+    }
+    // A version 2 client starts with the magic instead of its name
+    if (r->phase == MSG_HANDSHAKE && otpIsMagicPrefix(r->buf, r->len))
+    {
+        if (readerParseHeader(r, cfg) < 0) {
+            return -1;
+        }
+        if (r->phase == MSG_HANDSHAKE) {
+            return 0;
+        }
+    }
+    if (r->phase == MSG_CHUNK) {
+        return readerParseChunk(r, cfg);
+    }
+    if (r->phase == MSG_DISCARD)
+    {
+        if (r->len >= r->need) {
+            r->phase = MSG_RESPONSE;
+        } else {
+            r->need -= r->len;
+            r->len = 0;
+        }
+        return 0;
+    }
+    if (r->phase == MSG_BODY)
+    {
+        // The body may have arrived in the same read as the header
+        if (r->len >= r->need) {
+            r->consumed = r->need;
+            r->phase = MSG_RESPONSE;
+        }
+        return 0;
+    }
+
+    while (r->phase != MSG_RESPONSE)
+    {
+        char* bar = memchr(r->buf + r->scanned, '|', r->len - r->scanned);
+        if (bar == NULL) {
+            r->scanned = r->len;
+            // The handshake is short, so anything longer without a '|' is not our client
+            if (r->phase == MSG_HANDSHAKE && r->len > nameLen) {
+                serverBadClient(cfg);
+                return -1;
+            }
+            return 0;
+        }
+        size_t end = bar - r->buf;
+        r->scanned = end + 1;
+
+        switch (r->phase)
+        {
+        case MSG_HANDSHAKE:
+            // Only proceed if an expected client is trying to connect; its
+            // name decides the operation
+            r->op = serverOpByName(cfg, r->buf, end);
+            if (r->op == NULL)
+            {
+                serverBadClient(cfg);
+                return -1;
+            }
+            if (r->busy) {
+                serverBusy(cfg, "connections");
+                return -1;
+            }
+            r->phase = MSG_PLAINTEXT;
+            break;
+        case MSG_PLAINTEXT:
+            r->text_start = r->field_start;
+            r->text_len = end - r->field_start;
+            r->buf[end] = '\0';
+            r->phase = MSG_KEY;
+            break;
+        case MSG_KEY:
+            r->key_start = r->field_start;
+            r->key_len = end - r->field_start;
+            // The transform reads a key character for every text character,
+            // and version 1 has no way to refuse, so the client is dropped
+            if (r->key_len < r->text_len) {
+                fprintf(stderr, "%s: ERROR dropping client: key is shorter than the message\n", cfg->name);
+                metricsAdd(METRIC_REQUESTS_REJECTED, 1);
+                return -1;
+            }
+            r->buf[end] = '\0';
+            r->consumed = end + 1;
+            r->phase = MSG_RESPONSE;
+            break;
+        case MSG_BODY:
+        case MSG_CHUNK:
+        case MSG_DISCARD:
+        case MSG_RESPONSE:
+            break;
+        }
+        r->field_start = end + 1;
+    }
+    return 0;
+}
+
+/*
+* Feed the reader until the request is complete, the socket has nothing more
+* for now (non-blocking sockets) or the client is dropped. Bytes left over
+* from the previous request are parsed before the socket is read.
+* Returns 1 when the request is complete, 0 on EAGAIN, 2 if the client closed
+* a session between requests and -1 on error.
+*/
+static inline int readerRecv(struct msg_reader* r, int fd, const struct server_config* cfg)
+{
+    if (readerParse(r, cfg) < 0) {
+        return -1;
+    }
+    while (r->phase != MSG_RESPONSE)
+    {
+        if (readerReserve(r, cfg) < 0) {
+            return -1;
+        }
+        // Once a version 2 header says how long the request is, read exactly that much
+        size_t want = r->cap - r->len;
+        if (r->phase == MSG_BODY) {
+            want = r->need - r->len;
+        }
+        // recvmsg() rather than recv() so shared memory passed over a Unix
+        // domain socket is picked up instead of being dropped
+        union {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = { r->buf + r->len, want };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t charsRead = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (charsRead > 0 && msg.msg_controllen > 0) {
+            readerTakeFds(r, &msg);
+        }
+        if (charsRead < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: ERROR reading from socket: %s\n", cfg->name, strerror(errno));
+            return -1;
+        }
+        // A closed socket will never deliver the rest of the message
+        if (charsRead == 0) {
+            if (r->session && r->phase == MSG_HANDSHAKE && r->len == 0) {
+                return 2;
+            }
+            fprintf(stderr, "%s: client socket closed\n", cfg->name);
+            return -1;
+        }
+        r->len += charsRead;
+        readerReceived(r, charsRead);
+        if (readerParse(r, cfg) < 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/*
+* Append n bytes that arrived for the reader, for io_uring mode where the
+* kernel receives into buffers of its own rather than straight into the
+* reader's. The bytes may run past the end of the current request into the
+* next one, which readerNext() keeps. Returns -1 if out of memory.
+*/
+static inline int readerAppend(struct msg_reader* r, const char* data, size_t n,
+                               const struct server_config* cfg)
+{
+    if (r->cap - r->len < n)
+    {
+        size_t newCap = r->cap ? r->cap : READER_INITIAL_BUFFER;
+        while (newCap - r->len < n) {
+            newCap *= 2;
+        }
+        // As in readerReserve(), only a version 1 request grows unannounced
+        if ((r->phase == MSG_PLAINTEXT || r->phase == MSG_KEY) && !readerAdmit(r, newCap, cfg)) {
+            serverBusy(cfg, "request buffers");
+            return -1;
+        }
+        if (readerGrow(r, newCap, cfg) < 0) {
+            return -1;
+        }
+    }
+    memcpy(r->buf + r->len, data, n);
+    r->len += n;
+    readerReceived(r, n);
+    return 0;
+}
+
+/*
+* A client connection, served by the same code in all modes: its msg_reader
+* moves through the handshake, plaintext and key phases (or the version 2
+* header, body and chunks) as bytes arrive, then the response phase writes
+* the reply. A pool worker drives a conn over a blocking socket, an event
+* loop over a non-blocking one and an io_uring loop through submissions.
+*/
+struct conn {
+    int fd;
+    struct msg_reader reader;   // Request parser; reader.phase is the connection state
+    unsigned char header[OTP_HEADER_SIZE];  // Version 2 reply header or stream chunk length
+    size_t header_len;          // Bytes of header to send (0 for version 1)
+    const char* out;            // Transformed message in the reader's buffer, or the refusal
+    size_t out_len;             // Length of out
+    size_t out_sent;            // Bytes of header and out already written to the socket
+    int replying;               // A reply has been built and is being written
+    int done;                   // Close the connection once the reply is written
+    enum msg_phase next;        // What to read once the reply is written
+    uint32_t events;            // Events the event loop is waiting for
+    int blocking;               // The socket blocks (pool mode)
+    int zerocopy;               // Large replies go out with MSG_ZEROCOPY
+    uint32_t zc_sent;           // MSG_ZEROCOPY sends issued
+    uint32_t zc_done;           // MSG_ZEROCOPY sends the kernel is finished with
+    int unix_socket;            // Accepted on the Unix domain socket
+    char* shared;               // Memory the client shares with the server, or NULL
+    size_t shared_len;          // Size of that memory
+    struct deadline deadline;   // Of the request being read or the reply being written
+    struct deadline_list* deadlines;    // The DEADLINE_KINDS lists of the loop serving it, or NULL
+    int64_t* slot;              // Admission count the connection holds a place in, or NULL
+
+    // io_uring mode only
+    struct msghdr msg;          // The reply being sent
+    struct iovec iov[2];
+    int recv_armed;             // A receive is queued
+    int sending;                // A send is queued
+    int eof;                    // The client has shut down its side
+    int closing;                // Close once the queued operations complete
+    int held_bid;               // Buffer received while a send was queued, or -1
+    size_t held_len;            // Bytes in that buffer
+    int starved;                // Its receive found no free buffer and waits for one
+    uint64_t starved_mark;      // Buffers returned before that receive could have failed
+    struct conn* starved_next;  // Next connection waiting for a buffer
+    struct msghdr recv_msg;     // Receive on a Unix domain socket, which may pass shared memory
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } recv_control;
+
+    // Timing of the reply being written, with metrics or tracing on
+    uint64_t ready_at;          // When the request was complete
+    uint64_t cipher_ns;         // Time spent transforming it
+};
+
+// Start serving a new client on fd
+static inline void connReset(struct conn* c, int fd)
+{
+    c->fd = fd;
+    readerReset(&c->reader);
+    c->out = NULL;
+    c->out_len = 0;
+    c->out_sent = 0;
+    c->header_len = 0;
+    c->replying = 0;
+    c->done = 0;
+    c->blocking = 0;
+    c->zerocopy = 0;
+    c->zc_sent = 0;
+    c->zc_done = 0;
+    c->unix_socket = 0;
+    c->shared = NULL;
+    c->shared_len = 0;
+    memset(&c->deadline, 0, sizeof(c->deadline));
+    c->deadlines = NULL;
+    c->slot = NULL;
+    metricsAdd(METRIC_CONNECTIONS_OPENED, 1);
+
+    // Every reply leaves in a single sendmsg(), so Nagle's algorithm only
+    // holds back the small ones (a stream's last chunk, short session
+    // replies) until the client's delayed ACK
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/*
+* Start the deadline of the phase the connection just entered: reading a
+* request, or writing the reply to one.
+*/
+static inline void connArmDeadline(struct conn* c)
+{
+    if (c->deadlines != NULL) {
+        deadlineArm(&c->deadlines[c->replying ? DEADLINE_WRITE : DEADLINE_READ], &c->deadline);
+    }
+}
+
+static inline struct conn* connOfDeadline(struct deadline* d)
+{
+    return (struct conn*)((char*)d - offsetof(struct conn, deadline));
+}
+
+// Log a connection whose deadline ran out, before it is dropped
+static inline void connTimedOut(const struct conn* c, const struct server_config* cfg)
+{
+    fprintf(stderr, "%s: client timed out %s\n", cfg->name,
+            c->replying ? "reading the reply" : "sending a request");
+    metricsAdd(METRIC_TIMEOUTS, 1);
+}
+
+/*
+* Admit a connection an event loop just accepted. Past cfg->max_conns it
+* is only served the OTP_OP_BUSY reply to its first request, and past
+* BUSY_MAX_CONNS of those as well it is not served at all: returns -1 and
+* the caller closes it.
+*/
+static inline int connAdmit(struct conn* c, const struct server_config* cfg)
+{
+    if (cfg->max_conns == 0) {
+        return 0;
+    }
+    if (__atomic_add_fetch(&server_conns, 1, __ATOMIC_RELAXED) <= cfg->max_conns) {
+        c->slot = &server_conns;
+        return 0;
+    }
+    __atomic_sub_fetch(&server_conns, 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&server_busy_conns, 1, __ATOMIC_RELAXED) <= BUSY_MAX_CONNS) {
+        c->slot = &server_busy_conns;
+        c->reader.busy = 1;
+        return 0;
+    }
+    __atomic_sub_fetch(&server_busy_conns, 1, __ATOMIC_RELAXED);
+    serverBusy(cfg, "connections");
+    return -1;
+}
+
+// Give up the connection's place in the admission counts and its deadline
+static inline void connRelease(struct conn* c)
+{
+    deadlineCancel(&c->deadline);
+    if (c->slot != NULL) {
+        __atomic_sub_fetch(c->slot, 1, __ATOMIC_RELAXED);
+        c->slot = NULL;
+    }
+}
+
+// Let large replies on the connection go out with MSG_ZEROCOPY if the server wants that
+static inline void connEnableZerocopy(struct conn* c, const struct server_config* cfg)
+{
+    int on = 1;
+    if (cfg->zerocopy && setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+        c->zerocopy = 1;
+    }
+}
+
+// Fill in the header that precedes a version 2 reply of payloadLen bytes
+static inline void connReplyHeader(struct conn* c, uint8_t opcode, uint16_t flags,
+                                   size_t payloadLen, uint64_t keyLen)
+{
+    struct otp_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version = OTP_VERSION;
+    hdr.opcode = opcode;
+    hdr.flags = flags;
+    hdr.payload_len = payloadLen;
+    hdr.key_len = keyLen;
+    otpEncodeHeader(c->header, &hdr);
+    c->header_len = OTP_HEADER_SIZE;
+}
+
+/*
+* Point *key at the pad region a key reference names. Encryption reserves
+* the region in the key store, so it can never be used again; decryption
+* only checks that it exists. Returns NULL or the reason for refusing.
+*/
+static inline const char* connResolveKey(struct msg_reader* r, const struct server_config* cfg,
+                                         const char** key, uint64_t* offset)
+{
+    const char* id;
+    size_t idLen;
+    uint64_t requested;
+    if (otpDecodeKeyRef((unsigned char*)r->buf + r->key_start, r->key_len, &requested, &id, &idLen) < 0) {
+        return "malformed key reference";
+    }
+    if (cfg->keys == NULL) {
+        return "this server has no key store";
+    }
+    struct keystore_pad* pad = keystoreFind(cfg->keys, id, idLen);
+    if (pad == NULL) {
+        return "no such key";
+    }
+
+    const char* refusal;
+    if (r->op->opcode == OTP_OP_ENCRYPT) {
+        refusal = keystoreReserve(pad, requested, r->text_len, offset);
+    } else {
+        refusal = keystoreCheck(pad, requested, r->text_len);
+        *offset = requested;
+    }
+    if (refusal == NULL) {
+        *key = pad->data + *offset;
+    }
+    return refusal;
+}
+
+// Unmap the connection's shared memory and close anything passed but not yet mapped
+static inline void connDetachShared(struct conn* c)
+{
+    if (c->shared != NULL) {
+        munmap(c->shared, c->shared_len);
+        c->shared = NULL;
+        c->shared_len = 0;
+    }
+    if (c->reader.passed_fd >= 0) {
+        close(c->reader.passed_fd);
+        c->reader.passed_fd = -1;
+    }
+}
+
+/*
+* Map the memory the client just passed as the connection's shared memory,
+* in place of any it passed before. Only a memfd sealed against shrinking
+* is taken, since a client that truncated the memory under the server
+* would crash it with SIGBUS.
+*/
+static inline void connAttachShared(struct conn* c, const struct server_config* cfg)
+{
+    int fd = c->reader.passed_fd;
+    c->reader.passed_fd = -1;
+
+    const char* problem = NULL;
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        problem = "is not a memfd sealed against shrinking";
+    } else if (fstat(fd, &st) < 0 || st.st_size <= 0 || (uint64_t)st.st_size > OTP_SHARED_MAX) {
+        problem = "is empty or too large";
+    } else {
+        void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            problem = "cannot be mapped";
+        } else {
+            connDetachShared(c);
+            c->shared = map;
+            c->shared_len = st.st_size;
+        }
+    }
+    close(fd);
+    if (problem != NULL) {
+        fprintf(stderr, "%s: ERROR shared memory from client %s\n", cfg->name, problem);
+    }
+}
+
+/*
+* Point *text and *key at a shared request's text and key in the
+* connection's shared memory. Returns NULL or the reason for refusing.
+*/
+static inline const char* connResolveShared(struct conn* c, char** text, const char** key)
+{
+    struct msg_reader* r = &c->reader;
+    uint64_t textOffset, keyOffset;
+    if (c->shared == NULL) {
+        return "no shared memory attached";
+    }
+    otpDecodeShared((unsigned char*)r->buf + OTP_HEADER_SIZE, &textOffset, &keyOffset);
+    if (textOffset > c->shared_len || r->text_len > c->shared_len - textOffset ||
+        keyOffset > c->shared_len || r->key_len > c->shared_len - keyOffset)
+    {
+        return "text or key lies outside the shared memory";
+    }
+    *text = c->shared + textOffset;
+    *key = c->shared + keyOffset;
+    return NULL;
+}
+
+/*
+* Build the reply to the request the reader just completed: a refusal, the
+* header that opens a stream, one transformed chunk of a stream, or the whole
+* transformed message. Version 1 clients only ever get the bare text.
+*/
+static inline void connPrepareReply(struct conn* c, const struct server_config* cfg)
+{
+    struct msg_reader* r = &c->reader;
+
+    c->out = NULL;
+    c->replying = 1;
+    c->out_sent = 0;
+    c->header_len = 0;
+    c->out_len = 0;
+    c->next = MSG_HANDSHAKE;
+    c->cipher_ns = 0;
+    c->ready_at = metricsTiming() ? metricsNow() : 0;
+    connArmDeadline(c);
+    if (!r->is_chunk) {
+        metricsAdd(METRIC_REQUESTS, 1);
+    }
+
+    if (r->passed_fd >= 0) {
+        connAttachShared(c, cfg);
+    }
+    char* text = r->buf + r->text_start;
+    const char* key = r->buf + r->key_start;
+    uint64_t keyOffset = 0;
+    if (r->reject == NULL && (r->keyref || r->shared)) {
+        r->reject = r->keyref ? connResolveKey(r, cfg, &key, &keyOffset) : connResolveShared(c, &text, &key);
+        if (r->reject != NULL) {
+            fprintf(stderr, "%s: ERROR refusing request: %s\n", cfg->name, r->reject);
+        }
+    }
+    if (r->reject != NULL) {
+        if (!r->busy) {
+            metricsAdd(METRIC_REQUESTS_REJECTED, 1);
+        }
+        c->out = (char*)r->reject;
+        c->out_len = strlen(r->reject);
+        connReplyHeader(c, r->busy ? OTP_OP_BUSY : OTP_OP_ERROR, 0, c->out_len, 0);
+        // A session survives a refusal only if the refused body was read in full
+        c->done = !r->session || r->stream || r->consumed == 0;
+        return;
+    }
+    uint16_t packed = r->packed ? OTP_FLAG_PACKED : 0;
+    uint16_t shared = r->shared ? OTP_FLAG_SHARED : 0;
+    if (r->stream && !r->is_chunk) {
+        connReplyHeader(c, OTP_OP_RESULT, OTP_FLAG_STREAM | packed, 0, 0);
+        c->next = MSG_CHUNK;
+        return;
+    }
+
+    if (r->text_len > 0) {
+        // The text is overwritten with the result, so serving a request
+        // allocates nothing beyond the reader's buffer
+        uint64_t started = c->ready_at != 0 ? metricsNow() : 0;
+        if (r->packed) {
+            // Packed payloads are at most a chunk or MAX_MESSAGE symbols, so they stay on this thread
+            r->op->packed_transform(text, text, key, r->text_len);
+            c->out_len = otpPackedSize(r->text_len);
+        } else {
+            otpParallelTransform(r->op->transform, text, text, key, r->text_len);
+            // A shared request's result is left where its text was
+            c->out_len = r->shared ? 0 : r->text_len;
+        }
+        if (started != 0) {
+            c->cipher_ns = metricsNow() - started;
+        }
+        c->out = text;
+    }
+    if (r->is_chunk) {
+        // A chunk of length 0 ends the stream and is echoed back the same way
+        otpEncodeChunk(c->header, r->text_len);
+        c->header_len = OTP_CHUNK_HEADER;
+        if (r->text_len > 0) {
+            c->next = MSG_CHUNK;
+        } else {
+            c->done = !r->session;
+        }
+    } else {
+        if (r->version == OTP_VERSION) {
+            connReplyHeader(c, OTP_OP_RESULT, (r->keyref ? OTP_FLAG_KEYREF : 0) | packed | shared,
+                            r->text_len, keyOffset);
+        }
+        c->done = r->version != OTP_VERSION || !r->session;
+    }
+}
+
+/*
+* With MSG_ZEROCOPY the kernel keeps reading the reply out of the reader's
+* buffer after sendmsg() returns, so the buffer may only be reused once every
+* such send has completed. Completions arrive on the socket's error queue.
+* Returns 1 once they are all in, 0 if a non-blocking socket has to wait for
+* them and -1 on error.
+*/
+static inline int connZerocopyWait(struct conn* c, const struct server_config* cfg)
+{
+    while (c->zc_done != c->zc_sent)
+    {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "%s: ERROR reading socket error queue: %s\n", cfg->name, strerror(errno));
+                return -1;
+            }
+            if (!c->blocking) {
+                return 0;
+            }
+            // A non-empty error queue shows up as POLLERR
+            struct pollfd pfd;
+            pfd.fd = c->fd;
+            pfd.events = 0;
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            struct sock_extended_err* ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // Sends ee_info through ee_data have completed
+            if ((int32_t)(ee->ee_data + 1 - c->zc_done) > 0) {
+                c->zc_done = ee->ee_data + 1;
+            }
+            // The kernel had to copy after all (loopback always does), so
+            // zero-copy only adds the completion round trip on this socket
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                c->zerocopy = 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+* Write as much of the reply as the socket takes, header and text gathered in
+* one sendmsg() and resumed after short writes. Returns 1 once it is all sent
+* and the kernel no longer needs the buffer.
+*/
+static inline int connWrite(struct conn* c, const struct server_config* cfg)
+{
+    size_t total = c->header_len + c->out_len;
+    while (c->out_sent < total)
+    {
+        // Send whatever is left of the header and the text in one call
+        struct iovec iov[2];
+        int iovcnt = 0;
+        if (c->out_sent < c->header_len) {
+            iov[iovcnt].iov_base = c->header + c->out_sent;
+            iov[iovcnt].iov_len = c->header_len - c->out_sent;
+            iovcnt++;
+        }
+        size_t outOffset = c->out_sent > c->header_len ? c->out_sent - c->header_len : 0;
+        if (outOffset < c->out_len) {
+            iov[iovcnt].iov_base = (char*)c->out + outOffset;
+            iov[iovcnt].iov_len = c->out_len - outOffset;
+            iovcnt++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        int flags = MSG_NOSIGNAL;
+        if (c->zerocopy && c->out_len >= ZEROCOPY_MIN) {
+            flags |= MSG_ZEROCOPY;
+        }
+        ssize_t charsWritten = sendmsg(c->fd, &msg, flags);
+        if (charsWritten < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            // Out of memory for pinning pages: send this reply the usual way
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                c->zerocopy = 0;
+                continue;
+            }
+            fprintf(stderr, "%s: ERROR writing to socket: %s\n", cfg->name, strerror(errno));
+            return -1;
+        }
+        if (flags & MSG_ZEROCOPY) {
+            c->zc_sent++;
+        }
+        c->out_sent += charsWritten;
+        metricsAdd(METRIC_BYTES_OUT, charsWritten);
+    }
+    return connZerocopyWait(c, cfg);
+}
+
+/*
+* Record the phase timings of a reply that has been written in full, in the
+* histograms and the trace log. Sending counts from the end of the cipher
+* phase, so it includes any wait for the client to make room.
+*/
+static inline void connReplySent(const struct conn* c)
+{
+    if (c->ready_at == 0) {
+        return;
+    }
+    const struct msg_reader* r = &c->reader;
+    uint64_t phase_ns[PHASE_COUNT];
+    phase_ns[PHASE_REASSEMBLY] = r->arrived != 0 && r->arrived < c->ready_at ? c->ready_at - r->arrived : 0;
+    phase_ns[PHASE_CIPHER] = c->cipher_ns;
+    phase_ns[PHASE_SEND] = metricsNow() - c->ready_at - c->cipher_ns;
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        metricsTime(p, phase_ns[p]);
+    }
+
+    if (otp_trace_fd >= 0) {
+        struct trace_record t;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        t.time_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+        memcpy(t.phase_ns, phase_ns, sizeof(phase_ns));
+        t.fd = c->fd;
+        t.version = (uint8_t)r->version;
+        t.kind = r->is_chunk ? TRACE_CHUNK : r->stream ? TRACE_STREAM : TRACE_MESSAGE;
+        t.rejected = r->reject != NULL;
+        t.bytes = t.rejected || t.kind == TRACE_STREAM ? 0 : r->text_len;
+        traceRecord(&t);
+    }
+}
+
+/*
+* Move the connection along as far as the socket allows: read a request,
+* write its reply and, for a stream or a session, carry on with the next
+* chunk or request. Pipelined requests are answered strictly in order.
+* Returns 1 once the client has been served, 0 if the (non-blocking) socket
+* would block and -1 if the client has to be dropped.
+*/
+static inline int connProgress(struct conn* c, const struct server_config* cfg)
+{
+    while (1)
+    {
+        if (!c->replying)
+        {
+            int rc = readerRecv(&c->reader, c->fd, cfg);
+            if (rc == 2) {
+                return 1;
+            }
+            if (rc <= 0) {
+                return rc;
+            }
+            connPrepareReply(c, cfg);
+        }
+        int rc = connWrite(c, cfg);
+        if (rc <= 0) {
+            return rc;
+        }
+        connReplySent(c);
+        if (c->done) {
+            return 1;
+        }
+        c->replying = 0;
+        readerNext(&c->reader, c->next);
+        connArmDeadline(c);
+    }
+}
+
+/*
+* Serve a single client on connectionSocket: verify the handshake, read the
+* message and key, and send back the transformed message, repeating for as
+* long as a version 2 session stays open.
+* Without deadlines the socket blocks. With them (deadlines is not NULL) it
+* does not, and between attempts the worker waits in poll() for no longer
+* than the phase the connection is in has left.
+* Returns 0 on success and -1 if the client was rejected, timed out or the socket failed.
+*/
+static inline int handleConnection(int connectionSocket, const struct server_config* cfg,
+                                   struct conn* c, struct deadline_list* deadlines)
+{
+    connReset(c, connectionSocket);
+    c->blocking = deadlines == NULL;
+    connEnableZerocopy(c, cfg);
+    c->deadlines = deadlines;
+    connArmDeadline(c);
+
+    int rc;
+    while ((rc = connProgress(c, cfg)) == 0)
+    {
+        // Room in the socket buffer while a reply is pending, nothing but
+        // POLLERR while zero-copy completions are outstanding, otherwise
+        // the next bytes of the request
+        struct pollfd pfd;
+        pfd.fd = c->fd;
+        pfd.events = POLLIN;
+        if (c->replying) {
+            pfd.events = c->out_sent < c->header_len + c->out_len ? POLLOUT : 0;
+        }
+        int timeout = deadlines != NULL ? deadlineTimeout(deadlines, DEADLINE_KINDS) : -1;
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "%s: ERROR in poll: %s\n", cfg->name, strerror(errno));
+            break;
+        }
+        if (ready == 0 && deadlineExpired(deadlines, DEADLINE_KINDS, deadlineClock()) != NULL) {
+            connTimedOut(c, cfg);
+            break;
+        }
+    }
+    connRelease(c);
+    return rc == 1 ? 0 : -1;
+}
+
+/*
+* Body of a worker process: accept connections from the shared listening
+* sockets one at a time and serve each of them until the worker is killed.
+* With a Unix domain socket as well (unixSocket >= 0), both listening
+* sockets are non-blocking and the worker waits on them with poll().
+*/
+static inline void workerLoop(int listenSocket, int unixSocket, const struct server_config* cfg)
+{
+    // Buffers come from the worker's pool, so they are reused from one connection to the next
+    struct conn c;
+    memset(&c, 0, sizeof(c));
+    struct deadline_list deadlines[DEADLINE_KINDS];
+    deadlineInit(&deadlines[DEADLINE_READ], (uint64_t)cfg->read_ms * 1000000);
+    deadlineInit(&deadlines[DEADLINE_WRITE], (uint64_t)cfg->write_ms * 1000000);
+    int timed = cfg->read_ms > 0 || cfg->write_ms > 0;
+
+    while (1)
+    {
+        int fromSocket = listenSocket;
+        if (unixSocket >= 0) {
+            struct pollfd pfd[2];
+            pfd[0].fd = listenSocket;
+            pfd[0].events = POLLIN;
+            pfd[1].fd = unixSocket;
+            pfd[1].events = POLLIN;
+            if (poll(pfd, 2, -1) <= 0) {
+                continue;
+            }
+            fromSocket = (pfd[1].revents & POLLIN) ? unixSocket : listenSocket;
+        }
+
+        // The kernel hands each pending connection to exactly one worker;
+        // the others woken by poll() find nothing left to accept
+        int connectionSocket = accept4(fromSocket, NULL, NULL, SOCK_CLOEXEC | (timed ? SOCK_NONBLOCK : 0));
+        if (connectionSocket < 0) {
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "%s: ERROR on accept: %s\n", cfg->name, strerror(errno));
+            }
+            continue;
+        }
+        handleConnection(connectionSocket, cfg, &c, timed ? deadlines : NULL);
+        close(connectionSocket);
+        connDetachShared(&c);
+        readerRelease(&c.reader);
+        metricsAdd(METRIC_CONNECTIONS_CLOSED, 1);
+    }
+}
+
+// Flags set by the supervisor's signal handlers
+static volatile sig_atomic_t pool_child_exited = 0;
+static volatile sig_atomic_t pool_retry_spawn = 0;
+static volatile sig_atomic_t pool_shutdown = 0;
+
+static void poolOnSigchld(int sig) { (void)sig; pool_child_exited = 1; }
+static void poolOnSigalrm(int sig) { (void)sig; pool_retry_spawn = 1; }
+static void poolOnShutdown(int sig) { (void)sig; pool_shutdown = 1; }
+
+// Fork the worker for slot index. Returns its pid in the parent or -1 if fork() failed.
+static inline pid_t spawnWorker(int listenSocket, int unixSocket, const struct server_config* cfg,
+                                int index, const sigset_t* origMask)
+{
+    pid_t spawn_pid = fork();
+    if (spawn_pid == 0)
+    {
+        /* Child */
+        // Workers die on SIGTERM/SIGINT and do not supervise anyone themselves
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGALRM, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        sigprocmask(SIG_SETMASK, origMask, NULL);
+        affinityPin(affinityCpu(&cfg->cpus, index), cfg->name);
+        workerLoop(listenSocket, unixSocket, cfg);
+        exit(0);
+    }
+    if (spawn_pid == -1) {
+        fprintf(stderr, "%s: fork() failed for worker: %s\n", cfg->name, strerror(errno));
+    }
+    return spawn_pid;
+}
+
+/*
+* Pre-fork cfg->workers worker processes that share listenSocket (and
+* unixSocket, if it is not -1) and keep the pool at full strength: every
+* worker that exits is reaped on SIGCHLD and replaced. Returns after
+* SIGTERM/SIGINT once all workers have been stopped.
+*/
+static inline void runWorkerPool(int listenSocket, int unixSocket, const struct server_config* cfg)
+{
+    pid_t* workers = calloc(cfg->workers, sizeof(pid_t));
+    time_t* started = calloc(cfg->workers, sizeof(time_t));
+    if (workers == NULL || started == NULL) {
+        fprintf(stderr, "%s: could not allocate worker table\n", cfg->name);
+        exit(1);
+    }
+
+    // Block the supervisor's signals so they are only delivered inside sigsuspend()
+    sigset_t blockMask, origMask;
+    sigemptyset(&blockMask);
+    sigaddset(&blockMask, SIGCHLD);
+    sigaddset(&blockMask, SIGALRM);
+    sigaddset(&blockMask, SIGTERM);
+    sigaddset(&blockMask, SIGINT);
+    sigprocmask(SIG_BLOCK, &blockMask, &origMask);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = poolOnSigchld;
+    sigaction(SIGCHLD, &sa, NULL);
+    sa.sa_handler = poolOnSigalrm;
+    sigaction(SIGALRM, &sa, NULL);
+    sa.sa_handler = poolOnShutdown;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    pool_retry_spawn = 1;
+    while (!pool_shutdown)
+    {
+        // Reap every worker that has exited and free its slot
+        if (pool_child_exited)
+        {
+            pool_child_exited = 0;
+            int child_status;
+            pid_t terminated_child;
+            while ((terminated_child = waitpid(-1, &child_status, WNOHANG)) > 0)
+            {
+                for (int i = 0; i < cfg->workers; i++)
+                {
+                    if (workers[i] != terminated_child) {
+                        continue;
+                    }
+                    if (WIFSIGNALED(child_status)) {
+                        fprintf(stderr, "%s: worker %d killed by signal %d\n",
+                                cfg->name, (int)terminated_child, WTERMSIG(child_status));
+                    } else {
+                        fprintf(stderr, "%s: worker %d exited with status %d\n",
+                                cfg->name, (int)terminated_child, WEXITSTATUS(child_status));
+                    }
+                    workers[i] = 0;
+                    pool_retry_spawn = 1;
+                    metricsAdd(METRIC_WORKER_EXITS, 1);
+                }
+            }
+        }
+
+        // Refill empty slots. A worker that died within a second of starting is
+        // not replaced straight away so a crashing worker cannot fork-bomb the host.
+        if (pool_retry_spawn)
+        {
+            pool_retry_spawn = 0;
+            time_t now = time(NULL);
+            for (int i = 0; i < cfg->workers; i++)
+            {
+                if (workers[i] != 0) {
+                    continue;
+                }
+                if (started[i] != 0 && now - started[i] < 1) {
+                    alarm(1);
+                    continue;
+                }
+                pid_t spawn_pid = spawnWorker(listenSocket, unixSocket, cfg, i, &origMask);
+                if (spawn_pid == -1) {
+                    alarm(1);
+                    continue;
+                }
+                workers[i] = spawn_pid;
+                started[i] = now;
+            }
+        }
+
+        if (!pool_shutdown && !pool_child_exited && !pool_retry_spawn) {
+            sigsuspend(&origMask);
+        }
+    }
+
+    // Stop the pool and wait for every worker before returning
+    for (int i = 0; i < cfg->workers; i++)
+    {
+        if (workers[i] != 0) {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    for (int i = 0; i < cfg->workers; i++)
+    {
+        if (workers[i] != 0) {
+            waitpid(workers[i], NULL, 0);
+        }
+    }
+    free(workers);
+    free(started);
+    sigprocmask(SIG_SETMASK, &origMask, NULL);
+}
+
+/*
+* Event-driven mode. Every connection is a conn driven by readiness events
+* on a non-blocking socket, waiting for EPOLLIN while it reads a request and
+* for EPOLLOUT while a reply does not fit in the socket buffer.
+*/
+
+struct event_loop {
+    const struct server_config* cfg;
+    int cpu;                    // CPU the loop is pinned to, or -1
+    int listenSocket;
+    int unixSocket;             // Shared by every loop, or -1
+    int epfd;
+    struct deadline_list deadlines[DEADLINE_KINDS];
+    pthread_t thread;
+};
+
+static inline void connClose(struct conn* c)
+{
+    connRelease(c);
+    close(c->fd);
+    connDetachShared(c);
+    metricsAdd(METRIC_CONNECTIONS_CLOSED, 1);
+    readerRelease(&c->reader);
+    free(c);
+}
+
+// Accept every pending connection on one of the loop's listening sockets
+static inline void loopAccept(struct event_loop* loop, int listenSocket)
+{
+    const struct server_config* cfg = loop->cfg;
+    while (1)
+    {
+        int connectionSocket = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connectionSocket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "%s: ERROR on accept: %s\n", cfg->name, strerror(errno));
+            }
+            return;
+        }
+
+        struct conn* c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            fprintf(stderr, "%s: out of memory for new connection\n", cfg->name);
+            close(connectionSocket);
+            continue;
+        }
+        connReset(c, connectionSocket);
+        if (connAdmit(c, cfg) < 0) {
+            connClose(c);
+            continue;
+        }
+        connEnableZerocopy(c, cfg);
+        c->unix_socket = listenSocket == loop->unixSocket;
+        c->events = EPOLLIN;
+        c->deadlines = loop->deadlines;
+        connArmDeadline(c);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connectionSocket, &ev) < 0) {
+            fprintf(stderr, "%s: ERROR adding connection to epoll: %s\n", cfg->name, strerror(errno));
+            connClose(c);
+        }
+    }
+}
+
+// Body of one event loop thread
+static void* eventLoopMain(void* arg)
+{
+    struct event_loop* loop = arg;
+    const struct server_config* cfg = loop->cfg;
+    struct epoll_event events[EPOLL_BATCH];
+    affinityPin(loop->cpu, cfg->name);
+
+    while (1)
+    {
+        int ready = epoll_wait(loop->epfd, events, EPOLL_BATCH, deadlineTimeout(loop->deadlines, DEADLINE_KINDS));
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: ERROR in epoll_wait: %s\n", cfg->name, strerror(errno));
+            return NULL;
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            // The listening sockets are registered with a NULL pointer and
+            // the Unix domain one with a pointer to its descriptor
+            struct conn* c = events[i].data.ptr;
+            if (c == NULL) {
+                loopAccept(loop, loop->listenSocket);
+                continue;
+            }
+            if (events[i].data.ptr == &loop->unixSocket) {
+                loopAccept(loop, loop->unixSocket);
+                continue;
+            }
+
+            int rc = connProgress(c, cfg);
+            if (rc != 0) {
+                connClose(c);
+                continue;
+            }
+
+            // Wait for room in the socket buffer while a reply is pending,
+            // for nothing but EPOLLERR while zero-copy completions are
+            // outstanding, otherwise for the next bytes of the request
+            uint32_t wanted = EPOLLIN;
+            if (c->replying) {
+                wanted = c->out_sent < c->header_len + c->out_len ? EPOLLOUT : 0;
+            }
+            if (wanted != c->events) {
+                struct epoll_event ev;
+                ev.events = wanted;
+                ev.data.ptr = c;
+                epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                c->events = wanted;
+            }
+        }
+
+        // Drop the connections that ran out of time for the phase they are in
+        if (deadlineNext(loop->deadlines, DEADLINE_KINDS) != 0) {
+            uint64_t now = deadlineClock();
+            struct deadline* d;
+            while ((d = deadlineExpired(loop->deadlines, DEADLINE_KINDS, now)) != NULL)
+            {
+                struct conn* c = connOfDeadline(d);
+                connTimedOut(c, cfg);
+                connClose(c);
+            }
+        }
+    }
+}
+
+/*
+* Start cfg->threads event loops, each with its own SO_REUSEPORT listening
+* socket on cfg->port, and run them until the process is killed. They all
+* watch the one Unix domain socket, each new connection waking just one.
+*/
+static inline void runEventLoops(const struct server_config* cfg)
+{
+    struct event_loop* loops = calloc(cfg->threads, sizeof(*loops));
+    if (loops == NULL) {
+        fprintf(stderr, "%s: could not allocate event loops\n", cfg->name);
+        exit(1);
+    }
+    int unixSocket = cfg->unix_path != NULL ? openUnixListenSocket(cfg, 1) : -1;
+
+    for (int i = 0; i < cfg->threads; i++)
+    {
+        loops[i].cfg = cfg;
+        loops[i].cpu = affinityCpu(&cfg->cpus, i);
+        deadlineInit(&loops[i].deadlines[DEADLINE_READ], (uint64_t)cfg->read_ms * 1000000);
+        deadlineInit(&loops[i].deadlines[DEADLINE_WRITE], (uint64_t)cfg->write_ms * 1000000);
+        // Accepting must never block the loop
+        loops[i].listenSocket = openListenSocket(cfg, 1, 1);
+        steerListenSocket(cfg, loops[i].listenSocket, i);
+        loops[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loops[i].epfd < 0) {
+            error("ERROR creating epoll instance");
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].listenSocket, &ev) < 0) {
+            error("ERROR adding listening socket to epoll");
+        }
+        loops[i].unixSocket = unixSocket;
+        if (unixSocket >= 0) {
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = &loops[i].unixSocket;
+            if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, unixSocket, &ev) < 0) {
+                error("ERROR adding Unix domain socket to epoll");
+            }
+        }
+    }
+    for (int i = 0; i < cfg->threads; i++)
+    {
+        int rc = pthread_create(&loops[i].thread, NULL, eventLoopMain, &loops[i]);
+        if (rc != 0) {
+            fprintf(stderr, "%s: could not start event loop thread: %s\n", cfg->name, strerror(rc));
+            exit(1);
+        }
+    }
+    for (int i = 0; i < cfg->threads; i++)
+    {
+        pthread_join(loops[i].thread, NULL);
+    }
+}
+
+/*
+* io_uring mode. As in epoll mode every thread runs its own loop with its
+* own SO_REUSEPORT listening socket, but instead of waiting for readiness
+* and then making a system call for every accept, recv and send, each loop
+* queues the operations themselves and reaps their results in batches with
+* one io_uring_enter():
+*   - a single multishot accept delivers every new connection
+*   - receives take a buffer from the ring's provided buffers only once data
+*     has arrived, and the bytes are appended to the connection's reader
+*   - each reply is one sendmsg, linked to the receive of the connection's
+*     next request, so a session costs no extra submission per request
+*   - connections on the Unix domain socket receive with recvmsg instead,
+*     which also takes the buffer from the ring but can pass shared memory
+*   - one timeout is kept queued for the first deadline to expire
+*   - a receive that finds every buffer in use waits until one is returned,
+*     or the timeout fires, before it is queued again
+* Large replies are not sent with MSG_ZEROCOPY in this mode.
+*/
+
+enum uring_op {
+    URING_ACCEPT = 1,
+    URING_RECV = 2,
+    URING_SEND = 3,
+    URING_ACCEPT_UNIX = 4,
+    URING_TIMER = 5
+};
+#define URING_OP_MASK 7
+
+struct uring_loop {
+    const struct server_config* cfg;
+    int cpu;                    // CPU the loop is pinned to, or -1
+    int listenSocket;
+    int unixSocket;             // Shared by every loop, or -1
+    struct otp_ring ring;
+    struct deadline_list deadlines[DEADLINE_KINDS];
+    struct __kernel_timespec timer_at;  // When the queued timeout fires
+    int timer_armed;            // A timeout is queued
+    uint64_t returned;          // Buffers handed back to the ring so far
+    uint64_t returned_at_wait;  // returned when the loop last waited for completions
+    struct conn* starved;       // Connections waiting for a buffer to receive into
+    pthread_t thread;
+};
+
+// Tag an operation's user_data with its connection and kind; conns are at least 8-byte aligned
+static inline uint64_t uringTag(struct conn* c, enum uring_op op)
+{
+    return (uint64_t)(uintptr_t)c | op;
+}
+
+static inline struct io_uring_sqe* uringSqe(struct uring_loop* loop)
+{
+    struct io_uring_sqe* sqe = otpRingSqe(&loop->ring);
+    if (sqe == NULL) {
+        fprintf(stderr, "%s: ERROR submitting to io_uring: %s\n", loop->cfg->name, strerror(errno));
+        exit(1);
+    }
+    return sqe;
+}
+
+static inline void uringArmAccept(struct uring_loop* loop, enum uring_op op)
+{
+    struct io_uring_sqe* sqe = uringSqe(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = op == URING_ACCEPT_UNIX ? loop->unixSocket : loop->listenSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = op;
+}
+
+static inline void uringArmRecv(struct uring_loop* loop, struct conn* c)
+{
+    struct io_uring_sqe* sqe = uringSqe(loop);
+    sqe->opcode = IORING_OP_RECV;
+    if (c->unix_socket) {
+        // With no iovec the provided buffer is used whole
+        memset(&c->recv_msg, 0, sizeof(c->recv_msg));
+        c->recv_msg.msg_control = c->recv_control.buf;
+        c->recv_msg.msg_controllen = sizeof(c->recv_control.buf);
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->addr = (uint64_t)(uintptr_t)&c->recv_msg;
+        sqe->msg_flags = MSG_CMSG_CLOEXEC;
+    }
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = loop->ring.buf_group;
+    sqe->user_data = uringTag(c, URING_RECV);
+    c->recv_armed = 1;
+}
+
+// Hand buffer bid back to the ring, so a starved receive can be queued again
+static inline void uringReturnBuffer(struct uring_loop* loop, unsigned bid)
+{
+    otpRingReturnBuffer(&loop->ring, bid);
+    loop->returned++;
+}
+
+/*
+* Park a connection whose receive found no free buffer. Its receive failed
+* after the loop last waited, so a buffer returned since then may already
+* be free again; one returned before is not.
+*/
+static inline void uringStarve(struct uring_loop* loop, struct conn* c)
+{
+    c->starved = 1;
+    c->starved_mark = loop->returned_at_wait;
+    c->starved_next = loop->starved;
+    loop->starved = c;
+}
+
+// Take a connection off the list of those waiting for a buffer
+static inline void uringUnstarve(struct uring_loop* loop, struct conn* c)
+{
+    struct conn** link = &loop->starved;
+    while (*link != c) {
+        link = &(*link)->starved_next;
+    }
+    *link = c->starved_next;
+    c->starved = 0;
+}
+
+/*
+* Receive again on the waiting connections a buffer has been returned for
+* since their receive failed, or on all of them if force is set. Without a
+* free buffer they would only fail again at once.
+*/
+static inline void uringFeedStarved(struct uring_loop* loop, int force)
+{
+    struct conn** link = &loop->starved;
+    while (*link != NULL)
+    {
+        struct conn* c = *link;
+        if (!force && loop->returned <= c->starved_mark) {
+            link = &c->starved_next;
+            continue;
+        }
+        *link = c->starved_next;
+        c->starved = 0;
+        if (!c->recv_armed && !c->sending) {
+            uringArmRecv(loop, c);
+        }
+    }
+}
+
+/*
+* Queue whatever is left of the reply. Unless the connection closes after
+* it or a receive is already waiting to be taken in, the receive of the
+* next request is linked behind it.
+*/
+static inline void uringSend(struct uring_loop* loop, struct conn* c)
+{
+    int iovcnt = 0;
+    if (c->out_sent < c->header_len) {
+        c->iov[iovcnt].iov_base = c->header + c->out_sent;
+        c->iov[iovcnt].iov_len = c->header_len - c->out_sent;
+        iovcnt++;
+    }
+    size_t outOffset = c->out_sent > c->header_len ? c->out_sent - c->header_len : 0;
+    if (outOffset < c->out_len) {
+        c->iov[iovcnt].iov_base = (char*)c->out + outOffset;
+        c->iov[iovcnt].iov_len = c->out_len - outOffset;
+        iovcnt++;
+    }
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = iovcnt;
+
+    struct io_uring_sqe* sqe = uringSqe(loop);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&c->msg;
+    // MSG_WAITALL makes a short send fail the link instead of starting the receive early
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = uringTag(c, URING_SEND);
+    c->sending = 1;
+    // A buffer already held has to be taken in first, or the next receive
+    // would overwrite it; the send's completion does that and receives again
+    if (!c->done && !c->recv_armed && !c->eof && c->held_bid < 0) {
+        sqe->flags |= IOSQE_IO_LINK;
+        uringArmRecv(loop, c);
+    }
+}
+
+/*
+* Queue a timeout for the first deadline to expire, unless one is queued
+* already. It fires no later than the shortest deadline from now, so no
+* deadline armed while it is queued can be due before it.
+*/
+static inline void uringArmTimer(struct uring_loop* loop)
+{
+    uint64_t next = deadlineNext(loop->deadlines, DEADLINE_KINDS);
+    if (loop->timer_armed || next == 0) {
+        return;
+    }
+    uint64_t shortest = 0;
+    for (int i = 0; i < DEADLINE_KINDS; i++)
+    {
+        uint64_t duration = loop->deadlines[i].duration_ns;
+        if (duration != 0 && (shortest == 0 || duration < shortest)) {
+            shortest = duration;
+        }
+    }
+    uint64_t latest = deadlineCoarseClock() + shortest;
+    if (next > latest) {
+        next = latest;
+    }
+    loop->timer_at.tv_sec = next / 1000000000ull;
+    loop->timer_at.tv_nsec = next % 1000000000ull;
+
+    struct io_uring_sqe* sqe = uringSqe(loop);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->timer_at;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = URING_TIMER;
+    loop->timer_armed = 1;
+}
+
+/*
+* Close the connection once nothing queued refers to it any more. Shutting
+* the socket down makes a receive that is still waiting complete.
+*/
+static inline void uringDrop(struct uring_loop* loop, struct conn* c)
+{
+    connRelease(c);
+    if (c->held_bid >= 0) {
+        uringReturnBuffer(loop, c->held_bid);
+        c->held_bid = -1;
+    }
+    if (c->starved) {
+        uringUnstarve(loop, c);
+    }
+    if (c->recv_armed || c->sending) {
+        if (!c->closing) {
+            c->closing = 1;
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        return;
+    }
+    connClose(c);
+}
+
+/*
+* Parse what the reader holds and either queue the reply, if a request is
+* complete, or a receive for more of it. Returns -1 if the client has to be
+* dropped.
+*/
+static inline int uringServe(struct uring_loop* loop, struct conn* c)
+{
+    const struct server_config* cfg = loop->cfg;
+    struct msg_reader* r = &c->reader;
+
+    if (readerParse(r, cfg) < 0) {
+        return -1;
+    }
+    if (r->phase == MSG_RESPONSE) {
+        connPrepareReply(c, cfg);
+        uringSend(loop, c);
+        return 0;
+    }
+    if (r->len > READER_MAX) {
+        fprintf(stderr, "%s: message from client is too long\n", cfg->name);
+        return -1;
+    }
+    // Take a buffer for all of an announced body at once, as readerReserve()
+    // does, so it counts against cfg->max_bytes from the start and is not
+    // copied again as it grows
+    if ((r->phase == MSG_BODY || r->phase == MSG_CHUNK) && r->need > r->cap && readerGrow(r, r->need, cfg) < 0) {
+        return -1;
+    }
+    // A closed socket will never deliver the rest of the message
+    if (c->eof) {
+        if (!(r->session && r->phase == MSG_HANDSHAKE && r->len == 0)) {
+            fprintf(stderr, "%s: client socket closed\n", cfg->name);
+        }
+        return -1;
+    }
+    if (!c->recv_armed) {
+        uringArmRecv(loop, c);
+    }
+    return 0;
+}
+
+// A receive completed. Returns -1 if the client has to be dropped.
+static inline int uringOnRecv(struct uring_loop* loop, struct conn* c, const struct io_uring_cqe* cqe)
+{
+    const struct server_config* cfg = loop->cfg;
+    c->recv_armed = 0;
+
+    if (cqe->res > 0)
+    {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (c->unix_socket && c->recv_msg.msg_controllen > 0) {
+            readerTakeFds(&c->reader, &c->recv_msg);
+        }
+        // The reply being sent may point into the reader's buffer, which
+        // must not move until the send is done
+        if (c->sending) {
+            c->held_bid = bid;
+            c->held_len = cqe->res;
+            return 0;
+        }
+        int rc = readerAppend(&c->reader, otpRingBuffer(&loop->ring, bid), cqe->res, cfg);
+        uringReturnBuffer(loop, bid);
+        if (rc < 0) {
+            return -1;
+        }
+        return uringServe(loop, c);
+    }
+    if (cqe->res == -ENOBUFS) {
+        // Queuing it again straight away would only spin until a buffer is
+        // free; a send still queued receives again once it completes
+        if (!c->sending) {
+            uringStarve(loop, c);
+        }
+        return 0;
+    }
+    if (cqe->res == 0) {
+        c->eof = 1;
+    } else if (cqe->res != -ECANCELED) {
+        // A cancelled receive was linked to a send that failed or fell short
+        fprintf(stderr, "%s: ERROR reading from socket: %s\n", cfg->name, strerror(-cqe->res));
+        return -1;
+    }
+    return c->sending ? 0 : uringServe(loop, c);
+}
+
+// A send completed. Returns -1 if the client has to be dropped.
+static inline int uringOnSend(struct uring_loop* loop, struct conn* c, const struct io_uring_cqe* cqe)
+{
+    const struct server_config* cfg = loop->cfg;
+    c->sending = 0;
+
+    if (cqe->res < 0) {
+        fprintf(stderr, "%s: ERROR writing to socket: %s\n", cfg->name, strerror(-cqe->res));
+        return -1;
+    }
+    c->out_sent += cqe->res;
+    metricsAdd(METRIC_BYTES_OUT, cqe->res);
+    if (c->out_sent < c->header_len + c->out_len) {
+        uringSend(loop, c);
+        return 0;
+    }
+    connReplySent(c);
+    if (c->done) {
+        return -1;
+    }
+
+    // On to the next request, which may already be in the reader or the held buffer
+    c->replying = 0;
+    readerNext(&c->reader, c->next);
+    connArmDeadline(c);
+    if (c->held_bid >= 0) {
+        int rc = readerAppend(&c->reader, otpRingBuffer(&loop->ring, c->held_bid), c->held_len, cfg);
+        uringReturnBuffer(loop, c->held_bid);
+        c->held_bid = -1;
+        if (rc < 0) {
+            return -1;
+        }
+    }
+    return uringServe(loop, c);
+}
+
+// A multishot accept produced a connection or an error
+static inline void uringOnAccept(struct uring_loop* loop, const struct io_uring_cqe* cqe, enum uring_op op)
+{
+    const struct server_config* cfg = loop->cfg;
+
+    // The kernel ends a multishot accept on errors; start a new one
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uringArmAccept(loop, op);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+            fprintf(stderr, "%s: ERROR on accept: %s\n", cfg->name, strerror(-cqe->res));
+        }
+        return;
+    }
+
+    struct conn* c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        fprintf(stderr, "%s: out of memory for new connection\n", cfg->name);
+        close(cqe->res);
+        return;
+    }
+    connReset(c, cqe->res);
+    c->held_bid = -1;
+    c->unix_socket = op == URING_ACCEPT_UNIX;
+    if (connAdmit(c, cfg) < 0) {
+        connClose(c);
+        return;
+    }
+    c->deadlines = loop->deadlines;
+    connArmDeadline(c);
+    if (uringServe(loop, c) < 0) {
+        uringDrop(loop, c);
+    }
+}
+
+// Body of one io_uring loop thread
+static void* uringLoopMain(void* arg)
+{
+    struct uring_loop* loop = arg;
+    const struct server_config* cfg = loop->cfg;
+    affinityPin(loop->cpu, cfg->name);
+
+    // Only the thread that created a ring may submit to it
+    if (otpRingInit(&loop->ring, URING_ENTRIES) < 0 ||
+        otpRingInitBuffers(&loop->ring, 0, URING_BUFFERS, URING_BUFFER_SIZE) < 0)
+    {
+        fprintf(stderr, "%s: ERROR setting up io_uring: %s\n", cfg->name, strerror(errno));
+        exit(1);
+    }
+    uringArmAccept(loop, URING_ACCEPT);
+    if (loop->unixSocket >= 0) {
+        uringArmAccept(loop, URING_ACCEPT_UNIX);
+    }
+
+    while (1)
+    {
+        uringArmTimer(loop);
+        loop->returned_at_wait = loop->returned;
+        if (otpRingSubmit(&loop->ring, 1) < 0 && errno != EBUSY && errno != EAGAIN) {
+            fprintf(stderr, "%s: ERROR in io_uring_enter: %s\n", cfg->name, strerror(errno));
+            return NULL;
+        }
+        struct io_uring_cqe* next;
+        while ((next = otpRingPeek(&loop->ring)) != NULL)
+        {
+            struct io_uring_cqe cqe = *next;
+            otpRingAdvance(&loop->ring);
+
+            enum uring_op op = cqe.user_data & URING_OP_MASK;
+            struct conn* c = (struct conn*)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_OP_MASK);
+            if (op == URING_ACCEPT || op == URING_ACCEPT_UNIX) {
+                uringOnAccept(loop, &cqe, op);
+                continue;
+            }
+            // Drop the connections that ran out of time for the phase they are in
+            if (op == URING_TIMER) {
+                loop->timer_armed = 0;
+                uint64_t now = deadlineClock();
+                struct deadline* d;
+                while ((d = deadlineExpired(loop->deadlines, DEADLINE_KINDS, now)) != NULL)
+                {
+                    c = connOfDeadline(d);
+                    connTimedOut(c, cfg);
+                    uringDrop(loop, c);
+                }
+                uringFeedStarved(loop, 1);
+                continue;
+            }
+
+            int rc;
+            if (c->closing) {
+                // Only waiting for the last operations to finish
+                if (op == URING_RECV) {
+                    c->recv_armed = 0;
+                    // Shared memory passed now is closed with the connection
+                    if (c->unix_socket && cqe.res > 0 && c->recv_msg.msg_controllen > 0) {
+                        readerTakeFds(&c->reader, &c->recv_msg);
+                    }
+                    if (cqe.flags & IORING_CQE_F_BUFFER) {
+                        uringReturnBuffer(loop, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                    }
+                } else {
+                    c->sending = 0;
+                }
+                rc = -1;
+            } else if (op == URING_RECV) {
+                rc = uringOnRecv(loop, c, &cqe);
+            } else {
+                rc = uringOnSend(loop, c, &cqe);
+            }
+            if (rc < 0) {
+                uringDrop(loop, c);
+            }
+        }
+        uringFeedStarved(loop, 0);
+    }
+}
+
+/*
+* Start cfg->threads io_uring loops, each with its own SO_REUSEPORT listening
+* socket on cfg->port and all accepting from the one Unix domain socket, and
+* run them until the process is killed. Returns -1
+* straight away, with errno set, if this kernel cannot run them.
+*/
+static inline int runUringLoops(const struct server_config* cfg)
+{
+    // Every loop needs multishot accept and provided buffer rings, which
+    // arrived together in Linux 5.19
+    struct otp_ring probe;
+    if (otpRingInit(&probe, 4) < 0) {
+        return -1;
+    }
+    if (otpRingInitBuffers(&probe, 0, 1, URING_BUFFER_SIZE) < 0) {
+        int saved = errno;
+        otpRingFree(&probe);
+        errno = saved;
+        return -1;
+    }
+    otpRingFree(&probe);
+
+    struct uring_loop* loops = calloc(cfg->threads, sizeof(*loops));
+    if (loops == NULL) {
+        fprintf(stderr, "%s: could not allocate io_uring loops\n", cfg->name);
+        exit(1);
+    }
+    int unixSocket = cfg->unix_path != NULL ? openUnixListenSocket(cfg, 0) : -1;
+    for (int i = 0; i < cfg->threads; i++)
+    {
+        loops[i].cfg = cfg;
+        loops[i].cpu = affinityCpu(&cfg->cpus, i);
+        loops[i].listenSocket = openListenSocket(cfg, 1, 0);
+        steerListenSocket(cfg, loops[i].listenSocket, i);
+        loops[i].unixSocket = unixSocket;
+        deadlineInit(&loops[i].deadlines[DEADLINE_READ], (uint64_t)cfg->read_ms * 1000000);
+        deadlineInit(&loops[i].deadlines[DEADLINE_WRITE], (uint64_t)cfg->write_ms * 1000000);
+    }
+    for (int i = 0; i < cfg->threads; i++)
+    {
+        int rc = pthread_create(&loops[i].thread, NULL, uringLoopMain, &loops[i]);
+        if (rc != 0) {
+            fprintf(stderr, "%s: could not start io_uring thread: %s\n", cfg->name, strerror(rc));
+            exit(1);
+        }
+    }
+    for (int i = 0; i < cfg->threads; i++)
+    {
+        pthread_join(loops[i].thread, NULL);
+    }
+    return 0;
+}
+
+/*
+* Parse the command line shared by both servers into cfg.
+* Exits with a usage message if it is malformed.
+*/
+static inline void parseServerArgs(int argc, char *argv[], struct server_config* cfg)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg->mode = MODE_POOL;
+    cfg->workers = DEFAULT_WORKERS;
+    cfg->threads = cpus > 0 ? (int)cpus : 1;
+    cfg->backlog = 0;
+    cfg->cipher_threads = cpus > 1 ? (int)cpus - 1 : 0;
+    cfg->parallel_min = OTP_PARALLEL_DEFAULT_MIN;
+    cfg->read_ms = DEFAULT_READ_TIMEOUT_MS;
+    cfg->write_ms = DEFAULT_WRITE_TIMEOUT_MS;
+    cfg->max_bytes = DEFAULT_MAX_BYTES;
+    cfg->max_conns = DEFAULT_MAX_CONNS;
+
+    int opt;
+    int bad = 0;
+    int limited = 0;
+    const char* keyDir = NULL;
+    while ((opt = getopt(argc, argv, "m:w:t:b:j:p:zk:a:T:u:R:W:c:B:A:J:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "pool") == 0) {
+                cfg->mode = MODE_POOL;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                cfg->mode = MODE_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                cfg->mode = MODE_URING;
+            } else {
+                bad = 1;
+            }
+            break;
+        case 'w':
+            cfg->workers = atoi(optarg);
+            break;
+        case 't':
+            cfg->threads = atoi(optarg);
+            break;
+        case 'b':
+            cfg->backlog = atoi(optarg);
+            break;
+        case 'j':
+            cfg->cipher_threads = atoi(optarg);
+            break;
+        case 'p':
+            cfg->parallel_min = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            cfg->zerocopy = 1;
+            break;
+        case 'k':
+            keyDir = optarg;
+            break;
+        case 'a':
+            cfg->admin_port = atoi(optarg);
+            bad |= cfg->admin_port < 1 || cfg->admin_port > 65535;
+            break;
+        case 'T':
+            cfg->trace_path = optarg;
+            break;
+        case 'u':
+            cfg->unix_path = optarg;
+            break;
+        case 'R':
+            cfg->read_ms = atoi(optarg);
+            break;
+        case 'W':
+            cfg->write_ms = atoi(optarg);
+            break;
+        case 'c':
+            cfg->max_conns = atoi(optarg);
+            limited = 1;
+            break;
+        case 'B':
+            cfg->max_bytes = strtoul(optarg, NULL, 10);
+            limited = 1;
+            break;
+        case 'A':
+            bad |= affinityParse(&cfg->cpus, optarg) < 0;
+            break;
+        case 'J':
+            bad |= affinityParse(&cfg->cipher_cpus, optarg) < 0;
+            break;
+        default:
+            bad = 1;
+            break;
+        }
+    }
+    if (cfg->backlog == 0) {
+        cfg->backlog = cfg->mode == MODE_POOL ? DEFAULT_BACKLOG : EVENT_BACKLOG;
+    }
+    // Each forked worker would count only its own buffer against -B, so a
+    // pool leaves admission to its workers and backlog, and says so rather
+    // than silently dropping limits it was given
+    if (cfg->mode == MODE_POOL) {
+        if (limited) {
+            fprintf(stderr, "%s: -c and -B need -m epoll or -m uring; a pool is bounded by -w and -b\n", cfg->name);
+            exit(1);
+        }
+        cfg->max_bytes = 0;
+    }
+    if (bad || optind != argc - 1 || cfg->workers < 1 || cfg->threads < 1 || cfg->backlog < 1 ||
+        cfg->cipher_threads < 0 || cfg->read_ms < 0 || cfg->write_ms < 0 || cfg->max_conns < 0)
+    {
+        fprintf(stderr, "USAGE: %s port [-m pool|epoll|uring] [-w workers] [-t threads] [-b backlog]"
+                " [-j cipher_threads] [-p parallel_min] [-z] [-k key_dir] [-a admin_port] [-T trace_file]"
+                " [-u socket_path] [-R read_ms] [-W write_ms] [-c max_conns] [-B max_bytes]"
+                " [-A cpus] [-J cpus]\n", argv[0]);
+        fprintf(stderr, "  cpus are CPUs and ranges like \"0-3,8\", or NUMA nodes like \"node0,node1\"\n");
+        fprintf(stderr, "  -c and -B apply to the epoll and uring modes only; a pool is bounded by -w and -b\n");
+        exit(1);
+    }
+    cfg->port = atoi(argv[optind]);
+
+    // Load the pads now so every worker and thread shares the same mappings
+    if (keyDir != NULL) {
+        cfg->keys = keystoreOpen(keyDir, cfg->name);
+    }
+    // The shards are shared with the workers, so they must exist before the pool forks
+    if (cfg->admin_port != 0) {
+        metricsInit(cfg->name);
+    }
+    if (cfg->trace_path != NULL) {
+        otp_trace_fd = open(cfg->trace_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (otp_trace_fd < 0) {
+            fprintf(stderr, "%s: ERROR opening trace file %s: %s\n", cfg->name, cfg->trace_path, strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+/*
+* Let an event loop server hold as many connections as -c admits: raise the
+* soft limit on descriptors to the hard one, and if that still leaves too few,
+* admit no more connections than leave some over, so accept() never fails for
+* want of one. -c 0 is left unlimited. A limit that cannot be read or raised
+* is reported and the server carries on with what it has.
+*/
+static inline void raiseFileLimit(struct server_config* cfg)
+{
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) < 0) {
+        fprintf(stderr, "%s: could not read the descriptor limit: %s\n", cfg->name, strerror(errno));
+        return;
+    }
+    if (files.rlim_cur < files.rlim_max) {
+        struct rlimit raised = files;
+        raised.rlim_cur = files.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+            files = raised;
+        } else {
+            fprintf(stderr, "%s: could not raise the descriptor limit from %llu to %llu: %s\n", cfg->name,
+                    (unsigned long long)files.rlim_cur, (unsigned long long)raised.rlim_cur, strerror(errno));
+        }
+    }
+    rlim_t need = (rlim_t)cfg->max_conns + FD_RESERVE + BUSY_MAX_CONNS;
+    if (cfg->max_conns != 0 && files.rlim_cur != RLIM_INFINITY && files.rlim_cur < need) {
+        int most = files.rlim_cur > FD_RESERVE + BUSY_MAX_CONNS ? (int)files.rlim_cur - FD_RESERVE - BUSY_MAX_CONNS : 1;
+        fprintf(stderr, "%s: only %llu descriptors available, admitting at most %d connections\n", cfg->name,
+                (unsigned long long)files.rlim_cur, most);
+        cfg->max_conns = most;
+    }
+}
+
+// Serve clients in the configured mode until the server is shut down
+static inline void runServer(struct server_config* cfg)
+{
+    // Clients that hang up early must not kill the server with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    otpParallelConfigure(cfg->cipher_threads, cfg->parallel_min);
+    otpParallelPlace(cfg->cipher_cpus.cpus, cfg->cipher_cpus.count);
+    if (cfg->admin_port != 0) {
+        metricsServeAdmin(cfg->admin_port, cfg->name);
+    }
+
+    if (cfg->mode != MODE_POOL) {
+        raiseFileLimit(cfg);
+    }
+    if (cfg->mode == MODE_URING) {
+        if (runUringLoops(cfg) == 0) {
+            return;
+        }
+        fprintf(stderr, "%s: io_uring is not available (%s), using epoll instead\n",
+                cfg->name, strerror(errno));
+    }
+    if (cfg->mode != MODE_POOL) {
+        runEventLoops(cfg);
+        return;
+    }
+    // Workers that wait on two listening sockets must not block in accept()
+    int unixSocket = cfg->unix_path != NULL ? openUnixListenSocket(cfg, 1) : -1;
+    int listenSocket = openListenSocket(cfg, 0, unixSocket >= 0);
+    runWorkerPool(listenSocket, unixSocket, cfg);
+    close(listenSocket);
+    if (unixSocket >= 0) {
+        close(unixSocket);
+        unlink(cfg->unix_path);
+    }
+}
+
+#endif
@@ -0,0 +1,269 @@
+/*
+* A small io_uring wrapper for the server's uring mode, written against the
+* raw system calls so the servers do not depend on liburing.
+* An otp_ring is one submission queue, one completion queue and one ring of
+* provided buffers that receives pick from as data arrives, so a connection
+* that is waiting for its next request holds no receive buffer of its own.
+* Each ring is used by a single thread.
+*/
+
+#ifndef OTP_URING_H
+#define OTP_URING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct otp_ring {
+    int fd;
+
+    // Submission queue, shared with the kernel
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    unsigned sqe_tail;          // Next SQE to hand out; published to sq_tail on submit
+    unsigned to_submit;         // SQEs handed out since the last submit
+
+    // Completion queue, shared with the kernel
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+
+    // Provided receive buffers
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_len;
+    char* bufs;
+    unsigned buf_count;         // A power of two
+    unsigned buf_size;
+    uint16_t buf_group;
+    uint16_t buf_tail;
+};
+
+static inline int otpRingSetup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int otpRingEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static inline int otpRingRegister(int fd, unsigned opcode, void* arg, unsigned nrArgs)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+// Release everything otpRingInit() and otpRingInitBuffers() set up
+static inline void otpRingFree(struct otp_ring* ring)
+{
+    if (ring->bufs != NULL) {
+        free(ring->bufs);
+    }
+    if (ring->buf_ring != NULL) {
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if (ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_len);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/*
+* Create a ring with room for entries submissions. Only this thread will
+* submit to it, which lets the kernel defer completion work until the thread
+* waits for it. Returns -1 with errno set if io_uring is unavailable.
+*/
+static inline int otpRingInit(struct otp_ring* ring, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(ring, 0, sizeof(*ring));
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring->fd = otpRingSetup(entries, &p);
+    // Kernels before 6.1 do not know these flags
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        ring->fd = otpRingSetup(entries, &p);
+    }
+    if (ring->fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        otpRingFree(ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // With IORING_FEAT_SINGLE_MMAP both queues live in one mapping
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_map_len > ring->sq_map_len) {
+        ring->sq_map_len = ring->cq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        otpRingFree(ring);
+        return -1;
+    }
+    ring->cq_map = ring->sq_map;
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        otpRingFree(ring);
+        return -1;
+    }
+
+    char* sq = ring->sq_map;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+
+    char* cq = ring->cq_map;
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// Hand queued submissions to the kernel and wait until at least waitFor have completed
+static inline int otpRingSubmit(struct otp_ring* ring, unsigned waitFor)
+{
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    while (1)
+    {
+        int rc = otpRingEnter(ring->fd, ring->to_submit, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (rc >= 0) {
+            ring->to_submit -= (unsigned)rc < ring->to_submit ? (unsigned)rc : ring->to_submit;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Get a cleared SQE to fill in, submitting what is queued first if the queue is full
+static inline struct io_uring_sqe* otpRingSqe(struct otp_ring* ring)
+{
+    while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        if (otpRingSubmit(ring, 0) < 0 && errno != EBUSY && errno != EAGAIN) {
+            return NULL;
+        }
+    }
+    unsigned index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+// The oldest completion not yet consumed, or NULL if there is none
+static inline struct io_uring_cqe* otpRingPeek(struct otp_ring* ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+// Give the completion returned by otpRingPeek() back to the kernel
+static inline void otpRingAdvance(struct otp_ring* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Hand buffer bid back to the kernel for another receive
+static inline void otpRingReturnBuffer(struct otp_ring* ring, unsigned bid)
+{
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * ring->buf_size);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// The data a receive left in buffer bid
+static inline char* otpRingBuffer(struct otp_ring* ring, unsigned bid)
+{
+    return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+/*
+* Register count buffers of size bytes each (count a power of two) as
+* buffer group group, for receives submitted with IOSQE_BUFFER_SELECT.
+* Returns -1 with errno set if the kernel has no provided buffer rings.
+*/
+static inline int otpRingInitBuffers(struct otp_ring* ring, uint16_t group, unsigned count, unsigned size)
+{
+    ring->buf_ring_len = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+    ring->bufs = malloc((size_t)count * size);
+    if (ring->bufs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_group = group;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (otpRingRegister(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (unsigned bid = 0; bid < count; bid++)
+    {
+        otpRingReturnBuffer(ring, bid);
+    }
+    return 0;
+}
+
+#endif